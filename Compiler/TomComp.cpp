@@ -17,7 +17,8 @@
 // TomBasicCompiler
 
 TomBasicCompiler::TomBasicCompiler (TomVM& vm, bool caseSensitive)
-         : m_vm (vm), m_caseSensitive (caseSensitive), m_syntax(LS_BASIC4GL) {
+         : m_vm (vm), m_caseSensitive (caseSensitive), m_identLexCount (0), m_syntax(LS_BASIC4GL), m_registerCode (true),
+           m_compiledCodeSize (0), m_compiledFunctions (0), m_compiledConstants (0), m_compiledRegisterCode (true) {
     ClearState ();
 
     // Setup operators
@@ -86,6 +87,8 @@ TomBasicCompiler::TomBasicCompiler (TomVM& vm, bool caseSensitive)
 void TomBasicCompiler::ClearState () {
     m_regType   = VTP_INT;
     m_reg2Type  = VTP_INT;
+    m_regVar    = -1;
+    m_varLoad   = -1;
     m_freeTempData = false;
     m_operandStack.clear ();
     m_operatorStack.clear ();
@@ -108,11 +111,230 @@ bool TomBasicCompiler::Compile () {
     m_programConstants.clear ();
     m_labels.clear ();
     m_labelIndex.clear ();
+    m_forLoops.clear ();
+    m_indexChecks.clear ();
+    m_arraySizes.clear ();
+    m_aliasedVars.clear ();
+    m_readLoads.clear ();
+    m_checkpoints.clear ();
+    m_labelOrder.clear ();
+    m_constantOrder.clear ();
+    m_aliasedVarOrder.clear ();
+    m_arraySizeChanges.clear ();
     InternalCompile ();
+    FinishCompile ();
 
     return !Error ();
 }
 
+bool TomBasicCompiler::Recompile () {
+
+    // Find first source line changed since the last compile
+    StringVector& source = m_parser.SourceCode ();
+    unsigned int line = 0;
+    while (     line < source.size ()
+            &&  line < m_compiledSource.size ()
+            &&  source [line] == m_compiledSource [line])
+        line++;
+
+    // Find last checkpoint before it
+    int i = m_checkpoints.size () - 1;
+    while (i >= 0 && m_checkpoints [i].m_token.m_line >= line)
+        i--;
+
+    // Compile from scratch if there is none, or if the program has been
+    // changed since (e.g. by TempCompileExpression), or if anything that
+    // affects how the unchanged lines compile has changed.
+    if (    i < 0
+        ||  m_vm.InstructionCount () != m_compiledCodeSize
+        ||  m_functions.size () != m_compiledFunctions
+        ||  m_constants.size () != m_compiledConstants
+        ||  m_registerCode != m_compiledRegisterCode)
+        return Compile ();
+
+    // Roll back to checkpoint and compile the rest of the program
+    m_checkpoints.erase (m_checkpoints.begin () + i + 1, m_checkpoints.end ());
+    RestoreCheckpoint (m_checkpoints.back (), line);
+    CompileInstructions ();
+    FinishCompile ();
+
+    return !Error ();
+}
+
+void TomBasicCompiler::FinishCompile () {
+
+    // Keep a copy of the program as compiled, for Recompile to roll back to.
+    // (The following passes modify instructions and move labels.)
+    m_vm.CopyProgram (m_rawCode, m_rawLines);
+    m_rawLabels             = m_labels;
+    m_rawLabelIndex         = m_labelIndex;
+    m_rawVarTypes.clear ();
+    for (int i = 0; i < m_vm.Variables ().Size (); i++)
+        m_rawVarTypes.push_back (m_vm.Variables ().Variables () [i].m_type);
+    m_compiledSource        = m_parser.SourceCode ();
+    m_compiledFunctions     = m_functions.size ();
+    m_compiledConstants     = m_constants.size ();
+    m_compiledRegisterCode  = m_registerCode;
+
+    if (!Error ()) {
+
+        // Remove array bounds checks that can never fail
+        RemoveBoundsChecks ();
+
+        // Defer whole array copies until the arrays are next accessed
+        UseCopyOnWrite ();
+
+        // Replace common instruction sequences with superinstructions
+        FuseInstructions ();
+    }
+
+    m_compiledCodeSize = m_vm.InstructionCount ();
+}
+
+void TomBasicCompiler::AddCheckpoint () {
+    compCheckpoint c;
+    c.m_token                   = m_token;
+    c.m_parserLine              = m_parser.Line ();
+    c.m_parserCol               = m_parser.Col ();
+    c.m_codeSize                = m_vm.InstructionCount ();
+    c.m_variableCount           = m_vm.Variables ().Size ();
+    c.m_strucCount              = m_vm.DataTypes ().Structures ().size ();
+    c.m_fieldCount              = m_vm.DataTypes ().Fields ().size ();
+    c.m_storedTypeCount         = m_vm.StoredTypeCount ();
+    c.m_programDataSize         = m_vm.ProgramData ().size ();
+    c.m_stringConstantCount     = m_vm.StringConstants ().size ();
+    c.m_regType                 = m_regType;
+    c.m_reg2Type                = m_reg2Type;
+    c.m_regVar                  = m_regVar;
+    c.m_varLoad                 = m_varLoad;
+    c.m_varLoadRead             = m_readLoads.find (m_varLoad) != m_readLoads.end ();
+    c.m_freeTempData            = m_freeTempData;
+    c.m_lastLine                = m_lastLine;
+    c.m_lastCol                 = m_lastCol;
+    c.m_syntax                  = m_syntax;
+    c.m_flowControl             = m_flowControl;
+    for (unsigned int i = 0; i < m_flowControl.size (); i++)
+        if (m_flowControl [i].m_forLoop >= 0)
+            c.m_forLoopRanged.push_back (m_forLoops [m_flowControl [i].m_forLoop].m_ranged);
+    c.m_jumpCount               = m_jumps.size ();
+    c.m_resetCount              = m_resets.size ();
+    c.m_forLoopCount            = m_forLoops.size ();
+    c.m_indexCheckCount         = m_indexChecks.size ();
+    c.m_labelCount              = m_labelOrder.size ();
+    c.m_constantCount           = m_constantOrder.size ();
+    c.m_aliasedVarCount         = m_aliasedVarOrder.size ();
+    c.m_arraySizeChangeCount    = m_arraySizeChanges.size ();
+    m_checkpoints.push_back (c);
+}
+
+void TomBasicCompiler::RestoreCheckpoint (compCheckpoint& c, unsigned int changedLine) {
+
+    // Roll program back. Code is restored from the copy made before the post-
+    // compile passes.
+    m_vm.RestoreProgram (m_rawCode, m_rawLines, c.m_codeSize);
+    m_vm.Variables ().Truncate (c.m_variableCount);
+    for (int i = 0; i < c.m_variableCount; i++)
+        m_vm.Variables ().Variables () [i].m_type = m_rawVarTypes [i];
+    m_vm.DataTypes ().Truncate (c.m_strucCount, c.m_fieldCount);
+    m_vm.TruncateStoredTypes (c.m_storedTypeCount);
+    m_vm.ProgramData ().erase (m_vm.ProgramData ().begin () + c.m_programDataSize, m_vm.ProgramData ().end ());
+    m_vm.StringConstants ().erase (m_vm.StringConstants ().begin () + c.m_stringConstantCount, m_vm.StringConstants ().end ());
+
+    // Remove labels declared since
+    m_labels     = m_rawLabels;
+    m_labelIndex = m_rawLabelIndex;
+    while (m_labelOrder.size () > c.m_labelCount) {
+        std::string& name = m_labelOrder.back ();
+        compLabelIndex::iterator i = m_labelIndex.find (m_labels [name].m_offset);
+        if (i != m_labelIndex.end () && (*i).second == name)
+            m_labelIndex.erase (i);
+        m_labels.erase (name);
+        m_labelOrder.pop_back ();
+    }
+
+    // The last label declared before the checkpoint may share its offset with
+    // a removed one, which replaced it in the index
+    if (!m_labelOrder.empty ()) {
+        compLabel& label = m_labels [m_labelOrder.back ()];
+        m_labelIndex [label.m_offset] = m_labelOrder.back ();
+    }
+
+    // Undo constant declarations and bounds check elimination information
+    while (m_constantOrder.size () > c.m_constantCount) {
+        m_programConstants.erase (m_constantOrder.back ());
+        m_constantOrder.pop_back ();
+    }
+    while (m_aliasedVarOrder.size () > c.m_aliasedVarCount) {
+        m_aliasedVars.erase (m_aliasedVarOrder.back ());
+        m_aliasedVarOrder.pop_back ();
+    }
+    while (m_arraySizeChanges.size () > c.m_arraySizeChangeCount) {
+        compArraySizeChange& change = m_arraySizeChanges.back ();
+        if (change.m_existed)   m_arraySizes [change.m_var] = change.m_sizes;
+        else                    m_arraySizes.erase (change.m_var);
+        m_arraySizeChanges.pop_back ();
+    }
+    m_readLoads.erase (m_readLoads.lower_bound (c.m_codeSize), m_readLoads.end ());
+    if (c.m_varLoad >= 0) {
+        if (c.m_varLoadRead)    m_readLoads.insert (c.m_varLoad);
+        else                    m_readLoads.erase (c.m_varLoad);
+    }
+
+    // Restore compiler state
+    m_jumps.erase (m_jumps.begin () + c.m_jumpCount, m_jumps.end ());
+    m_resets.erase (m_resets.begin () + c.m_resetCount, m_resets.end ());
+    m_forLoops.erase (m_forLoops.begin () + c.m_forLoopCount, m_forLoops.end ());
+    m_indexChecks.erase (m_indexChecks.begin () + c.m_indexCheckCount, m_indexChecks.end ());
+    m_flowControl = c.m_flowControl;
+    int loop = 0;
+    for (unsigned int i = 0; i < m_flowControl.size (); i++)
+        if (m_flowControl [i].m_forLoop >= 0)
+            m_forLoops [m_flowControl [i].m_forLoop].m_ranged = c.m_forLoopRanged [loop++];
+    m_operandStack.clear ();
+    m_operatorStack.clear ();
+    m_regType       = c.m_regType;
+    m_reg2Type      = c.m_reg2Type;
+    m_regVar        = c.m_regVar;
+    m_varLoad       = c.m_varLoad;
+    m_freeTempData  = c.m_freeTempData;
+    m_lastLine      = c.m_lastLine;
+    m_lastCol       = c.m_lastCol;
+    m_syntax        = c.m_syntax;
+
+    // Resume parsing after the checkpoint's token. Lines before the changed
+    // line are not lexed again.
+    ClearError ();
+    m_parser.ResetFrom (changedLine);
+    m_parser.SetPos (c.m_parserLine, c.m_parserCol);
+    m_token = c.m_token;
+}
+
+void TomBasicCompiler::VarAliased (int var) {
+
+    // Variable has had its address taken
+    if (var >= 0 && m_aliasedVars.insert (var).second)
+        m_aliasedVarOrder.push_back (var);
+}
+
+void TomBasicCompiler::FuseInstructions () {
+
+    // Labels are entry points (in addition to jump and gosub destinations)
+    std::vector<unsigned int> entryPoints, offsetMap;
+    compLabelIndex::iterator i;
+    for (i = m_labelIndex.begin (); i != m_labelIndex.end (); i++)
+        entryPoints.push_back ((*i).first);
+
+    m_vm.FuseInstructions (entryPoints, offsetMap);
+
+    // Update label offsets
+    compLabelIndex oldIndex;
+    oldIndex.swap (m_labelIndex);
+    for (i = oldIndex.begin (); i != oldIndex.end (); i++)
+        m_labelIndex [offsetMap [(*i).first]] = (*i).second;
+    for (compLabelMap::iterator j = m_labels.begin (); j != m_labels.end (); j++)
+        (*j).second.m_offset = offsetMap [(*j).second.m_offset];
+}
+
 bool TomBasicCompiler::CheckParser () {
     // Check parser for error
     // Copy error state (if any)
@@ -124,6 +346,46 @@ bool TomBasicCompiler::CheckParser () {
     return true;
 }
 
+static std::string ConstantText (compConstant& c) {
+
+    // Return text value of constant
+    switch (c.m_valType) {
+    case VTP_INT:       return IntToString (c.m_intVal);
+    case VTP_REAL:      return RealToString (c.m_realVal);
+    case VTP_STRING:    return c.m_stringVal;
+    default:            return "";
+    }
+}
+
+void TomBasicCompiler::ClassifyText (std::string& text, compIdentClass& c) {
+    c.m_classified = true;
+
+    // Apply case sensitivity
+    c.m_text = m_caseSensitive ? text : LowerCase (text);
+
+    // Match against reserved keywords
+    if (m_reservedWords.find (c.m_text) != m_reservedWords.end ())
+        c.m_type = CTT_KEYWORD;
+
+    // Match against external functions
+    else if (IsFunction (c.m_text))
+        c.m_type = CTT_FUNCTION;
+
+    else {
+
+        // Match against permanent constants.
+        // Text is replaced with the text value of the constant.
+        compConstantMap::iterator smi = m_constants.find (c.m_text);
+        if (smi != m_constants.end ()) {
+            c.m_type    = CTT_CONSTANT;
+            c.m_text    = ConstantText ((*smi).second);
+            c.m_valType = (*smi).second.m_valType;
+        }
+        else
+            c.m_type    = CTT_TEXT;
+    }
+}
+
 bool TomBasicCompiler::GetToken (bool skipEOL, bool dataMode) {
 
     // Read a token
@@ -134,49 +396,34 @@ bool TomBasicCompiler::GetToken (bool skipEOL, bool dataMode) {
     // Text token processing
     if (m_token.m_type == CTT_TEXT) {
 
-        // Apply case sensitivity
-        if (!m_caseSensitive)
-            m_token.m_text = LowerCase (m_token.m_text);
-
-        // Match against reserved keywords
-        compStringSet::iterator si = m_reservedWords.find (m_token.m_text);
-        if (si != m_reservedWords.end ())
-            m_token.m_type = CTT_KEYWORD;
-
-        // Match against external functions
-        else if (IsFunction (m_token.m_text))
-            m_token.m_type = CTT_FUNCTION;
-
-        else {
-
-            // Match against constants
-
-            // Try permanent constants first
-            bool isConstant;
-            compConstantMap::iterator smi = m_constants.find (m_token.m_text);
-            isConstant = smi != m_constants.end ();
-
-            // Otherwise try program constants
-            if (!isConstant) {
-                smi = m_programConstants.find (m_token.m_text);
-                isConstant = smi != m_programConstants.end ();
+        // Match against reserved words, functions and permanent constants.
+        // Identifiers read from the source code are interned by the parser, so
+        // each distinct identifier is only matched once, and the result cached
+        // by its identifier index.
+        compIdentClass temp, *c = &temp;
+        if (m_token.m_ident >= 0) {
+            if (m_identLexCount != m_parser.LexCount ()) {
+                m_identClasses.clear ();
+                m_identLexCount = m_parser.LexCount ();
             }
-
-            if (isConstant) {
-                m_token.m_type      = CTT_CONSTANT;             // Replace token with constant
-
-                // Replace text with text value of constant
-                switch ((*smi).second.m_valType) {
-                case VTP_INT:
-                    m_token.m_text = IntToString ((*smi).second.m_intVal);
-                    break;
-                case VTP_REAL:
-                    m_token.m_text = RealToString ((*smi).second.m_realVal);
-                    break;
-                case VTP_STRING:
-                    m_token.m_text = (*smi).second.m_stringVal;
-                    break;
-                }
+            if (m_token.m_ident >= (int) m_identClasses.size ())
+                m_identClasses.resize (m_parser.IdentifierCount ());
+            c = &m_identClasses [m_token.m_ident];
+        }
+        if (!c->m_classified)
+            ClassifyText (m_token.m_text, *c);
+        m_token.m_type = c->m_type;
+        m_token.m_text = c->m_text;
+        if (c->m_type == CTT_CONSTANT)
+            m_token.m_valType = c->m_valType;
+
+        // Otherwise try program constants.
+        // (Not cached, as these are declared during compilation.)
+        if (m_token.m_type == CTT_TEXT && !m_programConstants.empty ()) {
+            compConstantMap::iterator smi = m_programConstants.find (m_token.m_text);
+            if (smi != m_programConstants.end ()) {
+                m_token.m_type      = CTT_CONSTANT;
+                m_token.m_text      = ConstantText ((*smi).second);
                 m_token.m_valType   = (*smi).second.m_valType;
             }
         }
@@ -215,9 +462,21 @@ void TomBasicCompiler::InternalCompile () {
     if (!GetToken (true))
         return;
 
-    // Compile code
-    while (!m_parser.Eof () && CompileInstruction ())
-        ;
+    CompileInstructions ();
+}
+
+void TomBasicCompiler::CompileInstructions () {
+
+    // Compile code.
+    // Checkpoints are added at the start of lines for Recompile.
+    while (!m_parser.Eof ()) {
+        if (    m_token.m_newLine
+            &&  !m_parser.Special ()
+            &&  (m_checkpoints.empty () || m_token.m_line >= m_checkpoints.back ().m_token.m_line + TC_CHECKPOINTLINES))
+            AddCheckpoint ();
+        if (!CompileInstruction ())
+            break;
+    }
 
     // Terminate program
     AddInstruction (OP_END, VTP_INT, vmValue ());
@@ -233,8 +492,10 @@ void TomBasicCompiler::InternalCompile () {
 
             // Point token to goto instruction, so that it will be displayed
             // if there is an error.
-            m_token.m_line = instr.m_sourceLine;
-            m_token.m_col  = instr.m_sourceChar;
+            int line, col;
+            m_vm.GetSourcePos ((*i).m_jumpInstruction, line, col);
+            m_token.m_line = line;
+            m_token.m_col  = col;
 
             // Label must exist
             if (!LabelExists ((*i).m_labelName)) {
@@ -255,8 +516,10 @@ void TomBasicCompiler::InternalCompile () {
 
             // Point token to reset instruction, so that it will be displayed
             // if there is an error.
-            m_token.m_line = instr.m_sourceLine;
-            m_token.m_col  = instr.m_sourceChar;
+            int line, col;
+            m_vm.GetSourcePos ((*i).m_jumpInstruction, line, col);
+            m_token.m_line = line;
+            m_token.m_col  = col;
 
             // Label must exist
             if (!LabelExists ((*i).m_labelName)) {
@@ -295,9 +558,12 @@ void TomBasicCompiler::InternalCompile () {
 }
 
 void TomBasicCompiler::AddInstruction (vmOpCode opCode, vmBasicValType type, const vmValue& val) {
+    AddInstruction (opCode, type, val, m_token.m_line, m_token.m_col);
+}
+
+void TomBasicCompiler::AddInstruction (vmOpCode opCode, vmBasicValType type, const vmValue& val, unsigned int line, unsigned int col) {
 
     // Add instruction, and include source code position audit
-    unsigned int line = m_token.m_line, col = m_token.m_col;
 
     // Prevent line and col going backwards. (Debugging tools rely on source-
     // offsets never decreasing as source code is traversed.)
@@ -305,7 +571,7 @@ void TomBasicCompiler::AddInstruction (vmOpCode opCode, vmBasicValType type, con
         line = m_lastLine;
         col  = m_lastCol;
     }
-    m_vm.AddInstruction (vmInstruction (opCode, type, val, line, col));
+    m_vm.AddInstruction (vmInstruction (opCode, type, val), line, col);
     m_lastLine = line;
     m_lastCol  = col;
 }
@@ -330,6 +596,10 @@ bool TomBasicCompiler::CompileInstruction () {
         // Create new label
         AddLabel (m_token.m_text, compLabel (m_vm.InstructionCount (), m_vm.ProgramData ().size ()));
 
+        // Code after a label can be reached from anywhere, so the loop
+        // variables of enclosing "for" loops can have any value.
+        ClearForLoopRanges ();
+
         // Skip label
         if (!GetToken ())
             return false;
@@ -343,6 +613,13 @@ bool TomBasicCompiler::CompileInstruction () {
         if (!CompileDim (false))
             return false;
     }
+    else if (m_token.m_text == "redim" && m_vm.Variables ().GetVar ("redim") < 0) {
+
+        // (REDIM is not a reserved word, so that existing programs that use
+        // it as a variable name still compile.)
+        if (!CompileDim (false, true))
+            return false;
+    }
     else if (m_token.m_text == "goto") {
         if (!GetToken ())
             return false;
@@ -551,11 +828,16 @@ bool TomBasicCompiler::CompileStructure () {
     if (!GetToken ())                                   // Skip structure name
         return false;
 
+    // Optional FIELDMAJOR stores arrays of the structure one field at a time
+    bool fieldMajor = m_token.m_text == "fieldmajor";
+    if (fieldMajor && !GetToken ())
+        return false;
+
     if (!SkipSeparators ())                             // Require : or new line
         return false;
 
     // Create structure
-    m_vm.DataTypes ().NewStruc (name);
+    m_vm.DataTypes ().NewStruc (name).m_fieldMajor = fieldMajor;
 
     // Expect at least one field
     if (m_token.m_text == "endstruc" || m_token.m_text == "end") {
@@ -609,10 +891,10 @@ bool TomBasicCompiler::CompileStructure () {
     return true;
 }
 
-bool TomBasicCompiler::CompileDim (bool forStruc) {
+bool TomBasicCompiler::CompileDim (bool forStruc, bool reDim) {
 
-    // Skip optional DIM
-    if (m_token.m_text == "dim")
+    // Skip optional DIM (or REDIM)
+    if (m_token.m_text == (reDim ? "redim" : "dim"))
         if (!GetToken ())
             return false;
 
@@ -657,12 +939,26 @@ bool TomBasicCompiler::CompileDim (bool forStruc) {
                 SetError ("Structure cannot contain an element of its own type");
                 return false;
             }
+            if (struc.m_fieldMajor && type.m_pointerLevel == 0 && (type.m_arrayLevel > 0 || type.m_basicType >= 0)) {
+                SetError ("Field major structure fields must be single values (not arrays or structures)");
+                return false;
+            }
+            if (struc.m_fieldMajor && struc.m_fieldCount >= VM_MAXFIELDMAJORFIELDS) {
+                SetError ("Too many fields in field major structure");
+                return false;
+            }
 
             // Add field to structure
             m_vm.DataTypes ().NewField (name, type);
         }
         else {
 
+            // REDIM can only resize arrays
+            if (reDim && (type.m_pointerLevel > 0 || type.m_arrayLevel == 0)) {
+                SetError ((std::string) "REDIM can only be used with arrays. '" + name + "' is not an array");
+                return false;
+            }
+
             // Regular DIM.
             // Check if variable has already been DIMmed. (This is allowed, but
             // only if DIMed to the same type.)
@@ -680,14 +976,30 @@ bool TomBasicCompiler::CompileDim (bool forStruc) {
                 // Create new variable
                 varIndex = m_vm.Variables ().NewVar (name, type);
 
-            // Generate code to allocate variable data
+            // Record array dimension sizes (for bounds check elimination).
+            // (The smallest size is recorded, as REDIM can shrink arrays.)
+            if (type.PhysicalPointerLevel () == 0 && type.m_arrayLevel > 0) {
+                compArraySizeMap::iterator i = m_arraySizes.find (varIndex);
+                if (i == m_arraySizes.end ()) {
+                    m_arraySizeChanges.push_back (compArraySizeChange (varIndex, false, std::vector<vmInt> ()));
+                    m_arraySizes [varIndex] = m_dimSizes;
+                }
+                else {
+                    m_arraySizeChanges.push_back (compArraySizeChange (varIndex, true, (*i).second));
+                    for (unsigned int d = 0; d < m_dimSizes.size (); d++)
+                        if (m_dimSizes [d] < 0 || m_dimSizes [d] < (*i).second [d])
+                            (*i).second [d] = m_dimSizes [d];
+                }
+            }
+
+            // Generate code to allocate (or resize) variable data
             // Note:    Opcode contains the index of the variable. Variable type
             //          and size data is stored in the variable entry.
-            AddInstruction (OP_DECLARE, VTP_INT, vmValue (varIndex));
+            AddInstruction (reDim ? OP_REDIM : OP_DECLARE, VTP_INT, vmValue (varIndex));
 
             // If this was an array and not a pointer, then its array indices
             // will have been pushed to the stack.
-            // The DECLARE operator automatically removes them however
+            // The DECLARE and REDIM operators automatically remove them however
             if (type.PhysicalPointerLevel() == 0)
                 for (int i = 0; i < type.m_arrayLevel; i++)
                     m_operandStack.pop_back ();
@@ -700,6 +1012,7 @@ bool TomBasicCompiler::CompileDimField (std::string& name, vmValType& type, bool
 
     type = VTP_UNDEFINED;
     name = "";
+    m_dimSizes.clear ();
 
     // Look for structure type
     if (m_token.m_type == CTT_TEXT) {
@@ -786,7 +1099,19 @@ bool TomBasicCompiler::CompileDimField (std::string& name, vmValType& type, bool
             // Here we generate code to calculate the dimension size and push it to
             // stack.
             else {
-                if (!(CompileExpression () && CompileConvert (VTP_INT) && CompilePush ()))
+                unsigned int start = m_vm.InstructionCount ();
+                if (!(CompileExpression () && CompileConvert (VTP_INT)))
+                    return false;
+
+                // Record size if dimension is a constant
+                if (    m_vm.InstructionCount () == start + 1
+                    &&  m_vm.Instruction (start).m_opCode == OP_LOAD_CONST
+                    &&  m_vm.Instruction (start).m_type == VTP_INT)
+                    m_dimSizes.push_back (m_vm.Instruction (start).m_value.IntVal () + 1);
+                else
+                    m_dimSizes.push_back (-1);
+
+                if (!CompilePush ())
                     return false;
                 type.m_arrayLevel++;
             }
@@ -875,6 +1200,7 @@ bool TomBasicCompiler::CompileLoadVar () {
         return false;
 
     // Generate code to load variable
+    int load = m_vm.InstructionCount ();
     AddInstruction (OP_LOAD_VAR, VTP_INT, vmValue (varIndex));
 
     // Register now contains a pointer to variable
@@ -887,7 +1213,11 @@ bool TomBasicCompiler::CompileLoadVar () {
         return false;
 
     // Compile data lookups (e.g. ".fieldname", array indices, take address e.t.c)
-    return CompileDataLookup (takeAddress);
+    m_regVar = varIndex;
+    if (!CompileDataLookup (takeAddress))
+        return false;
+    m_varLoad = load;
+    return true;
 }
 
 bool TomBasicCompiler::CompileDerefs () {
@@ -949,9 +1279,17 @@ bool TomBasicCompiler::CompileDataLookup (bool takeAddress) {
     //  * Taking address:           &data
     // Or any combination of the above.
 
+    // Array variable being indexed (if any), for bounds check elimination.
+    // Pointers to arrays are excluded, as they can point to any size array.
+    int array = -1, dimension = 0;
+    if (m_regVar >= 0 && m_vm.Variables ().Variables () [m_regVar].m_type.PhysicalPointerLevel () == 0)
+        array = m_regVar;
+
     bool done = false;
     while (!done) {
         if (m_token.m_text == ".") {
+            array = -1;
+            m_regVar = -1;
 
             // Lookup subfield
             // Register must contain a structure type
@@ -1006,8 +1344,17 @@ bool TomBasicCompiler::CompileDataLookup (bool takeAddress) {
                 return false;
             }
 
+            // Generate code to push array address
+            if (!CompilePush ())
+                return false;
+            vmValType arrayType = m_regType;
+
+            // Multi-dimensional arrays are indexed in a single step, so each
+            // index except the last is pushed after it is evaluated.
+            int indices = 0;
+            std::vector<compIndexCheck> checks;
             do {
-                if (m_regType.m_arrayLevel == 0) {
+                if (arrayType.m_arrayLevel == indices) {
                     SetError ("Unexpected ','");
                     return false;
                 }
@@ -1016,11 +1363,12 @@ bool TomBasicCompiler::CompileDataLookup (bool takeAddress) {
                 if (!GetToken ())                   // Skip "(" or ","
                     return false;
 
-                // Generate code to push array address
-                if (!CompilePush ())
+                // Generate code to push previous index
+                if (indices > 0 && !CompilePush ())
                     return false;
 
                 // Evaluate array index, and convert to an integer.
+                unsigned int indexStart = m_vm.InstructionCount ();
                 if (!CompileExpression ())
                     return false;
                 if (!CompileConvert (VTP_INT)) {
@@ -1028,27 +1376,119 @@ bool TomBasicCompiler::CompileDataLookup (bool takeAddress) {
                     return false;
                 }
 
-                // Generate code to pop array address into reg2
+                // Find loop variable if the index is a simple variable
+                int indexVar = -1;
+                if (    m_vm.InstructionCount () == indexStart + 2
+                    &&  m_vm.Instruction (indexStart).m_opCode == OP_LOAD_VAR
+                    &&  m_vm.Instruction (indexStart + 1).m_opCode == OP_DEREF)
+                    indexVar = m_vm.Instruction (indexStart).m_value.IntVal ();
+
+                // Record bounds check if indexing an array variable with the
+                // variable of an enclosing "for" loop.
+                if (array >= 0 && indexVar >= 0)
+                    for (int i = m_flowControl.size () - 1; i >= 0; i--)
+                        if (    m_flowControl [i].m_forLoop >= 0
+                            &&  m_forLoops [m_flowControl [i].m_forLoop].m_var == indexVar) {
+                            checks.push_back (compIndexCheck (0, m_flowControl [i].m_forLoop, array, dimension, indices));
+                            break;
+                        }
+                dimension++;
+                indices++;
+
+            } while (m_token.m_text == ",");
+
+            // Elements of field major structure arrays are not stored
+            // contiguously, so must be indexed together with a field.
+            vmValType rowType = arrayType;
+            rowType.m_arrayLevel = 1;
+            if (arrayType.m_arrayLevel == indices && m_vm.DataTypes ().FieldMajorArray (rowType)) {
+                if (m_token.m_text != ")") {
+                    SetError ("Expected ')'");
+                    return false;
+                }
+                if (!GetToken ())
+                    return false;
+                if (m_token.m_text != ".") {
+                    SetError ("Expected '.' (Field major structure array elements can only be accessed one field at a time)");
+                    return false;
+                }
+                if (!GetToken ())
+                    return false;
+
+                // Read and validate field name
+                if (m_token.m_type != CTT_TEXT) {
+                    SetError ("Expected field name");
+                    return false;
+                }
+                std::string fieldName = m_token.m_text;
+                if (!GetToken ())
+                    return false;
+                vmStructure& s = m_vm.DataTypes ().Structures () [arrayType.m_basicType];
+                int fieldIndex = m_vm.DataTypes ().GetField (s, fieldName);
+                if (fieldIndex < 0) {
+                    SetError ((std::string) "'" + fieldName + "' is not a field of structure '" + s.m_name + "'");
+                    return false;
+                }
+                vmStructureField& field = m_vm.DataTypes ().Fields () [fieldIndex];
+
+                // Generate code to index into array, and find field.
+                // Input:  reg   = Last array index
+                //         stack = Array address, then the other indices
+                // Output: reg   = Pointer to field
+                m_operandStack.resize (m_operandStack.size () - indices);
+                AddInstruction (OP_ARRAY_INDEX_FIELD, VTP_INT, vmValue ((vmInt) (indices | field.m_dataOffset << 18)));
+                for (unsigned int i = 0; i < checks.size (); i++) {
+                    checks [i].m_instruction = m_vm.InstructionCount () - 1;
+                    m_indexChecks.push_back (checks [i]);
+                }
+                array = -1;
+                m_regVar = -1;
+
+                // Reg now contains pointer to field
+                m_regType = field.m_type;
+                m_regType.m_pointerLevel++;
+
+                // Dereference to reach data
+                if (!CompileDerefs ())
+                    return false;
+                continue;
+            }
+
+            // Generate code to index into array.
+            if (indices == 1) {
+
+                // Pop array address into reg2
                 if (!CompilePop ())
                     return false;
 
-                // Generate code to index into array.
                 // Input:  reg  = Array index
                 //         reg2 = Array address
                 // Output: reg  = Pointer to array element
                 AddInstruction (OP_ARRAY_INDEX, VTP_INT, vmValue ());
+            }
+            else {
 
-                // reg now points to an element
-                m_regType = m_reg2Type;
-                m_regType.m_byRef           = false;
-                m_regType.m_pointerLevel    = 1;
-                m_regType.m_arrayLevel--;
+                // Input:  reg   = Last array index
+                //         stack = Array address, then the other indices
+                // Output: reg   = Pointer to array element
+                m_operandStack.resize (m_operandStack.size () - indices);
+                AddInstruction (OP_ARRAY_INDEX_N, VTP_INT, vmValue ((vmInt) indices));
+            }
+            for (unsigned int i = 0; i < checks.size (); i++) {
+                checks [i].m_instruction = m_vm.InstructionCount () - 1;
+                m_indexChecks.push_back (checks [i]);
+            }
+            m_regVar = -1;
 
-                // Dereference to get to element
-                if (!CompileDerefs ())
-                    return false;
+            // reg now points to an element
+            m_regType = arrayType;
+            m_regType.m_byRef           = false;
+            m_regType.m_pointerLevel    = 1;
+            m_regType.m_arrayLevel     -= indices;
 
-            } while (m_token.m_text == ",");
+            // Dereference to get to element
+            if (!CompileDerefs ())
+                return false;
 
             // Expect closing bracket
             if (m_token.m_text != ")") {
@@ -1063,9 +1503,11 @@ bool TomBasicCompiler::CompileDataLookup (bool takeAddress) {
     }
 
     // Compile take address (if necessary)
-    if (takeAddress)
+    if (takeAddress) {
         if (!CompileTakeAddress ())
             return false;
+        VarAliased (m_regVar);
+    }
 
     return true;
 }
@@ -1080,6 +1522,21 @@ bool TomBasicCompiler::CompileExpression (bool mustBeConstant) {
     //      A constant (numeric or string)
     //      A variable reference
 
+    // Numeric expressions with two or more operators are compiled to register
+    // code. (Register code saves nothing on smaller expressions, as the result
+    // must still be moved into reg.)
+    if (m_registerCode && !mustBeConstant) {
+        int root = ParseRegTree (2);
+        if (root >= 0) {
+            CompileRegNode (root, 0, m_regNodes [root].m_type);
+            AddRegInstruction (OP_R_MOVE, 0, vmValue (), m_token.m_line, m_token.m_col);
+            m_regType = m_regNodes [root].m_type;
+            return true;
+        }
+        if (Error ())
+            return false;
+    }
+
     // Push "stop evaluation" operand to stack. (To protect any existing operators
     // on the stack.
     m_operatorStack.push_back (compOperator (OT_STOP, OP_NOP, 0, -200000));    // Stop evaluation operator
@@ -1187,7 +1644,7 @@ bool TomBasicCompiler::CompileOperation () {
             CompileConvert (VTP_INT);
 
         // Perform unary operation
-        AddInstruction (o.m_opCode, m_regType.m_basicType, vmValue ());
+        AddInstruction (vmTypedOpCode (o.m_opCode, m_regType.m_basicType), m_regType.m_basicType, vmValue ());
 
         // Special case, boolean operator
         // Result will be an integer
@@ -1265,7 +1722,7 @@ bool TomBasicCompiler::CompileOperation () {
         }
 
         // Generate operation code
-        AddInstruction (o.m_opCode, opCodeType, vmValue ());
+        AddInstruction (vmTypedOpCode (o.m_opCode, opCodeType), opCodeType, vmValue ());
 
         // Special case, boolean operator
         // Result will be an integer
@@ -1307,13 +1764,323 @@ bool TomBasicCompiler::CompileExpressionLoad (bool mustBeConstant) {
     }
 }
 
+////////////////////////////////////////////////////////////////////////////////
+// Register code generation
+//
+// Numeric expressions (int and real constants, simple variables and the built
+// in operators) can be compiled to register machine instructions, instead of
+// evaluating them with reg, reg2 and the stack.
+// The expression is first parsed into a tree (m_regNodes). If anything is
+// found that the register machine does not handle (strings, arrays, function
+// calls, language extension operators e.t.c) the parser is rewound and the
+// expression is compiled the normal way.
+
+int TomBasicCompiler::ParseRegTree (int minOperators) {
+
+    // Parse expression into m_regNodes.
+    // Returns the index of the root node, or -1 if the expression is not
+    // suitable for register code (or has less than minOperators operators).
+    // The parser position is restored if -1 is returned, unless an error
+    // occurred.
+    compParserPos pos = SavePos ();
+    m_regNodes.clear ();
+    int root = ParseRegExpression (0);
+    if (Error ())
+        return -1;
+
+    if (root >= 0) {
+        int operators = 0;
+        for (unsigned int i = 0; i < m_regNodes.size (); i++)
+            if (m_regNodes [i].m_opCode != OP_NOP)
+                operators++;
+        if (operators >= minOperators && RegisterCount (root) <= VM_MAXREGISTERS)
+            return root;
+    }
+
+    RestorePos (pos);
+    return -1;
+}
+
+int TomBasicCompiler::ParseRegExpression (int minBinding) {
+
+    // Parse operand and any following binary operators that bind at least as
+    // tightly as minBinding.
+    // Operators of equal binding are applied left to right, exactly as
+    // CompileExpression does.
+    int left = ParseRegOperand ();
+    while (left >= 0) {
+        compOperatorMap::iterator o = m_binaryOperators.find (m_token.m_text);
+        if (o == m_binaryOperators.end () || (*o).second.m_binding < minBinding)
+            break;
+        compOperator oper = (*o).second;
+        if (!GetToken ())
+            return -1;
+        int right = ParseRegExpression (oper.m_binding + 1);
+        if (right < 0)
+            return -1;
+        left = AddRegOperation (oper, left, right);
+    }
+    return left;
+}
+
+int TomBasicCompiler::ParseRegOperand () {
+
+    // Bracketed expression
+    if (m_token.m_text == "(") {
+        if (!GetToken ())
+            return -1;
+        int node = ParseRegExpression (0);
+        if (node < 0 || m_token.m_text != ")")
+            return -1;
+        if (!GetToken ())
+            return -1;
+
+        // Data lookups are not applicable to numbers. Leave it to the normal
+        // compiler to report the error.
+        if (m_token.m_text == "(" || m_token.m_text == ".")
+            return -1;
+        return node;
+    }
+
+    // Unary operator.
+    // Applies to everything to its right that binds tighter than it does.
+    compOperatorMap::iterator o = m_unaryOperators.find (m_token.m_text);
+    if (o != m_unaryOperators.end ()) {
+        compOperator oper = (*o).second;
+        if (!GetToken ())
+            return -1;
+        int operand = ParseRegExpression (oper.m_binding + 1);
+        if (operand < 0)
+            return -1;
+        return AddRegOperation (oper, operand, -1);
+    }
+
+    compRegNode node;
+
+    // Numeric constant
+    if (m_token.m_type == CTT_CONSTANT) {
+        if (m_token.m_valType == VTP_INT)
+            node.m_value = vmValue (StringToInt (m_token.m_text));
+        else if (m_token.m_valType == VTP_REAL)
+            node.m_value = vmValue (StringToReal (m_token.m_text));
+        else
+            return -1;
+        node.m_type = (vmBasicValType) m_token.m_valType;
+    }
+
+    // Simple int or real variable
+    else if (m_token.m_type == CTT_TEXT) {
+        node.m_var = m_vm.Variables ().GetVar (m_token.m_text);
+        if (!m_vm.Variables ().IndexValid (node.m_var))
+            return -1;
+        vmValType& type = m_vm.Variables ().Variables () [node.m_var].m_type;
+        if (!type.IsBasic () || (type.m_basicType != VTP_INT && type.m_basicType != VTP_REAL))
+            return -1;
+        node.m_type = type.m_basicType;
+    }
+    else
+        return -1;
+
+    if (!GetToken ())
+        return -1;
+    if (m_token.m_text == "(" || m_token.m_text == ".")
+        return -1;
+
+    // Code to load the operand is positioned at the following token, as it
+    // would be by CompileLoad
+    node.m_line = m_token.m_line;
+    node.m_col  = m_token.m_col;
+    m_regNodes.push_back (node);
+    return m_regNodes.size () - 1;
+}
+
+int TomBasicCompiler::AddRegOperation (compOperator& o, int left, int right) {
+
+    // Add operator node. Operand types are resolved the same way as
+    // CompileOperation.
+    // Returns -1 if the operation has no register machine equivalent, or is
+    // handled by a language extension.
+    compRegNode node;
+    node.m_left     = left;
+    node.m_right    = right;
+    vmBasicValType leftType = m_regNodes [left].m_type;
+    vmValType type1, type2, resultType;
+    int opFunc;
+    bool freeTempData;
+
+    if (right < 0) {
+
+        // Unary operator
+        for (unsigned int i = 0; i < m_unOperExts.size (); i++) {
+            type1 = leftType;
+            if (m_unOperExts [i] (type1, o.m_opCode, opFunc, resultType, freeTempData))
+                return -1;
+        }
+        node.m_operandType = o.m_type == OT_BOOLOPERATOR ? VTP_INT : leftType;
+    }
+    else {
+
+        // Binary operator.
+        // Note: Extensions receive the right operand as the first type, as it
+        // would be in reg.
+        vmBasicValType rightType = m_regNodes [right].m_type;
+        for (unsigned int i = 0; i < m_binOperExts.size (); i++) {
+            type1 = rightType;
+            type2 = leftType;
+            if (m_binOperExts [i] (type1, type2, o.m_opCode, opFunc, resultType, freeTempData))
+                return -1;
+        }
+
+        // Convert operands to highest type
+        vmBasicValType highest = leftType;
+        if (rightType > highest)
+            highest = rightType;
+        if (o.m_type == OT_BOOLOPERATOR)
+            highest = VTP_INT;
+        if (m_syntax == LS_TRADITIONAL && o.m_opCode == OP_OP_DIV)
+            highest = VTP_REAL;
+        node.m_operandType = highest;
+    }
+
+    node.m_opCode = vmRegisterOpCode (vmTypedOpCode (o.m_opCode, node.m_operandType));
+    if (node.m_opCode == OP_NOP)
+        return -1;
+    node.m_type = o.m_type == OT_RETURNBOOLOPERATOR ? VTP_INT : node.m_operandType;
+    node.m_line = m_token.m_line;
+    node.m_col  = m_token.m_col;
+
+    m_regNodes.push_back (node);
+    return m_regNodes.size () - 1;
+}
+
+int TomBasicCompiler::RegisterCount (int node) {
+
+    // Number of registers required to evaluate node.
+    // The left operand is evaluated into the node's register, and the right
+    // operand into the next one up.
+    compRegNode& n = m_regNodes [node];
+    if (n.m_left < 0)
+        return 1;
+    int count = RegisterCount (n.m_left);
+    if (n.m_right >= 0) {
+        int rightCount = RegisterCount (n.m_right) + 1;
+        if (rightCount > count)
+            count = rightCount;
+    }
+    return count;
+}
+
+void TomBasicCompiler::AddRegInstruction (vmOpCode opCode, int reg, const vmValue& val, unsigned int line, unsigned int col) {
+
+    // Register machine instructions store the destination register in the
+    // instruction type
+    assert (reg >= 0 && reg < VM_MAXREGISTERS);
+    AddInstruction (opCode, (vmBasicValType) reg, val, line, col);
+}
+
+void TomBasicCompiler::CompileRegNode (int node, int reg, vmBasicValType type) {
+
+    // Generate code to evaluate node into register "reg", converted to "type".
+    // Registers above "reg" are used for temporary values.
+    compRegNode& n = m_regNodes [node];
+    if (n.m_opCode == OP_NOP) {
+        if (n.m_var >= 0)
+            AddRegInstruction (OP_R_LOAD_VAR, reg, vmValue ((vmInt) n.m_var), n.m_line, n.m_col);
+        else {
+
+            // Constants are converted at compile time
+            vmValue value = n.m_value;
+            if (n.m_type == VTP_INT && type == VTP_REAL)
+                value = vmValue ((vmReal) value.IntVal ());
+            else if (n.m_type == VTP_REAL && type == VTP_INT)
+                value = vmValue ((vmInt) value.RealVal ());
+            AddRegInstruction (OP_R_LOAD_CONST, reg, value, n.m_line, n.m_col);
+            return;
+        }
+    }
+    else {
+        CompileRegNode (n.m_left, reg, n.m_operandType);
+        if (n.m_right >= 0) {
+            CompileRegNode (n.m_right, reg + 1, n.m_operandType);
+            AddRegInstruction (n.m_opCode, reg, vmRegOperands (reg, reg + 1), n.m_line, n.m_col);
+        }
+        else
+            AddRegInstruction (n.m_opCode, reg, vmRegOperands (reg), n.m_line, n.m_col);
+    }
+
+    // Convert result
+    if (n.m_type == VTP_INT && type == VTP_REAL)
+        AddRegInstruction (OP_R_CONV_INT_REAL, reg, vmRegOperands (reg), n.m_line, n.m_col);
+    else if (n.m_type == VTP_REAL && type == VTP_INT)
+        AddRegInstruction (OP_R_CONV_REAL_INT, reg, vmRegOperands (reg), n.m_line, n.m_col);
+}
+
+bool TomBasicCompiler::CompileRegAssignment () {
+
+    // Compile "variable = expression" to register code, if variable is a
+    // simple int or real and the expression is suitable.
+    // Returns false if not compiled (check Error () to distinguish a compile
+    // error from an unsuitable assignment).
+    compParserPos pos = SavePos ();
+    if (m_token.m_type != CTT_TEXT)
+        return false;
+    int varIndex = m_vm.Variables ().GetVar (m_token.m_text);
+    if (!m_vm.Variables ().IndexValid (varIndex))
+        return false;
+    vmValType type = m_vm.Variables ().Variables () [varIndex].m_type;
+    if (!type.IsBasic () || (type.m_basicType != VTP_INT && type.m_basicType != VTP_REAL))
+        return false;
+
+    // Skip variable name and "="
+    if (!GetToken ())
+        return false;
+    if (m_token.m_text == "=") {
+        unsigned int line = m_token.m_line, col = m_token.m_col;
+        if (!GetToken ())
+            return false;
+
+        // Evaluate expression and save into variable
+        int root = ParseRegTree (0);
+        if (root >= 0) {
+
+            // Position the first instruction at the "=", as the normal
+            // assignment code would be.
+            int first = root;
+            while (m_regNodes [first].m_left >= 0)
+                first = m_regNodes [first].m_left;
+            m_regNodes [first].m_line   = line;
+            m_regNodes [first].m_col    = col;
+
+            CompileRegNode (root, 0, type.m_basicType);
+            AddRegInstruction (OP_R_SAVE_VAR, 0, vmValue ((vmInt) varIndex), m_token.m_line, m_token.m_col);
+            VarWritten (varIndex);
+            return true;
+        }
+        if (Error ())
+            return false;
+    }
+
+    RestorePos (pos);
+    return false;
+}
+
 bool TomBasicCompiler::CompileLoad () {
 
     // Compile load var or constant, or function result
     if (m_token.m_type == CTT_CONSTANT || m_token.m_text == "null")
         return CompileLoadConst ();
-    else if (m_token.m_type == CTT_TEXT || m_token.m_text == "&")
-        return CompileLoadVar ();
+    else if (m_token.m_type == CTT_TEXT || m_token.m_text == "&") {
+        if (!CompileLoadVar ())
+            return false;
+
+        // Note whether the variable is only read (i.e. a value was loaded,
+        // rather than an address)
+        if (    m_regType.VirtualPointerLevel () == 0
+            &&  m_regType.m_arrayLevel == 0
+            &&  m_regType.m_basicType < 0)
+            m_readLoads.insert (m_varLoad);
+        return true;
+    }
     else if (m_token.m_type == CTT_FUNCTION) {
         return CompileFunction (true);
     }
@@ -1476,6 +2243,14 @@ bool TomBasicCompiler::CompileTakeAddress () {
 
 bool TomBasicCompiler::CompileAssignment () {
 
+    // Simple numeric assignments can be compiled to register code
+    if (m_registerCode) {
+        if (CompileRegAssignment ())
+            return true;
+        if (Error ())
+            return false;
+    }
+
     // Generate code to load target variable
     if (!CompileLoadVar ())
         return false;
@@ -1491,6 +2266,7 @@ bool TomBasicCompiler::CompileAssignment () {
         SetError ("Left side cannot be assigned to");
         return false;
     }
+    VarWritten (m_regVar);
 
     // Skip =
     if (!GetToken ())
@@ -1575,6 +2351,10 @@ bool TomBasicCompiler::CompileGoto (vmOpCode jumpType) {
     // Record jump, so that we can fix up the offset in the second compile pass.
     m_jumps.push_back (compJump (m_vm.InstructionCount (), m_token.m_text));
 
+    // Assume a gosub can modify any variable
+    if (jumpType == OP_CALL)
+        ClearForLoopRanges ();
+
     // Add jump instruction
     AddInstruction (jumpType, VTP_INT, vmValue (0));
 
@@ -1716,6 +2496,16 @@ bool TomBasicCompiler::CompileFor () {
         return false;
     }
 
+    // Look for a constant integer start value.
+    // (Used to find the range of the loop variable inside the loop.)
+    vmInt low = 0, high = 0;
+    bool ranged = var.m_type == VTP_INT;
+    if (ranged) {
+        compParserPos pos = SavePos ();
+        ranged = GetToken () && m_token.m_text == "=" && GetToken () && IntConstantOperand (low);
+        RestorePos (pos);
+    }
+
     // Compile assignment
     int varLine = m_parser.Line (), varCol = m_parser.Col ();
     compToken varToken = m_token;
@@ -1733,6 +2523,10 @@ bool TomBasicCompiler::CompileFor () {
     if (!GetToken ())
         return false;
 
+    // Look for a constant integer end value
+    if (ranged)
+        ranged = IntConstantOperand (high);
+
     // Compile load variable and push
     compParserPos savedPos = SavePos ();                            // Save parser position
     m_parser.SetPos (varLine, varCol);                              // Point to variable name
@@ -1801,6 +2595,17 @@ bool TomBasicCompiler::CompileFor () {
     // Create flow control structure
     m_flowControl.push_back (compFlowControl (FCT_FOR, m_vm.InstructionCount (), loopPos, line, col, false, step));
 
+    // Record loop variable range.
+    // The loop condition is tested before each pass, so inside the loop the
+    // variable is always between the start and end values (unless something
+    // else modifies it).
+    if (ranged && stepValue.IntVal () == 0)
+        ranged = false;
+    if (ranged && stepValue.IntVal () < 0)
+        std::swap (low, high);
+    m_flowControl.back ().m_forLoop = m_forLoops.size ();
+    m_forLoops.push_back (compForLoop (varIndex, low, high, ranged));
+
     // Create conditional jump
     AddInstruction (OP_JUMP_FALSE, VTP_INT, vmValue (0));
 
@@ -1843,6 +2648,122 @@ bool TomBasicCompiler::CompileNext () {
     return true;
 }
 
+bool TomBasicCompiler::IntConstantOperand (vmInt& value) {
+
+    // Return true if the current token is an integer constant that makes up
+    // a whole operand. (I.e. it is not followed by a binary operator.)
+    // The parser position is not changed.
+    if (m_token.m_type != CTT_CONSTANT || m_token.m_valType != VTP_INT)
+        return false;
+    value = StringToInt (m_token.m_text);
+    compParserPos pos = SavePos ();
+    bool result = GetToken () && m_binaryOperators.find (m_token.m_text) == m_binaryOperators.end ();
+    RestorePos (pos);
+    return result;
+}
+
+void TomBasicCompiler::VarWritten (int var) {
+
+    // Variable is assigned a value.
+    // If it is the variable of an enclosing "for" loop, its range is no longer
+    // known.
+    if (var < 0)
+        return;
+    for (unsigned int i = 0; i < m_flowControl.size (); i++)
+        if (m_flowControl [i].m_forLoop >= 0 && m_forLoops [m_flowControl [i].m_forLoop].m_var == var)
+            m_forLoops [m_flowControl [i].m_forLoop].m_ranged = false;
+}
+
+void TomBasicCompiler::ClearForLoopRanges () {
+
+    // Forget the variable range of all enclosing "for" loops
+    for (unsigned int i = 0; i < m_flowControl.size (); i++)
+        if (m_flowControl [i].m_forLoop >= 0)
+            m_forLoops [m_flowControl [i].m_forLoop].m_ranged = false;
+}
+
+void TomBasicCompiler::RemoveBoundsChecks () {
+
+    // Convert array index instructions into unchecked versions where the
+    // enclosing "for" loop keeps the index within the array size.
+    // This is done after the whole program is compiled, as the loop variable
+    // could be modified anywhere inside the loop, or have its address taken
+    // anywhere in the program.
+    for (unsigned int i = 0; i < m_indexChecks.size (); i++) {
+        compIndexCheck& check = m_indexChecks [i];
+        compForLoop& loop = m_forLoops [check.m_forLoop];
+        if (!loop.m_ranged || loop.m_low < 0)
+            continue;
+        if (m_aliasedVars.find (loop.m_var) != m_aliasedVars.end ())
+            continue;
+        compArraySizeMap::iterator sizes = m_arraySizes.find (check.m_array);
+        if (sizes == m_arraySizes.end () || check.m_dimension >= (int) (*sizes).second.size ())
+            continue;
+        vmInt size = (*sizes).second [check.m_dimension];
+        if (size < 0 || loop.m_high >= size)
+            continue;
+        vmInstruction& instruction = m_vm.Instruction (check.m_instruction);
+        if (instruction.m_opCode == OP_ARRAY_INDEX)
+            instruction.m_opCode = OP_ARRAY_INDEX_UNCHECKED;
+        else if (instruction.m_opCode == OP_ARRAY_INDEX_N || instruction.m_opCode == OP_ARRAY_INDEX_FIELD)
+            instruction.m_value.IntVal () |= 1 << (check.m_operand + 8);
+    }
+}
+
+void TomBasicCompiler::UseCopyOnWrite () {
+
+    // Convert whole array assignments between array variables into
+    // copy-on-write copies, which the VM can defer until either array is next
+    // loaded. Every other load of those variables is converted to a version
+    // that completes the copy first, or (if it only reads a value) reads from
+    // the copy's source.
+    // Variables that have their address taken anywhere in the program are
+    // excluded, as their data can then be accessed without loading them.
+    compIntSet cowVars, operands;
+    int count = m_vm.InstructionCount ();
+    int i;
+    for (i = 0; i + 4 < count; i++) {
+
+        // Look for: LOAD_VAR dest, PUSH, LOAD_VAR source, POP, COPY
+        if (    m_vm.Instruction (i).m_opCode       != OP_LOAD_VAR
+            ||  m_vm.Instruction (i + 1).m_opCode   != OP_PUSH
+            ||  m_vm.Instruction (i + 2).m_opCode   != OP_LOAD_VAR
+            ||  m_vm.Instruction (i + 3).m_opCode   != OP_POP
+            ||  m_vm.Instruction (i + 4).m_opCode   != OP_COPY)
+            continue;
+        int vars [2] = { m_vm.Instruction (i).m_value.IntVal (), m_vm.Instruction (i + 2).m_value.IntVal () };
+        if (vars [0] == vars [1])
+            continue;
+        bool suitable = true;
+        for (int j = 0; j < 2; j++) {
+            vmValType& type = m_vm.Variables ().Variables () [vars [j]].m_type;
+            suitable = suitable
+                    && type.m_arrayLevel > 0
+                    && type.m_pointerLevel == 0
+                    && !m_vm.DataTypes ().ContainsString (type)
+                    && m_aliasedVars.find (vars [j]) == m_aliasedVars.end ();
+        }
+        if (!suitable)
+            continue;
+
+        // Convert copy
+        m_vm.Instruction (i + 4).m_opCode = OP_COPY_COW;
+        cowVars.insert (vars [0]);
+        cowVars.insert (vars [1]);
+        operands.insert (i);
+        operands.insert (i + 2);
+    }
+
+    // Convert other loads of the variables
+    for (i = 0; i < count && !cowVars.empty (); i++) {
+        vmInstruction& instruction = m_vm.Instruction (i);
+        if (    instruction.m_opCode == OP_LOAD_VAR
+            &&  cowVars.find (instruction.m_value.IntVal ()) != cowVars.end ()
+            &&  operands.find (i) == operands.end ())
+            instruction.m_opCode = m_readLoads.find (i) != m_readLoads.end () ? OP_LOAD_VAR_COW_READ : OP_LOAD_VAR_COW;
+    }
+}
+
 bool TomBasicCompiler::CompileWhile () {
 
     // Save loop position
@@ -2141,6 +3062,8 @@ bool TomBasicCompiler::CompileConvert (vmValType type) {
 
         // Convert register to pointer
         if (CompileTakeAddress ()) {
+            VarAliased (m_regVar);
+            m_readLoads.erase (m_varLoad);
 
             // Convert pointer to reference
             m_regType.m_byRef = true;
@@ -2254,6 +3177,7 @@ bool TomBasicCompiler::CompileConstant () {
         case VTP_REAL:      m_programConstants [name] = compConstant (value.RealVal ());    break;
         case VTP_STRING:    m_programConstants [name] = compConstant ((std::string) ("S" + stringValue));         break;
         };
+        m_constantOrder.push_back (name);
 
 /*        // Expect constant value
         if (m_token.m_type != CTT_CONSTANT) {
@@ -2479,9 +3403,11 @@ compParserPos TomBasicCompiler::SavePos () {
 
     // Save the current parser position, so we can return to it later.
     compParserPos pos;
-    pos.m_line  = m_parser.Line ();
-    pos.m_col   = m_parser.Col ();
-    pos.m_token = m_token;
+    pos.m_line          = m_parser.Line ();
+    pos.m_col           = m_parser.Col ();
+    pos.m_special       = m_parser.Special ();
+    pos.m_specialCol    = m_parser.SpecialCol ();
+    pos.m_token         = m_token;
     return pos;
 }
 
@@ -2489,6 +3415,8 @@ void TomBasicCompiler::RestorePos (compParserPos& pos) {
 
     // Restore parser position
     m_parser.SetPos (pos.m_line, pos.m_col);
+    if (pos.m_special)
+        m_parser.SetSpecialCol (pos.m_specialCol);
     m_token = pos.m_token;
 }
 
@@ -2526,8 +3454,11 @@ bool TomBasicCompiler::TempCompileExpression (std::string expression, vmValType&
     m_lastLine = 0;
     m_lastCol  = 0;
 
-    // Reset compiler state
+    // Reset compiler state.
+    // (This loses the state needed to resume compiling the program, so the
+    // next Recompile will compile from scratch.)
     ClearState ();
+    m_checkpoints.clear ();
 
     // Clear error state
     ClearError ();
@@ -2650,6 +3581,7 @@ bool TomBasicCompiler::CompileDataRead () {
             SetError ("Value cannot be READ into");
             return false;
         }
+        VarWritten (m_regVar);
 
         if (!CompilePush ())
             return false;
@@ -2832,7 +3764,7 @@ bool TomBasicCompiler::CompilePrint (bool forceNewline) {
     while (operandCount > 1) {
         if (!CompilePop())
             return false;
-        AddInstruction(OP_OP_PLUS, VTP_STRING, vmValue());
+        AddInstruction(OP_OP_PLUS_STRING, VTP_STRING, vmValue());
         m_regType = VTP_STRING;
 
         operandCount--;
@@ -2934,6 +3866,7 @@ bool TomBasicCompiler::CompileInput () {
     vmBasicValType variableType = m_regType.m_basicType;
 
     // Generate code to push its address to stack
+    VarWritten (m_regVar);
     if (!(CompileTakeAddress() && CompilePush()))
         return false;
 
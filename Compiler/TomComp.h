@@ -16,6 +16,7 @@
 
 #define TC_STEPSBETWEENREFRESH 1000
 #define TC_MAXOVERLOADEDFUNCTIONS 256           // Allow 256 functions of the same name (should be more than enough for anything...)
+#define TC_CHECKPOINTLINES 32                   // Minimum source lines between compiler checkpoints (see Recompile)
 
 ////////////////////////////////////////////////////////////////////////////////
 // Internal compiler types
@@ -94,6 +95,7 @@ struct compFlowControl {
     std::string         m_data;                         // Misc data
     bool                m_impliedEndif;                 // If/elseif/else only. True if there is an implied endif after the explict endif
     bool                m_blockIf;                      // True if is a block if. Block ifs require "endifs". Non-block ifs have an implicit endif at the end of the line
+    int                 m_forLoop;                      // For only. Index of loop range information (compForLoop)
 
     compFlowControl (compFlowControlType type, int jumpOut, int jumpLoop, int line, int col, bool impliedEndif = false, const std::string& data = (std::string) "", bool blockIf = false)
         :   m_type (type),
@@ -103,7 +105,8 @@ struct compFlowControl {
             m_sourceCol (col),
             m_impliedEndif (impliedEndif),
             m_data (data),
-            m_blockIf (blockIf) { ; }
+            m_blockIf (blockIf),
+            m_forLoop (-1) { ; }
     compFlowControl ()
         :   m_type ((compFlowControlType) 0),
             m_jumpOut (0),
@@ -111,7 +114,36 @@ struct compFlowControl {
             m_sourceLine (0),
             m_sourceCol (0),
             m_impliedEndif (false),
-            m_data ("") { ; }
+            m_data (""),
+            m_forLoop (-1) { ; }
+};
+
+// compForLoop
+// Range of a "for" loop's variable inside the loop body. Used to remove array
+// bounds checks when the array is known to be big enough.
+struct compForLoop {
+    int     m_var;                      // Loop variable index
+    vmInt   m_low, m_high;              // Range of loop variable inside the loop body
+    bool    m_ranged;                   // False if range is unknown (bounds are not constant, variable is modified in the loop e.t.c)
+
+    compForLoop (int var, vmInt low, vmInt high, bool ranged)
+        : m_var (var), m_low (low), m_high (high), m_ranged (ranged) { ; }
+};
+
+// compIndexCheck
+// An OP_ARRAY_INDEX that indexes an array variable with a "for" loop variable.
+// If the loop keeps the variable within the array dimension's size, it is
+// replaced with an OP_ARRAY_INDEX_UNCHECKED once compilation has finished.
+// For an OP_ARRAY_INDEX_N, the operand's range check is switched off instead.
+struct compIndexCheck {
+    unsigned int    m_instruction;      // Offset of OP_ARRAY_INDEX or OP_ARRAY_INDEX_N instruction
+    int             m_forLoop;          // Index of loop range information (compForLoop)
+    int             m_array;            // Array variable index
+    int             m_dimension;        // Array dimension being indexed (0 = first)
+    int             m_operand;          // Index operand of the instruction (0 = first)
+
+    compIndexCheck (unsigned int instruction, int forLoop, int array, int dimension, int operand)
+        : m_instruction (instruction), m_forLoop (forLoop), m_array (array), m_dimension (dimension), m_operand (operand) { ; }
 };
 
 // compConstant
@@ -161,6 +193,19 @@ struct compConstant {
             m_stringVal (c.m_stringVal) { ; }
 };
 
+// compIdentClass
+//
+// The result of matching a text token against the reserved words, functions
+// and permanent constants.
+struct compIdentClass {
+    bool            m_classified;       // False until text has been matched
+    compTokenType   m_type;             // CTT_KEYWORD, CTT_FUNCTION, CTT_CONSTANT or CTT_TEXT
+    vmBasicValType  m_valType;          // Value type, for constants
+    std::string     m_text;             // Token text. (Lower case if not case sensitive, or the constant's value)
+
+    compIdentClass () : m_classified (false) { ; }
+};
+
 // Language extension: Operator overloading
 //
 typedef bool (*compUnOperExt)(  vmValType& regType,     // IN: Current type in register.                                                        OUT: Required type cast before calling function
@@ -184,20 +229,95 @@ typedef std::map<std::string,compConstant> compConstantMap;
 typedef std::vector<compFuncSpec> compFuncSpecArray;
 typedef std::map<std::string,int> compStringIndex;
 typedef std::multimap<std::string,int> compFuncIndex;
+typedef std::map<int,std::vector<vmInt> > compArraySizeMap;
+typedef std::set<int> compIntSet;
 
 // Misc
 struct compParserPos {
     unsigned int m_line;
     int m_col;
+    bool m_special;                     // True if parser was in special mode
+    unsigned int m_specialCol;          // Position in special text
     compToken m_token;
 };
 
+// compRegNode
+// Expression tree node used by the register code generator.
+// Only numeric expressions built from constants, simple variables and the
+// built in operators are represented.
+struct compRegNode {
+    vmOpCode        m_opCode;           // Register machine op-code. OP_NOP for constants and variables
+    vmBasicValType  m_type;             // Result type
+    vmBasicValType  m_operandType;      // Type operands are converted to before the operation
+    int             m_var;              // Variable index. -1 if not a variable
+    vmValue         m_value;            // Constant value
+    int             m_left, m_right;    // Operand nodes. -1 if none
+    unsigned int    m_line, m_col;      // Source position for generated code
+
+    compRegNode ()
+        :   m_opCode (OP_NOP),
+            m_type (VTP_INT),
+            m_operandType (VTP_INT),
+            m_var (-1),
+            m_left (-1),
+            m_right (-1),
+            m_line (0),
+            m_col (0) { ; }
+};
+
 enum compLanguageSyntax {
     LS_TRADITIONAL          = 0,    // As compatible as possible with other BASICs
     LS_BASIC4GL             = 1,    // Standard Basic4GL syntax for backwards compatibility with existing code.
     LS_TRADITIONAL_PRINT    = 2     // Traditional mode PRINT, but otherwise standard Basic4GL syntax
 };
 
+// compCheckpoint
+// Compiler state at the start of a source line (between instructions).
+// Recompile rolls back to the last checkpoint before the first changed line,
+// and compiles onwards from there.
+// Everything the compiler only ever appends to is recorded by its size.
+struct compCheckpoint {
+    compToken                       m_token;                // First token of the line
+    unsigned int                    m_parserLine,           // Parser position after it
+                                    m_parserCol;
+    unsigned int                    m_codeSize;             // Instruction count
+    int                             m_variableCount,
+                                    m_strucCount,
+                                    m_fieldCount,
+                                    m_storedTypeCount,
+                                    m_programDataSize,
+                                    m_stringConstantCount;
+    vmValType                       m_regType, m_reg2Type;
+    int                             m_regVar;
+    int                             m_varLoad;
+    bool                            m_varLoadRead;          // True if m_varLoad was in m_readLoads
+    bool                            m_freeTempData;
+    unsigned int                    m_lastLine, m_lastCol;
+    compLanguageSyntax              m_syntax;
+    std::vector<compFlowControl>    m_flowControl;
+    std::vector<bool>               m_forLoopRanged;        // m_ranged of each open "for" loop (can be cleared later)
+    unsigned int                    m_jumpCount,
+                                    m_resetCount,
+                                    m_forLoopCount,
+                                    m_indexCheckCount,
+                                    m_labelCount,
+                                    m_constantCount,
+                                    m_aliasedVarCount,
+                                    m_arraySizeChangeCount;
+};
+
+// compArraySizeChange
+// A change to the recorded dimension sizes of an array variable, so that it
+// can be undone when rolling back to a checkpoint.
+struct compArraySizeChange {
+    int                 m_var;
+    bool                m_existed;                          // False if sizes were not recorded before
+    std::vector<vmInt>  m_sizes;                            // Previous sizes
+
+    compArraySizeChange (int var, bool existed, const std::vector<vmInt>& sizes)
+        : m_var (var), m_existed (existed), m_sizes (sizes) { ; }
+};
+
 ////////////////////////////////////////////////////////////////////////////////
 // TomBasicCompiler
 //
@@ -220,7 +340,10 @@ class TomBasicCompiler : public HasErrorState {
     compConstantMap         m_programConstants;     // Constants declared using the const command.
     compFuncSpecArray       m_functions;
     compFuncIndex           m_functionIndex;        // Maps function name to index of function (in m_functions array)
+    std::vector<compIdentClass> m_identClasses;     // Classified text, indexed by parser identifier. (See GetToken)
+    unsigned int            m_identLexCount;        // Parser LexCount when m_identClasses was filled
     compLanguageSyntax      m_syntax;
+    bool                    m_registerCode;         // True to compile numeric expressions to register machine code
 
     // Compiler state
     vmValType                       m_regType, m_reg2Type;
@@ -237,20 +360,56 @@ class TomBasicCompiler : public HasErrorState {
     bool                            m_freeTempData; // True if need to generate code to free temporary data before the next instruction
     unsigned int                    m_lastLine,
                                     m_lastCol;
-
+    std::vector<compRegNode>        m_regNodes;     // Expression tree for register code generator
+
+    // Array bounds check elimination
+    std::vector<compForLoop>        m_forLoops;     // Loop variable ranges of "for" loops
+    std::vector<compIndexCheck>     m_indexChecks;  // Bounds checks that may be removable
+    compArraySizeMap                m_arraySizes;   // Smallest DIMmed size of each array variable's dimensions. -1 = not constant
+    compIntSet                      m_aliasedVars;  // Variables that have had their address taken
+    std::vector<vmInt>              m_dimSizes;     // Dimension sizes parsed by the last CompileDimField. -1 = not constant
+    int                             m_regVar;       // Variable whose data reg points to (not an element or field of it). -1 = none
+
+    // Copy-on-write array assignment
+    compIntSet                      m_readLoads;    // LOAD_VAR instructions whose variable is only read
+    int                             m_varLoad;      // LOAD_VAR instruction of the last variable loaded
+
+    // Incremental recompilation
+    std::vector<compCheckpoint>     m_checkpoints;
+    StringVector                    m_compiledSource;   // Source code of the last compile
+    std::vector<vmInstruction>      m_rawCode;          // Program code and labels before the post-compile passes
+    vmLineTable                     m_rawLines;
+    compLabelMap                    m_rawLabels;
+    compLabelIndex                  m_rawLabelIndex;
+    std::vector<vmValType>          m_rawVarTypes;      // Variable types as compiled. (Running the program sets array sizes.)
+    std::vector<std::string>        m_labelOrder;       // Labels in order of declaration
+    std::vector<std::string>        m_constantOrder;    // Program constants in order of declaration
+    std::vector<int>                m_aliasedVarOrder;  // m_aliasedVars in order of insertion
+    std::vector<compArraySizeChange> m_arraySizeChanges;// m_arraySizes changes in order
+    unsigned int                    m_compiledCodeSize; // Instruction count after the last compile
+    unsigned int                    m_compiledFunctions,// Functions, constants and settings of the last compile
+                                    m_compiledConstants;
+    bool                            m_compiledRegisterCode;
+
+    void AddCheckpoint ();
+    void RestoreCheckpoint (compCheckpoint& c, unsigned int changedLine);
+    void VarAliased (int var);
+    void FinishCompile ();
 
     void ClearState ();
     bool GetToken (bool skipEOL = false, bool dataMode = false);
+    void ClassifyText (std::string& text, compIdentClass& c);
     bool CheckParser ();
 
     // Compilation
     void AddInstruction (vmOpCode opCode, vmBasicValType type, const vmValue& val);
+    void AddInstruction (vmOpCode opCode, vmBasicValType type, const vmValue& val, unsigned int line, unsigned int col);
     bool AtSeparator            ();
     bool AtSeparatorOrSpecial   ();
     bool SkipSeparators         ();
     bool CompileInstruction     ();
     bool CompileStructure       ();
-    bool CompileDim             (bool forStruc);
+    bool CompileDim             (bool forStruc, bool reDim = false);
     bool CompileDimField        (std::string& name, vmValType& type, bool forStruc);
     bool CompileLoadVar         ();
     bool CompileDeref           ();
@@ -269,6 +428,14 @@ class TomBasicCompiler : public HasErrorState {
     bool CompileExpressionLoad  (bool mustBeConstant = false);
     bool CompileLoadConst       ();
     bool CompileOperation       ();
+    int  ParseRegTree           (int minOperators);
+    int  ParseRegExpression     (int minBinding);
+    int  ParseRegOperand        ();
+    int  AddRegOperation        (compOperator& o, int left, int right);
+    int  RegisterCount          (int node);
+    void AddRegInstruction      (vmOpCode opCode, int reg, const vmValue& val, unsigned int line, unsigned int col);
+    void CompileRegNode         (int node, int reg, vmBasicValType type);
+    bool CompileRegAssignment   ();
     bool CompileGoto            (vmOpCode jumpType = OP_JUMP);
     bool CompileIf              (bool elseif);
     bool CompileElse            (bool elseif);
@@ -292,10 +459,17 @@ class TomBasicCompiler : public HasErrorState {
     bool CompilePrint           (bool forceNewLine);
     bool CompileInput           ();
     bool CompileLanguage        ();
+    bool IntConstantOperand     (vmInt& value);
+    void VarWritten             (int var);
+    void ClearForLoopRanges     ();
+    void RemoveBoundsChecks     ();
+    void UseCopyOnWrite         ();
 
     bool EvaluateConstantExpression (vmBasicValType& type, vmValue& result, std::string& stringResult);
     bool CompileConstantExpression (vmBasicValType type = VTP_UNDEFINED);
     void InternalCompile        ();
+    void CompileInstructions    ();
+    void FuseInstructions       ();
 
     // Language extension
     std::vector<compUnOperExt>  m_unOperExts;       // Unary operator extensions
@@ -313,6 +487,7 @@ class TomBasicCompiler : public HasErrorState {
         assert (!LabelExists (labelText));
         m_labels [labelText] = label;
         m_labelIndex [label.m_offset] = labelText;
+        m_labelOrder.push_back (labelText);
     }
     compFlowControl& FlowControlTOS () {
         assert (!m_flowControl.empty ());
@@ -336,10 +511,21 @@ public:
     bool            CaseSensitive (){ return m_caseSensitive; }
 
     bool Compile ();
+    bool Recompile ();
+        // Compile the program after its source code has been edited.
+        // Code compiled before the first changed line is kept, and compiling
+        // resumes from the last checkpoint before it. Falls back to Compile if
+        // there is none, or if functions, constants or settings have changed.
+        // Note: The result is the same as Compile.
 
     ////////////
     // Settings
     compLanguageSyntax Syntax() { return m_syntax; }
+    bool RegisterCode ()                        { return m_registerCode; }
+    void SetRegisterCode (bool registerCode)    { m_registerCode = registerCode; }
+        // Numeric expressions are compiled to register machine code when
+        // enabled. Otherwise all expressions are evaluated using reg, reg2
+        // and the stack.
 
     //////////////////////
     // Language extension
@@ -355,8 +541,7 @@ public:
 
     // Functions
     bool IsFunction (std::string& name) {
-        compFuncIndex::iterator i = m_functionIndex.find (LowerCase (name));
-        return i != m_functionIndex.end () && (*i).first == LowerCase (name);
+        return m_functionIndex.find (LowerCase (name)) != m_functionIndex.end ();
     }
     void AddFunction (  std::string         name,
                         vmFunction          func,
@@ -4,6 +4,14 @@
 #pragma hdrstop
 
 #include "compParse.h"
+#ifdef COMP_PARALLEL_LEX
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <unistd.h>
+#endif
+#endif
 
 //---------------------------------------------------------------------------
 
@@ -43,7 +51,7 @@ bool compParser::IsComparison (char c) {
     return c == '<' || c == '=' || c == '>';
 }
 
-compToken compParser::NextToken (bool skipEOL, bool dataMode) {
+compToken compParser::ScanToken (bool skipEOL, bool dataMode) {
 
     ClearError ();
 
@@ -52,6 +60,7 @@ compToken compParser::NextToken (bool skipEOL, bool dataMode) {
     t.m_text    = "";
     t.m_valType = VTP_INT;
     t.m_newLine = m_col == 0;
+    t.m_ident   = -1;
 
     // Skip leading whitespace.
     // Detect newlines
@@ -244,10 +253,346 @@ compToken compParser::NextToken (bool skipEOL, bool dataMode) {
     return t;
 }
 
+#ifdef COMP_PARALLEL_LEX
+static int ProcessorCount () {
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo (&info);
+    return info.dwNumberOfProcessors;
+#else
+    long count = sysconf (_SC_NPROCESSORS_ONLN);
+    return count > 0 ? count : 1;
+#endif
+}
+
+void compLexChunk (compParser& parser) {
+    parser.Lex ();
+}
+
+#ifdef _WIN32
+static DWORD WINAPI LexThread (LPVOID parser) {
+#else
+static void *LexThread (void *parser) {
+#endif
+    compLexChunk (*(compParser *) parser);
+    return 0;
+}
+#endif
+
+void compParser::Lex () {
+    assert (!m_special);
+
+    // Concatenate source code into one buffer
+    unsigned int i, size = 0;
+    for (i = 0; i < m_sourceCode.size (); i++)
+        size += m_sourceCode [i].length ();
+    m_source.clear ();
+    m_source.reserve (size + 1);
+    m_lineStart.clear ();
+    for (i = 0; i < m_sourceCode.size (); i++) {
+        m_lineStart.push_back (m_source.length ());
+        m_source += m_sourceCode [i];
+    }
+
+    // The token read at the end of the source is a single space symbol
+    m_lineStart.push_back (m_source.length ());
+    m_source += ' ';
+
+    // Keep tokens of lines before m_keepLines, and the identifiers they use.
+    // (Identifiers are numbered in order of appearance, so these are the first
+    // ones.)
+    unsigned int keep = 0, identifiers = 0;
+    if (m_keepLines > 0) {
+        unsigned int high = m_tokens.size ();
+        while (keep < high) {
+            unsigned int mid = (keep + high) / 2;
+            if (m_tokens [mid].m_line < m_keepLines)    keep = mid + 1;
+            else                                        high = mid;
+        }
+        for (i = 0; i < keep; i++)
+            if (m_tokens [i].m_ident >= (int) identifiers)
+                identifiers = m_tokens [i].m_ident + 1;
+    }
+    m_tokens.erase (m_tokens.begin () + keep, m_tokens.end ());
+    m_identifiers.erase (m_identifiers.begin () + identifiers, m_identifiers.end ());
+    unsigned int tableSize = 1024;
+    while (tableSize < identifiers * 2 + 2)
+        tableSize *= 2;
+    BuildIdentTable (tableSize);
+    if (keep > 0) {
+        LexTokens (m_keepLines);
+        m_lexed = true;
+        m_lexCount++;
+        return;
+    }
+
+    // Lex tokens. Large sources are split into chunks of lines, which are lexed
+    // in parallel.
+    int chunks = 1;
+#ifdef COMP_PARALLEL_LEX
+    chunks = m_lexThreads > 0 ? m_lexThreads : ProcessorCount ();
+    if (chunks > (int) (m_sourceCode.size () / COMP_LEXCHUNKLINES))
+        chunks = m_sourceCode.size () / COMP_LEXCHUNKLINES;
+#endif
+    if (chunks > 1)
+        LexParallel (chunks);
+    else
+        LexTokens ();
+
+    m_lexed = true;
+    m_lexCount++;
+}
+
+void compParser::LexTokens (unsigned int fromLine) {
+
+    // Scan tokens from the start of line fromLine to the end of the source
+    unsigned int line = m_line, col = m_col;
+    m_line = fromLine;
+    m_col  = 0;
+    bool end;
+    do {
+        end = Eof ();
+        compToken t = ScanToken (false, false);
+        compLexedToken lt;
+        lt.m_type       = t.m_type;
+        lt.m_valType    = t.m_valType;
+        lt.m_error      = Error ();
+        lt.m_length     = t.m_text.length ();
+        lt.m_line       = t.m_line;
+        lt.m_col        = t.m_col;
+        lt.m_ident      = t.m_type == CTT_TEXT && !lt.m_error
+                            ? Intern (m_lineStart [t.m_line] + t.m_col, lt.m_length)
+                            : -1;
+        m_tokens.push_back (lt);
+        ClearError ();
+    } while (!end);
+
+    m_line  = line;
+    m_col   = col;
+}
+
+void compParser::LexParallel (int chunks) {
+#ifdef COMP_PARALLEL_LEX
+
+    // Tokens never span lines, and each line is scanned from the same state.
+    // So each chunk of lines can be lexed separately by its own parser, and the
+    // results joined together.
+    std::vector<compParser> parsers (chunks);
+    unsigned int size = m_sourceCode.size ();
+    int c;
+    for (c = 0; c < chunks; c++) {
+        parsers [c].m_sourceCode.assign (   m_sourceCode.begin () + size * c / chunks,
+                                            m_sourceCode.begin () + size * (c + 1) / chunks);
+        parsers [c].m_lexThreads = 1;
+    }
+
+    // Lex the first chunk on this thread, and the rest on their own threads.
+    // (If a thread can't be created, its chunk is lexed on this thread.)
+#ifdef _WIN32
+    std::vector<HANDLE> threads (chunks);
+    for (c = 1; c < chunks; c++)
+        threads [c] = CreateThread (NULL, 0, LexThread, &parsers [c], 0, NULL);
+#else
+    std::vector<pthread_t> threads (chunks);
+    std::vector<bool> started (chunks, false);
+    for (c = 1; c < chunks; c++)
+        started [c] = pthread_create (&threads [c], NULL, LexThread, &parsers [c]) == 0;
+#endif
+    parsers [0].Lex ();
+    for (c = 1; c < chunks; c++) {
+#ifdef _WIN32
+        if (threads [c] != NULL) {
+            WaitForSingleObject (threads [c], INFINITE);
+            CloseHandle (threads [c]);
+        }
+#else
+        if (started [c])
+            pthread_join (threads [c], NULL);
+#endif
+        else
+            parsers [c].Lex ();
+    }
+
+    // Join the tokens. Lines are offset to the chunk's position in the source,
+    // and identifiers are interned into this parser's table. (Which numbers
+    // them in order of first appearance, the same as lexing in one pass.)
+    unsigned int count = 0;
+    for (c = 0; c < chunks; c++)
+        count += parsers [c].m_tokens.size ();
+    m_tokens.reserve (count);
+    for (c = 0; c < chunks; c++) {
+        compParser& parser = parsers [c];
+        unsigned int firstLine  = size * c / chunks;
+        unsigned int start      = m_lineStart [firstLine];
+        std::vector<int> identifiers (parser.m_identifiers.size ());
+        unsigned int i;
+        for (i = 0; i < identifiers.size (); i++)
+            identifiers [i] = Intern (  start + parser.m_identifiers [i].m_start,
+                                        parser.m_identifiers [i].m_length);
+
+        // Each chunk ends with the token read at the end of its source. Only
+        // the last chunk's is kept.
+        count = parser.m_tokens.size () - (c + 1 < chunks ? 1 : 0);
+        for (i = 0; i < count; i++) {
+            compLexedToken t = parser.m_tokens [i];
+            t.m_line += firstLine;
+            if (t.m_ident >= 0)
+                t.m_ident = identifiers [t.m_ident];
+            m_tokens.push_back (t);
+        }
+    }
+#else
+    LexTokens ();
+#endif
+}
+
+static unsigned int HashText (const char *text, unsigned int length) {
+
+    // FNV-1a hash
+    unsigned int hash = 2166136261u;
+    for (unsigned int i = 0; i < length; i++)
+        hash = (hash ^ (unsigned char) text [i]) * 16777619u;
+    return hash;
+}
+
+int compParser::Intern (unsigned int start, unsigned int length) {
+
+    // Find identifier in the table (linear probing)
+    const char *text = m_source.data () + start;
+    unsigned int mask = m_identTable.size () - 1;
+    unsigned int i;
+    for (i = HashText (text, length) & mask; m_identTable [i] != 0; i = (i + 1) & mask) {
+        compIdentifier& ident = m_identifiers [m_identTable [i] - 1];
+        if (ident.m_length == length && m_source.compare (ident.m_start, length, text, length) == 0)
+            return m_identTable [i] - 1;
+    }
+
+    // Not found. Add it
+    compIdentifier ident;
+    ident.m_start   = start;
+    ident.m_length  = length;
+    m_identifiers.push_back (ident);
+    m_identTable [i] = m_identifiers.size ();
+
+    // Keep the table at most half full
+    if (m_identifiers.size () * 2 > m_identTable.size ())
+        BuildIdentTable (m_identTable.size () * 2);
+    return m_identifiers.size () - 1;
+}
+
+void compParser::BuildIdentTable (unsigned int size) {
+
+    // Build hash table of identifiers. (Size must be a power of 2.)
+    m_identTable.assign (size, 0);
+    unsigned int mask = size - 1;
+    for (unsigned int j = 0; j < m_identifiers.size (); j++) {
+        compIdentifier& ident = m_identifiers [j];
+        unsigned int i;
+        for (    i = HashText (m_source.data () + ident.m_start, ident.m_length) & mask;
+                m_identTable [i] != 0;
+                i = (i + 1) & mask)
+            ;
+        m_identTable [i] = j + 1;
+    }
+}
+
+void compParser::TokenEnd (compLexedToken& t, unsigned int& line, unsigned int& col) {
+
+    // Find the position after a token has been read
+    line = t.m_line;
+    col  = t.m_col;
+    if (line >= m_sourceCode.size ())
+        return;                                 // End of source. (Position doesn't change)
+    if (t.m_type == CTT_EOL) {
+        line++;
+        col = 0;
+    }
+    else if (t.m_type == CTT_CONSTANT && t.m_valType == VTP_STRING)
+        col += t.m_length + 2;                  // Text excludes the quotes
+    else
+        col += t.m_length;
+}
+
+bool compParser::FindToken () {
+
+    // Find the token that will be read next from the current position.
+    // This is the first token that ends after it.
+    unsigned int first = 0, last = m_tokens.size () - 1;
+    while (first < last) {
+        unsigned int mid = (first + last) / 2, line, col;
+        TokenEnd (m_tokens [mid], line, col);
+        if (line > m_line || (line == m_line && col > m_col))
+            last = mid;
+        else
+            first = mid + 1;
+    }
+
+    // Position must not be part way through the token (or a comment). The
+    // caller must scan the token instead.
+    compLexedToken& t = m_tokens [first];
+    if (t.m_line < m_line || (t.m_line == m_line && t.m_col < m_col))
+        return false;
+
+    m_tokenIndex = first;
+    return true;
+}
+
+compToken compParser::NextToken (bool skipEOL, bool dataMode) {
+
+    // Special mode and DATA elements are scanned a character at a time
+    if (m_special)
+        return ScanToken (skipEOL, dataMode);
+    if (dataMode) {
+        m_tokenIndex = -1;
+        return ScanToken (skipEOL, dataMode);
+    }
+
+    // Find next token
+    ClearError ();
+    if (!m_lexed)
+        Lex ();
+    if (m_tokenIndex < 0 && !FindToken ())
+        return ScanToken (skipEOL, dataMode);
+
+    // Skip end of lines.
+    // (Except the last one, which is returned instead of the token at the end
+    // of the source.)
+    int i = m_tokenIndex;
+    bool newLine = m_col == 0;
+    if (skipEOL)
+        while (m_tokens [i].m_type == CTT_EOL && i + 2 < (int) m_tokens.size ()) {
+            i++;
+            newLine = true;
+        }
+    compLexedToken& lt = m_tokens [i];
+
+    // Scan tokens with errors again, to report the error
+    if (lt.m_error)
+        return ScanToken (skipEOL, dataMode);
+
+    // Read token
+    compToken t;
+    t.m_type    = (compTokenType) lt.m_type;
+    t.m_valType = (vmBasicValType) lt.m_valType;
+    t.m_newLine = newLine || t.m_type == CTT_EOL;
+    t.m_ident   = lt.m_ident;
+    t.m_line    = lt.m_line;
+    t.m_col     = lt.m_col;
+    if (lt.m_length > 0)
+        t.m_text.assign (   m_source,
+                            m_lineStart [lt.m_line] + lt.m_col + (t.m_type == CTT_CONSTANT && t.m_valType == VTP_STRING ? 1 : 0),
+                            lt.m_length);
+
+    // Move past it
+    TokenEnd (lt, m_line, m_col);
+    m_tokenIndex = i + 1 < (int) m_tokens.size () ? i + 1 : i;
+    return t;
+}
+
 compToken compParser::PeekToken (bool skipEOL, bool dataMode) {
 
     // Save position
-    int line = m_line, col = m_col;
+    int line = m_line, col = m_col, tokenIndex = m_tokenIndex;
 
     // Read token
     compToken t = NextToken (skipEOL, dataMode);
@@ -255,8 +600,9 @@ compToken compParser::PeekToken (bool skipEOL, bool dataMode) {
     // Restore position. (Except on error, when we leave the cursor pointing to
     // the error position.)
     if (!Error ()) {
-        m_line  = line;
-        m_col   = col;
+        m_line          = line;
+        m_col           = col;
+        m_tokenIndex    = tokenIndex;
     }
 
     return t;
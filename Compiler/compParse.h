@@ -10,6 +10,14 @@
 #include "../VM/vmTypes.h"
 #include "../VM/TomVM.h"
 
+// Large source files are lexed in chunks of lines on multiple threads (see
+// compParser::SetLexThreads). Define COMP_NO_PARALLEL_LEX to disable this.
+#ifndef COMP_NO_PARALLEL_LEX
+#define COMP_PARALLEL_LEX
+#endif
+
+#define COMP_LEXCHUNKLINES  2000        // Minimum number of lines in each chunk lexed by a thread
+
 enum compTokenType {
         CTT_CONSTANT,
         CTT_TEXT,           // Could be a variable, function name, keyword e.t.c...
@@ -28,9 +36,28 @@ struct compToken {
     compTokenType   m_type;
     vmBasicValType  m_valType;              // For constants. Defines the value type.
     bool            m_newLine;              // True if immediately preceeded by newline
+    int             m_ident;                // Interned identifier (see compParser::Identifier). -1 if not an identifier from the source code
     unsigned int m_line, m_col;
 };
 
+// compLexedToken
+//
+// A token in the parser's pre-lexed token array. Text is not stored, but
+// referenced by position in the parser's source buffer.
+struct compLexedToken {
+    unsigned char   m_type;                 // (compTokenType)
+    signed char     m_valType;              // (vmBasicValType)
+    bool            m_error;                // Lexing error. (The token is scanned again when read, to report it.)
+    unsigned int    m_length;               // Length of text
+    int             m_ident;                // Interned identifier, or -1
+    unsigned int    m_line, m_col;
+};
+
+struct compIdentifier {
+    unsigned int    m_start;                // Position in source buffer
+    unsigned int    m_length;
+};
+
 #ifndef StringVector
 typedef std::vector<std::string> StringVector;
 #endif
@@ -49,17 +76,49 @@ class compParser : public HasErrorState {
     // State
     unsigned int m_line, m_col;
 
+    // Pre-lexed tokens.
+    // The first time a token is read after Reset, the whole source code is
+    // lexed into m_tokens. (After ResetFrom, only the changed lines are.) Reading a token then just indexes into the array.
+    // Identifiers are interned, so that each distinct identifier has a single
+    // index.
+    // Special mode text and DATA statement elements (which have different
+    // lexing rules) are still scanned a character at a time.
+    bool                            m_lexed;
+    unsigned int                    m_lexCount;         // Number of times the source has been lexed
+    unsigned int                    m_keepLines;        // Lines whose tokens are kept by the next lex (see ResetFrom)
+    int                             m_lexThreads;       // Maximum threads used to lex. 0 = One per processor
+    std::string                     m_source;           // Source code lines, concatenated
+    std::vector<unsigned int>       m_lineStart;        // Position of each line in m_source
+    std::vector<compLexedToken>     m_tokens;           // Tokens, in source order. The last is the one read at the end of the source.
+    int                             m_tokenIndex;       // Next token. -1 = Find from line and col
+    std::vector<compIdentifier>     m_identifiers;
+    std::vector<int>                m_identTable;       // Hash table of identifier index + 1. (0 = empty)
+
+    void Lex ();
+    void LexTokens (unsigned int fromLine = 0);
+    void LexParallel (int chunks);
+    friend void compLexChunk (compParser& parser);
+    int Intern (unsigned int start, unsigned int length);
+    void BuildIdentTable (unsigned int size);
+    bool FindToken ();
+    void TokenEnd (compLexedToken& t, unsigned int& line, unsigned int& col);
+
     // Reading
     char GetChar (bool inString);
     char PeekChar (bool inString);
-    std::string Text () { assert (!Eof ()); return m_sourceCode [m_line]; }
+    const std::string& Text () { assert (!Eof ()); return m_sourceCode [m_line]; }
     bool IsNumber (char c);
     bool IsComparison (char c);
+    compToken ScanToken (bool skipEOL, bool dataMode);
 public:
-    compParser ()               { Reset (); }
+    compParser () : m_lexCount (0), m_lexThreads (0) { Reset (); }
     StringVector& SourceCode () { return m_sourceCode; }
-    void SetPos (int line, int col) { SetNormal (); m_line = line; m_col = col; ClearError (); }
-    void Reset ()               { SetPos (0, 0); }
+    void SetPos (int line, int col) { SetNormal (); m_line = line; m_col = col; m_tokenIndex = -1; ClearError (); }
+    void Reset ()               { m_lexed = false; m_keepLines = 0; SetPos (0, 0); }
+        // Note: Reset must be called after the source code is changed
+    void ResetFrom (unsigned int line) { Reset (); m_keepLines = line; }
+        // Like Reset, when only lines from line onwards have changed since the
+        // source code was last lexed. Tokens before line are kept.
     int Line ()                 { return m_line; }
     int Col ()                  { return m_col; }
     bool Eof () {
@@ -72,6 +131,24 @@ public:
         // "dataMode" is set to true when reading elements of a "DATA" statement.
         // (Slightly different parsing rules apply.)
 
+    // Lexing threads
+    // Source code with at least 2 x COMP_LEXCHUNKLINES lines is split into
+    // chunks that are lexed in parallel. The resulting tokens are the same
+    // either way.
+    void SetLexThreads (int count)      { m_lexThreads = count; }      // 0 = One per processor. 1 = Don't use threads
+    int LexThreads ()                   { return m_lexThreads; }
+
+    // Interned identifiers
+    // Note: Identifier indices change each time the source is lexed (after Reset),
+    // which can be detected by LexCount changing. (ResetFrom keeps the indices
+    // of identifiers in the unchanged lines.)
+    unsigned int LexCount ()            { return m_lexCount; }
+    int IdentifierCount ()              { return m_identifiers.size (); }
+    std::string Identifier (int index) {
+        assert (index >= 0 && index < IdentifierCount ());
+        return m_source.substr (m_identifiers [index].m_start, m_identifiers [index].m_length);
+    }
+
     // Special mode
     bool Special ()                     { return m_special; }
     void SetSpecial (std::string& text, int line = -1, int col = -1) {
@@ -85,6 +162,8 @@ public:
         else            m_specialSourceCol = m_col;
     }
     void SetNormal ()                   { m_special = false; }
+    unsigned int SpecialCol ()          { return m_specialCol; }
+    void SetSpecialCol (unsigned int col) { m_special = true; m_specialCol = col; ClearError (); }
 
 };
 
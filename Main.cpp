@@ -13,6 +13,8 @@
 
 #include <fstream>
 #include <iostream>
+#include <sstream>
+#include <ctime>
 #include "Compiler/TomComp.h"
 #include "FunctionLibs/TomStdBasicLib.h"
 #include "FunctionLibs/TomTrigBasicLib.h"
@@ -31,16 +33,7 @@ char buffer[1024];
 void WrapPrint(TomVM& vm) {cout << vm.GetStringParam(1).c_str();}
 void WrapPrintr(TomVM& vm) {cout << vm.GetStringParam(1).c_str() << endl;}
 
-void startCompiler () {
-	cout << "TomBasicCore BASIC compiler and virtual machine (C) Tom Mulgrew 2003-2004" << endl;
-	cout << "Ported to linux by Jon Snape (Supermonkey) 2006"<< endl;
-	cout << "OpenGL implimentation for linux port added by Davy Wybiral 2006"<< endl;
-	cout << endl;
-
-	// Create compiler and virtual machine
-	TomVM vm;
-	TomBasicCompiler comp(vm);
-	FileOpener files;
+void registerFunctions (TomBasicCompiler& comp, FileOpener& files) {
 
 	// Register function wrappers
 	comp.AddFunction("print",  WrapPrint,  compParamTypeList()<<VTP_STRING, false, false, VTP_INT);
@@ -54,6 +47,19 @@ void startCompiler () {
 	InitTomFileIOBasicLib(comp, &files);
 	InitTomWindowsBasicLib(comp, &files);
 	InitDavyFunctionLib(comp);
+}
+
+void startCompiler () {
+	cout << "TomBasicCore BASIC compiler and virtual machine (C) Tom Mulgrew 2003-2004" << endl;
+	cout << "Ported to linux by Jon Snape (Supermonkey) 2006"<< endl;
+	cout << "OpenGL implimentation for linux port added by Davy Wybiral 2006"<< endl;
+	cout << endl;
+
+	// Create compiler and virtual machine
+	TomVM vm;
+	TomBasicCompiler comp(vm);
+	FileOpener files;
+	registerFunctions(comp, files);
 
 	// Open File, read sourcecode
 	cout<<"Opening file "<<srcFile<<"..."<<endl;
@@ -85,7 +91,73 @@ void startCompiler () {
 	else cout << endl << "Done!" << endl;
 }
 
+// Compile time scaling benchmark.
+// Generates programs with increasing numbers of variables (and some structures)
+// and times how long each takes to compile. Compile time should grow roughly
+// linearly with the number of variables. Recompiling after an edit to the last
+// line should only take a fraction of that.
+void compileBenchmark () {
+	int counts[] = { 1000, 3000, 10000, 30000, 100000 };
+	for (int c = 0; c < 5; c++) {
+		int count = counts[c];
+		TomVM vm;
+		TomBasicCompiler comp(vm);
+		FileOpener files;
+		registerFunctions(comp, files);
+
+		// Generate program. Each group of 3 variables is declared then used,
+		// with a structure type and structure variable every 100 groups.
+		vector<string>& source = comp.Parser().SourceCode();
+		for (int i = 0; i < count / 3; i++) {
+			ostringstream line;
+			line << "dim var" << i << ", real" << i << "#, text" << i << "$";
+			source.push_back(line.str());
+			if (i % 100 == 0) {
+				ostringstream struc;
+				struc << "struc SType" << i << ": dim x, y#, name$: endstruc: dim SType" << i << " s" << i;
+				source.push_back(struc.str());
+			}
+			ostringstream use;
+			use << "var" << i << " = var" << i / 2 << " * 2 + " << i
+				<< ": real" << i << "# = real" << i / 3 << "# / 3.0"
+				<< ": text" << i << "$ = \"text \" + var" << i;
+			if (i >= 100)
+				use << ": s" << i / 100 * 100 << ".x = var" << i;
+			source.push_back(use.str());
+		}
+
+		// Compile
+		clock_t start = clock();
+		comp.ClearError();
+		comp.Compile();
+		clock_t end = clock();
+		if (comp.Error()) {
+			cout << "COMPILE ERROR!: " << comp.GetError().c_str() << endl;
+			return;
+		}
+		cout << count << " variables, " << source.size() << " lines: "
+			<< (end - start) * 1000 / CLOCKS_PER_SEC << "ms";
+
+		// Edit the last line and recompile
+		source.back() += ": var0 = 1";
+		start = clock();
+		comp.Recompile();
+		end = clock();
+		if (comp.Error()) {
+			cout << endl << "COMPILE ERROR!: " << comp.GetError().c_str() << endl;
+			return;
+		}
+		cout << ", recompile after editing last line: "
+			<< (end - start) * 1000 / CLOCKS_PER_SEC << "ms" << endl;
+	}
+}
+
 int main (int argc, char* argv[]) {
+	// Compile time benchmark (no window required)
+	if(argc==2 && string(argv[1])=="-compilebench") {
+		compileBenchmark();
+		return 0;
+	}
 	// Set srcFile & catch argument errors
 	if(argc==2) {srcFile = argv[1];}
 	else {cout << "Incorrect number of arguments!" << endl; return 0;}
@@ -8,6 +8,11 @@
 #pragma hdrstop
 
 #include "TomVM.h"
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
 
 //---------------------------------------------------------------------------
 
@@ -18,7 +23,7 @@
 const char *blankString = "";
 
 std::string streamHeader = "Basic4GL stream";
-int         streamVersion = 1;
+int         streamVersion = 3;
 
 ////////////////////////////////////////////////////////////////////////////////
 // TomVM
@@ -27,7 +32,23 @@ TomVM::TomVM (int maxDataSize)
         :   m_data              (maxDataSize),
             m_variables         (m_data, m_dataTypes),
             m_strings           (blankString),
-            m_stack             (m_strings) {
+            m_stringCollectAt   (VM_MINSTRINGCOLLECT),
+            m_reclaimedStrings  (0),
+            m_heapCollectAt     (VM_MINHEAPCOLLECT),
+            m_reclaimedBlocks   (0),
+            m_savedTempStart    (-1),
+            m_stack             (m_strings),
+            m_copyOnWrite       (false),
+            m_stepCount         (0),
+            m_outOfSteps        (false),
+            m_timeSlice         (VM_MINTIMESLICE),
+            m_handlersValid     (0),
+            m_jitEnabled        (false) {
+#ifdef VM_THREADED_DISPATCH
+    m_threaded = true;
+#else
+    m_threaded = false;
+#endif
     New ();
 }
 
@@ -44,6 +65,8 @@ void TomVM::New () {
 
     // Deallocate code
     m_code.clear ();
+    m_lines.Clear ();
+    CodeChanged (0);
     m_typeSet.Clear ();
     m_ip = 0;
     m_paused = false;
@@ -54,12 +77,43 @@ void TomVM::New () {
     m_breakPtsPatched = false;
 }
 
+void TomVM::RestoreProgram (const std::vector<vmInstruction>& code, const vmLineTable& lines, unsigned int size) {
+    assert (size <= code.size ());
+
+    // Clear variables and data
+    Clr ();
+
+    // Replace code
+    m_code.assign (code.begin (), code.begin () + size);
+    m_lines = lines;
+    m_lines.Rollback (size);
+    CodeChanged (0);
+    m_ip = 0;
+    m_paused = false;
+
+    // Patched breakpoints refer to the old code
+    m_patchedBreakPts.clear ();
+    m_tempBreakPts.clear ();
+    m_breakPtsPatched = false;
+}
+
 void TomVM::Clr () {
+    UnresolveVars ();                   // Instructions refer to variable data
     m_variables.Deallocate ();          // Deallocate variables
     m_data.Clear ();                    // Deallocate variable data
     m_strings.Clear ();                 // Clear strings
+    m_stringCollectAt   = VM_MINSTRINGCOLLECT;
+    m_reclaimedStrings  = 0;
+    m_heapCollectAt     = VM_MINHEAPCOLLECT;
+    m_reclaimedBlocks   = 0;
+    m_savedTempStart    = -1;
+    m_copyPlans.clear ();               // Structure types may change
+    m_deferredCopies.clear ();
     m_stack.Clear ();                   // Clear runtime stacks
     m_callStack.clear ();
+#ifdef VM_JIT
+    m_jit.Clear ();                     // Compiled loops refer to variable data
+#endif
 
     // Clear resources
     ClearResources ();
@@ -117,34 +171,384 @@ char    *ErrNotImplemented          = "Opcode not implemented",
         *ErrDataIsString            = "Expected to READ a number, got a text string instead";
 
 void TomVM::Continue (unsigned int steps) {
+
+    // Note: The step budget is only checked on backward jumps, gosubs and
+    // returns, so the VM may run a little past "steps" before returning
+    // control (but never past the end of the current loop iteration).
+    // StepCount () returns the exact number of instructions executed.
     ClearError ();
     m_paused = false;
+    m_stepCount = 0;
+    m_outOfSteps = false;
+    if (steps == 0)
+        return;
+
+#ifdef VM_THREADED_DISPATCH
+    if (m_threaded) {
+        Execute<true> (steps);
+        return;
+    }
+#endif
+    Execute<false> (steps);
+}
+
+static double TimeInMicroseconds () {
+#ifdef _WIN32
+    LARGE_INTEGER freq, count;
+    QueryPerformanceFrequency (&freq);
+    QueryPerformanceCounter (&count);
+    return (double) count.QuadPart * 1000000.0 / (double) freq.QuadPart;
+#else
+    // Monotonic clock, so time slices are unaffected by system clock changes
+    timespec t;
+    clock_gettime (CLOCK_MONOTONIC, &t);
+    return (double) t.tv_sec * 1000000.0 + (double) t.tv_nsec / 1000.0;
+#endif
+}
+
+void TomVM::ContinueFor (unsigned int microseconds) {
+
+    // Continue execution until the program stops by itself (error, breakpoint,
+    // TIMESHARE, end of program e.t.c) or the deadline passes.
+    // The program is run in slices of m_timeSlice steps, and the clock is
+    // checked between slices. The slice size is adjusted so that each slice
+    // takes a fraction of the time remaining.
+    double start = TimeInMicroseconds (), now = start;
+    double deadline = start + microseconds;
+    unsigned int total = 0;
+    do {
+        double sliceStart = now;
+        Continue (m_timeSlice);
+        total += m_stepCount;
+        now = TimeInMicroseconds ();
+
+        // Adapt slice size to measured execution speed
+        double elapsed = now - sliceStart;
+        double remaining = deadline - now;
+        if (elapsed <= 0)
+            m_timeSlice = m_timeSlice < VM_MAXTIMESLICE / 2 ? m_timeSlice * 2 : VM_MAXTIMESLICE;
+        else if (remaining > 0) {
+            double slice = (double) m_stepCount / elapsed * remaining / 2;
+            m_timeSlice =   slice < VM_MINTIMESLICE ? VM_MINTIMESLICE
+                          : slice > VM_MAXTIMESLICE ? VM_MAXTIMESLICE
+                          : (unsigned int) slice;
+        }
+    } while (m_outOfSteps && now < deadline);
+    m_stepCount = total;
+}
+
+#ifdef VM_JIT
+void TomVM::RunLoop (vmJitLoop& loop, unsigned int& stepCount, unsigned int steps) {
+
+    // Run compiled loop from the current instruction.
+    // Returns when execution leaves the loop, or reaches an instruction that
+    // must be run by the interpreter.
+    vmJitContext context;
+    if (!m_deferredCopies.empty ())
+        CompleteCopies ();              // Native code loads variables directly
+    unsigned int budget = steps - stepCount;
+    if (budget > 0x7fffffff)
+        budget = 0x7fffffff;
+    context.reg         = m_reg;
+    context.reg2        = m_reg2;
+    context.steps       = budget;
+    context.data        = &m_data.Data () [0];
+    context.regFile     = m_regFile;
+    loop.m_entry (&context);
+
+    // Copy state back
+    m_reg   = context.reg;
+    m_reg2  = context.reg2;
+    for (int i = 0; i < context.stackSize; i++)
+        m_stack.Push (context.stack [i]);
+    m_ip = context.ip;
+    stepCount += budget - context.steps;
+}
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+// Instruction dispatch
+//
+// Execute() is instantiated twice. Execute<false> is the portable version, and
+// dispatches every instruction through the switch statement.
+// Execute<true> uses "labels as values" (GCC/Clang). Each instruction in m_code
+// is pre-decoded into the address of its handler (m_handlers), and every
+// handler jumps directly to the next handler, instead of returning to a
+// central switch.
+// Both versions share the same handler code below.
+
+#ifdef VM_THREADED_DISPATCH
+#define VM_HANDLER(op)          case op: handler_##op:
+#define VM_INVALID_HANDLER      handler_invalid:
+#define VM_REGISTER_HANDLER(op) table [op] = &&handler_##op
+#define VM_DISPATCH             do {                                        \
+                                    if (!threaded) goto step;               \
+                                    instruction = code + m_ip;              \
+                                    goto *handlers [m_ip];                  \
+                                } while (false)
+#else
+#define VM_HANDLER(op)          case op:
+#define VM_INVALID_HANDLER
+#define VM_DISPATCH             goto step
+#endif
+#define VM_NEXT                 do { m_ip++; VM_DISPATCH; } while (false)
+
+// Rewrite the current instruction to access variable data directly (see
+// ResolveVar), and re-decode it.
+#ifdef VM_THREADED_DISPATCH
+#define VM_RESOLVE_VAR(op, dataIndex)                                       \
+                                do {                                        \
+                                    ResolveVar (m_ip, (op), (dataIndex));   \
+                                    if (threaded)                           \
+                                        handlers [m_ip] = handlerTable [op];\
+                                } while (false)
+#else
+#define VM_RESOLVE_VAR(op, dataIndex) ResolveVar (m_ip, (op), (dataIndex))
+#endif
+
+// Step accounting
+// Steps are not counted per instruction. Instead each taken branch charges
+// the straight line block of instructions that led up to it (blockStart to
+// m_ip inclusive). The step budget is only checked on backward branches and
+// on gosub calls and returns, as every loop passes through one of these.
+#define VM_BRANCH(target)       do {                                        \
+                                    unsigned int dest = (target);           \
+                                    stepCount += m_ip + 1 - blockStart;     \
+                                    bool backward = dest <= m_ip;           \
+                                    m_ip = blockStart = dest;               \
+                                    if (backward && stepCount >= steps)     \
+                                        goto outOfSteps;                    \
+                                    VM_DISPATCH;                            \
+                                } while (false)
+#define VM_BRANCH_CHECKED(target) do {                                      \
+                                    stepCount += m_ip + 1 - blockStart;     \
+                                    m_ip = blockStart = (target);           \
+                                    if (stepCount >= steps)                 \
+                                        goto outOfSteps;                    \
+                                    VM_DISPATCH;                            \
+                                } while (false)
+
+// Register machine operands
+#define VM_RD                   m_regFile [(byte) instruction->m_type]
+#define VM_RA                   m_regFile [instruction->m_value.IntVal () & 0xff]
+#define VM_RB                   m_regFile [(instruction->m_value.IntVal () >> 8) & 0xff]
+
+template<bool threaded> void TomVM::Execute (unsigned int steps) {
 
     ////////////////////////////////////////////////////////////////////////////
     // Virtual machine main loop
     vmInstruction *instruction;
-    unsigned int stepCount = 0;
+    unsigned int stepCount = 0, blockStart = m_ip;
     vmValue temp;
     unsigned int tempI;
 
-    goto step;
-
-nextStep:
-
-    // Proceed to next instruction
-    m_ip++;
+    vmInstruction *code = m_code.empty () ? NULL : &m_code [0];
+#ifdef VM_THREADED_DISPATCH
+    const void **handlers = NULL;
+
+    // Build handler lookup table (once only).
+    // Handler addresses can only be taken inside this function, so the
+    // table is built by the initialiser of a function static. (These are
+    // initialised under a lock, so VMs running for the first time on
+    // different threads don't race to build it.)
+    static const void *const *handlerTable = ({
+        static const void *table [256];
+        for (int i = 0; i < 256; i++)
+            table [i] = &&handler_invalid;
+        VM_REGISTER_HANDLER (OP_NOP);
+        VM_REGISTER_HANDLER (OP_END);
+        VM_REGISTER_HANDLER (OP_LOAD_CONST);
+        VM_REGISTER_HANDLER (OP_LOAD_VAR);
+        VM_REGISTER_HANDLER (OP_DEREF);
+        VM_REGISTER_HANDLER (OP_ADD_CONST);
+        VM_REGISTER_HANDLER (OP_ARRAY_INDEX);
+        VM_REGISTER_HANDLER (OP_ARRAY_INDEX_UNCHECKED);
+        VM_REGISTER_HANDLER (OP_ARRAY_INDEX_N);
+        VM_REGISTER_HANDLER (OP_ARRAY_INDEX_FIELD);
+        VM_REGISTER_HANDLER (OP_PUSH);
+        VM_REGISTER_HANDLER (OP_POP);
+        VM_REGISTER_HANDLER (OP_SAVE);
+        VM_REGISTER_HANDLER (OP_COPY);
+        VM_REGISTER_HANDLER (OP_DECLARE);
+        VM_REGISTER_HANDLER (OP_JUMP);
+        VM_REGISTER_HANDLER (OP_JUMP_TRUE);
+        VM_REGISTER_HANDLER (OP_JUMP_FALSE);
+        VM_REGISTER_HANDLER (OP_OP_NEG);
+        VM_REGISTER_HANDLER (OP_OP_PLUS);
+        VM_REGISTER_HANDLER (OP_OP_MINUS);
+        VM_REGISTER_HANDLER (OP_OP_TIMES);
+        VM_REGISTER_HANDLER (OP_OP_DIV);
+        VM_REGISTER_HANDLER (OP_OP_MOD);
+        VM_REGISTER_HANDLER (OP_OP_NOT);
+        VM_REGISTER_HANDLER (OP_OP_EQUAL);
+        VM_REGISTER_HANDLER (OP_OP_NOT_EQUAL);
+        VM_REGISTER_HANDLER (OP_OP_GREATER);
+        VM_REGISTER_HANDLER (OP_OP_GREATER_EQUAL);
+        VM_REGISTER_HANDLER (OP_OP_LESS);
+        VM_REGISTER_HANDLER (OP_OP_LESS_EQUAL);
+        VM_REGISTER_HANDLER (OP_CONV_INT_REAL);
+        VM_REGISTER_HANDLER (OP_CONV_INT_REAL2);
+        VM_REGISTER_HANDLER (OP_CONV_REAL_INT);
+        VM_REGISTER_HANDLER (OP_CONV_REAL_INT2);
+        VM_REGISTER_HANDLER (OP_CONV_INT_STRING);
+        VM_REGISTER_HANDLER (OP_CONV_REAL_STRING);
+        VM_REGISTER_HANDLER (OP_CONV_INT_STRING2);
+        VM_REGISTER_HANDLER (OP_CONV_REAL_STRING2);
+        VM_REGISTER_HANDLER (OP_OP_AND);
+        VM_REGISTER_HANDLER (OP_OP_OR);
+        VM_REGISTER_HANDLER (OP_OP_XOR);
+        VM_REGISTER_HANDLER (OP_OP_NEG_INT);
+        VM_REGISTER_HANDLER (OP_OP_NEG_REAL);
+        VM_REGISTER_HANDLER (OP_OP_PLUS_INT);
+        VM_REGISTER_HANDLER (OP_OP_PLUS_REAL);
+        VM_REGISTER_HANDLER (OP_OP_PLUS_STRING);
+        VM_REGISTER_HANDLER (OP_OP_MINUS_INT);
+        VM_REGISTER_HANDLER (OP_OP_MINUS_REAL);
+        VM_REGISTER_HANDLER (OP_OP_TIMES_INT);
+        VM_REGISTER_HANDLER (OP_OP_TIMES_REAL);
+        VM_REGISTER_HANDLER (OP_OP_DIV_INT);
+        VM_REGISTER_HANDLER (OP_OP_DIV_REAL);
+        VM_REGISTER_HANDLER (OP_OP_MOD_INT);
+        VM_REGISTER_HANDLER (OP_OP_EQUAL_INT);
+        VM_REGISTER_HANDLER (OP_OP_EQUAL_REAL);
+        VM_REGISTER_HANDLER (OP_OP_EQUAL_STRING);
+        VM_REGISTER_HANDLER (OP_OP_NOT_EQUAL_INT);
+        VM_REGISTER_HANDLER (OP_OP_NOT_EQUAL_REAL);
+        VM_REGISTER_HANDLER (OP_OP_NOT_EQUAL_STRING);
+        VM_REGISTER_HANDLER (OP_OP_GREATER_INT);
+        VM_REGISTER_HANDLER (OP_OP_GREATER_REAL);
+        VM_REGISTER_HANDLER (OP_OP_GREATER_STRING);
+        VM_REGISTER_HANDLER (OP_OP_GREATER_EQUAL_INT);
+        VM_REGISTER_HANDLER (OP_OP_GREATER_EQUAL_REAL);
+        VM_REGISTER_HANDLER (OP_OP_GREATER_EQUAL_STRING);
+        VM_REGISTER_HANDLER (OP_OP_LESS_INT);
+        VM_REGISTER_HANDLER (OP_OP_LESS_REAL);
+        VM_REGISTER_HANDLER (OP_OP_LESS_STRING);
+        VM_REGISTER_HANDLER (OP_OP_LESS_EQUAL_INT);
+        VM_REGISTER_HANDLER (OP_OP_LESS_EQUAL_REAL);
+        VM_REGISTER_HANDLER (OP_OP_LESS_EQUAL_STRING);
+        VM_REGISTER_HANDLER (OP_LOAD_VAR_DEREF);
+        VM_REGISTER_HANDLER (OP_LOAD_VAR_PUSH);
+        VM_REGISTER_HANDLER (OP_PUSH_VAR);
+        VM_REGISTER_HANDLER (OP_PUSH_CONST);
+        VM_REGISTER_HANDLER (OP_POP_SAVE);
+        VM_REGISTER_HANDLER (OP_POP_ARRAY_INDEX);
+        VM_REGISTER_HANDLER (OP_POP_ARRAY_INDEX_UNCHECKED);
+        VM_REGISTER_HANDLER (OP_POP_PLUS_STRING);
+        VM_REGISTER_HANDLER (OP_POP_AND);
+        VM_REGISTER_HANDLER (OP_POP_OR);
+        VM_REGISTER_HANDLER (OP_POP_XOR);
+        VM_REGISTER_HANDLER (OP_POP_PLUS_INT);
+        VM_REGISTER_HANDLER (OP_POP_PLUS_REAL);
+        VM_REGISTER_HANDLER (OP_POP_MINUS_INT);
+        VM_REGISTER_HANDLER (OP_POP_MINUS_REAL);
+        VM_REGISTER_HANDLER (OP_POP_TIMES_INT);
+        VM_REGISTER_HANDLER (OP_POP_TIMES_REAL);
+        VM_REGISTER_HANDLER (OP_POP_DIV_INT);
+        VM_REGISTER_HANDLER (OP_POP_DIV_REAL);
+        VM_REGISTER_HANDLER (OP_POP_MOD_INT);
+        VM_REGISTER_HANDLER (OP_POP_EQUAL_INT);
+        VM_REGISTER_HANDLER (OP_POP_EQUAL_REAL);
+        VM_REGISTER_HANDLER (OP_POP_NOT_EQUAL_INT);
+        VM_REGISTER_HANDLER (OP_POP_NOT_EQUAL_REAL);
+        VM_REGISTER_HANDLER (OP_POP_GREATER_INT);
+        VM_REGISTER_HANDLER (OP_POP_GREATER_REAL);
+        VM_REGISTER_HANDLER (OP_POP_GREATER_EQUAL_INT);
+        VM_REGISTER_HANDLER (OP_POP_GREATER_EQUAL_REAL);
+        VM_REGISTER_HANDLER (OP_POP_LESS_INT);
+        VM_REGISTER_HANDLER (OP_POP_LESS_REAL);
+        VM_REGISTER_HANDLER (OP_POP_LESS_EQUAL_INT);
+        VM_REGISTER_HANDLER (OP_POP_LESS_EQUAL_REAL);
+        VM_REGISTER_HANDLER (OP_POP_EQUAL_INT_JUMP_FALSE);
+        VM_REGISTER_HANDLER (OP_POP_EQUAL_REAL_JUMP_FALSE);
+        VM_REGISTER_HANDLER (OP_POP_NOT_EQUAL_INT_JUMP_FALSE);
+        VM_REGISTER_HANDLER (OP_POP_NOT_EQUAL_REAL_JUMP_FALSE);
+        VM_REGISTER_HANDLER (OP_POP_GREATER_INT_JUMP_FALSE);
+        VM_REGISTER_HANDLER (OP_POP_GREATER_REAL_JUMP_FALSE);
+        VM_REGISTER_HANDLER (OP_POP_GREATER_EQUAL_INT_JUMP_FALSE);
+        VM_REGISTER_HANDLER (OP_POP_GREATER_EQUAL_REAL_JUMP_FALSE);
+        VM_REGISTER_HANDLER (OP_POP_LESS_INT_JUMP_FALSE);
+        VM_REGISTER_HANDLER (OP_POP_LESS_REAL_JUMP_FALSE);
+        VM_REGISTER_HANDLER (OP_POP_LESS_EQUAL_INT_JUMP_FALSE);
+        VM_REGISTER_HANDLER (OP_POP_LESS_EQUAL_REAL_JUMP_FALSE);
+        VM_REGISTER_HANDLER (OP_R_LOAD_CONST);
+        VM_REGISTER_HANDLER (OP_R_LOAD_VAR);
+        VM_REGISTER_HANDLER (OP_R_SAVE_VAR);
+        VM_REGISTER_HANDLER (OP_R_MOVE);
+        VM_REGISTER_HANDLER (OP_R_CONV_INT_REAL);
+        VM_REGISTER_HANDLER (OP_R_CONV_REAL_INT);
+        VM_REGISTER_HANDLER (OP_R_NEG_INT);
+        VM_REGISTER_HANDLER (OP_R_NEG_REAL);
+        VM_REGISTER_HANDLER (OP_R_NOT);
+        VM_REGISTER_HANDLER (OP_R_PLUS_INT);
+        VM_REGISTER_HANDLER (OP_R_PLUS_REAL);
+        VM_REGISTER_HANDLER (OP_R_MINUS_INT);
+        VM_REGISTER_HANDLER (OP_R_MINUS_REAL);
+        VM_REGISTER_HANDLER (OP_R_TIMES_INT);
+        VM_REGISTER_HANDLER (OP_R_TIMES_REAL);
+        VM_REGISTER_HANDLER (OP_R_DIV_INT);
+        VM_REGISTER_HANDLER (OP_R_DIV_REAL);
+        VM_REGISTER_HANDLER (OP_R_MOD_INT);
+        VM_REGISTER_HANDLER (OP_R_EQUAL_INT);
+        VM_REGISTER_HANDLER (OP_R_EQUAL_REAL);
+        VM_REGISTER_HANDLER (OP_R_NOT_EQUAL_INT);
+        VM_REGISTER_HANDLER (OP_R_NOT_EQUAL_REAL);
+        VM_REGISTER_HANDLER (OP_R_GREATER_INT);
+        VM_REGISTER_HANDLER (OP_R_GREATER_REAL);
+        VM_REGISTER_HANDLER (OP_R_GREATER_EQUAL_INT);
+        VM_REGISTER_HANDLER (OP_R_GREATER_EQUAL_REAL);
+        VM_REGISTER_HANDLER (OP_R_LESS_INT);
+        VM_REGISTER_HANDLER (OP_R_LESS_REAL);
+        VM_REGISTER_HANDLER (OP_R_LESS_EQUAL_INT);
+        VM_REGISTER_HANDLER (OP_R_LESS_EQUAL_REAL);
+        VM_REGISTER_HANDLER (OP_R_AND);
+        VM_REGISTER_HANDLER (OP_R_OR);
+        VM_REGISTER_HANDLER (OP_R_XOR);
+        VM_REGISTER_HANDLER (OP_CALL_FUNC);
+        VM_REGISTER_HANDLER (OP_CALL_OPERATOR_FUNC);
+        VM_REGISTER_HANDLER (OP_TIMESHARE);
+        VM_REGISTER_HANDLER (OP_FREE_TEMP);
+        VM_REGISTER_HANDLER (OP_ALLOC);
+        VM_REGISTER_HANDLER (OP_REDIM);
+        VM_REGISTER_HANDLER (OP_CALL);
+        VM_REGISTER_HANDLER (OP_RETURN);
+        VM_REGISTER_HANDLER (OP_DATA_READ);
+        VM_REGISTER_HANDLER (OP_DATA_RESET);
+        VM_REGISTER_HANDLER (OP_RUN);
+        VM_REGISTER_HANDLER (OP_LOAD_DATA);
+        VM_REGISTER_HANDLER (OP_PUSH_DATA);
+        VM_REGISTER_HANDLER (OP_R_LOAD_DATA);
+        VM_REGISTER_HANDLER (OP_R_SAVE_DATA);
+        VM_REGISTER_HANDLER (OP_COPY_COW);
+        VM_REGISTER_HANDLER (OP_LOAD_VAR_COW);
+        VM_REGISTER_HANDLER (OP_LOAD_VAR_COW_READ);
+        VM_REGISTER_HANDLER (OP_BREAKPT);
+        table;
+    });
+
+    if (threaded) {
+
+        // Pre-decode any instructions added or modified since the last run
+        if (m_handlers.size () != m_code.size ())
+            m_handlers.resize (m_code.size ());
+        for (unsigned int i = m_handlersValid; i < m_code.size (); i++)
+            m_handlers [i] = handlerTable [m_code [i].m_opCode];
+        m_handlersValid = m_code.size ();
+        if (!m_handlers.empty ())
+            handlers = &m_handlers [0];
+    }
+#endif
 
 step:
-
-    // Count steps
-    if (++stepCount > steps)
-        return;
-
-    instruction = &m_code [m_ip];
+    instruction = &code [m_ip];
+#ifdef VM_THREADED_DISPATCH
+    if (threaded)
+        goto *handlers [m_ip];
+#endif
     switch (instruction->m_opCode) {
-    case OP_NOP:                goto nextStep;
-    case OP_END:                break;
-    case OP_LOAD_CONST:
+    VM_HANDLER (OP_NOP)                VM_NEXT;
+    VM_HANDLER (OP_END)                break;
+    VM_HANDLER (OP_LOAD_CONST)
 
         // Load value
         if (instruction->m_type == VTP_STRING) {
@@ -154,23 +558,124 @@ step:
         }
         else
             Reg () = instruction->m_value;
-        goto nextStep;
+        VM_NEXT;
 
-    case OP_LOAD_VAR: {
+    VM_HANDLER (OP_LOAD_VAR) {
 
         // Load variable.
         // Instruction contains index of variable.
         assert (m_variables.IndexValid (instruction->m_value.IntVal ()));
         vmVariable& var = m_variables.Variables () [instruction->m_value.IntVal ()];
         if (var.Allocated ()) {
-            // Load address of variable's data into register
+            // Load address of variable's data into register.
+            // The address won't change until the variables are deallocated,
+            // so from now on load it as a constant.
+            m_reg.IntVal () = var.m_dataIndex;
+            VM_RESOLVE_VAR (OP_LOAD_CONST, var.m_dataIndex);
+            VM_NEXT;
+        }
+        SetError (ErrUnDIMmedVariable);
+        break;
+    }
+    VM_HANDLER (OP_LOAD_VAR_DEREF)
+    VM_HANDLER (OP_PUSH_VAR) {
+
+        // Load variable value (int or real).
+        assert (m_variables.IndexValid (instruction->m_value.IntVal ()));
+        vmVariable& var = m_variables.Variables () [instruction->m_value.IntVal ()];
+        if (var.Allocated ()) {
+            assert (m_data.IndexValid (var.m_dataIndex));
+            m_reg = m_data.Data () [var.m_dataIndex];
+            if (instruction->m_opCode == OP_PUSH_VAR) {
+                m_stack.Push (m_reg);
+                VM_RESOLVE_VAR (OP_PUSH_DATA, var.m_dataIndex);
+            }
+            else
+                VM_RESOLVE_VAR (OP_LOAD_DATA, var.m_dataIndex);
+            VM_NEXT;
+        }
+        SetError (ErrUnDIMmedVariable);
+        break;
+    }
+    VM_HANDLER (OP_LOAD_VAR_PUSH) {
+
+        // Load variable address and push it
+        assert (m_variables.IndexValid (instruction->m_value.IntVal ()));
+        vmVariable& var = m_variables.Variables () [instruction->m_value.IntVal ()];
+        if (var.Allocated ()) {
+            m_reg.IntVal () = var.m_dataIndex;
+            m_stack.Push (m_reg);
+            VM_RESOLVE_VAR (OP_PUSH_CONST, var.m_dataIndex);
+            VM_NEXT;
+        }
+        SetError (ErrUnDIMmedVariable);
+        break;
+    }
+
+    // Resolved variable access. Instruction value is the data index.
+    VM_HANDLER (OP_LOAD_DATA)
+        assert (m_data.IndexValid (instruction->m_value.IntVal ()));
+        m_reg = m_data.Data () [instruction->m_value.IntVal ()];
+        VM_NEXT;
+    VM_HANDLER (OP_PUSH_DATA)
+        assert (m_data.IndexValid (instruction->m_value.IntVal ()));
+        m_reg = m_data.Data () [instruction->m_value.IntVal ()];
+        m_stack.Push (m_reg);
+        VM_NEXT;
+    VM_HANDLER (OP_R_LOAD_DATA)
+        assert (m_data.IndexValid (instruction->m_value.IntVal ()));
+        VM_RD = m_data.Data () [instruction->m_value.IntVal ()];
+        VM_NEXT;
+    VM_HANDLER (OP_R_SAVE_DATA)
+        assert (m_data.IndexValid (instruction->m_value.IntVal ()));
+        m_data.Data () [instruction->m_value.IntVal ()] = VM_RD;
+        VM_NEXT;
+
+    VM_HANDLER (OP_COPY_COW) {
+
+        // Copy array. In copy-on-write mode the copy is deferred until either
+        // array is next loaded by LOAD_VAR_COW.
+        vmValType type = m_typeSet.GetValType (instruction->m_value.IntVal ());
+        int size;
+        assert (!m_dataTypes.ContainsString (type));
+        if (!CheckCopy (m_reg.IntVal (), m_reg2.IntVal (), type, size))
+            break;
+        if (m_copyOnWrite)
+            DeferCopy (m_reg.IntVal (), m_reg2.IntVal (), size);
+        else
+            BlockCopy (m_reg.IntVal (), m_reg2.IntVal (), size);
+        VM_NEXT;
+    }
+    VM_HANDLER (OP_LOAD_VAR_COW)
+    VM_HANDLER (OP_LOAD_VAR_COW_READ) {
+
+        // Load address of variable's data.
+        // The data may be the source or destination of a deferred copy. Any
+        // such copy is completed first, except when the variable is only
+        // read, in which case the copy's source can be read instead.
+        assert (m_variables.IndexValid (instruction->m_value.IntVal ()));
+        vmVariable& var = m_variables.Variables () [instruction->m_value.IntVal ()];
+        if (var.Allocated ()) {
             m_reg.IntVal () = var.m_dataIndex;
-            goto nextStep;
+            if (!m_deferredCopies.empty ()) {
+                if (instruction->m_opCode == OP_LOAD_VAR_COW_READ)
+                    m_reg.IntVal () = DeferredCopySource (var.m_dataIndex);
+                else
+                    CompleteCopies (var.m_dataIndex);
+            }
+            VM_NEXT;
         }
         SetError (ErrUnDIMmedVariable);
         break;
     }
-    case OP_DEREF: {
+    VM_HANDLER (OP_PUSH_CONST)
+
+        // Load value (int or real) and push it
+        m_reg = instruction->m_value;
+        m_stack.Push (m_reg);
+        VM_NEXT;
+
+    VM_HANDLER (OP_DEREF) {
 
         // Dereference reg.
         if (m_reg.IntVal () != 0) {
@@ -180,27 +685,30 @@ step:
             case VTP_INT:
             case VTP_REAL:
                 m_reg = val;
-                goto nextStep;
+                VM_NEXT;
             case VTP_STRING:
                 assert (m_strings.IndexValid (val.IntVal ()));
                 m_regString = m_strings.Value (val.IntVal ());
-                goto nextStep;
+                VM_NEXT;
             }
             assert (false);
         }
         SetError (ErrUnsetPointer);
         break;
     }
-    case OP_ADD_CONST:
+    VM_HANDLER (OP_ADD_CONST)
         // Check pointer
         if (m_reg.IntVal () != 0) {
             m_reg.IntVal () += instruction->m_value.IntVal ();
-            goto nextStep;
+            VM_NEXT;
         }
         SetError (ErrUnsetPointer);
         break;
 
-    case OP_ARRAY_INDEX:
+    VM_HANDLER (OP_POP_ARRAY_INDEX)
+        m_stack.Pop (Reg2 ());
+        // Fall through
+    VM_HANDLER (OP_ARRAY_INDEX)
 
         if (m_reg2.IntVal () != 0) {
             // Input:   m_reg2 = Array address
@@ -216,7 +724,7 @@ step:
             if (m_reg.IntVal () >= 0 && m_reg.IntVal () < m_data.Data () [m_reg2.IntVal ()].IntVal ()) {
                 assert (m_data.Data () [m_reg2.IntVal () + 1].IntVal () >= 0);
                 m_reg.IntVal () = m_reg2.IntVal () + 2 + m_reg.IntVal () * m_data.Data () [m_reg2.IntVal () + 1].IntVal ();
-                goto nextStep;
+                VM_NEXT;
             }
             SetError (ErrBadArrayIndex);
             break;
@@ -224,21 +732,108 @@ step:
         SetError (ErrUnsetPointer);
         break;
 
-    case OP_PUSH:
+    VM_HANDLER (OP_POP_ARRAY_INDEX_UNCHECKED)
+        m_stack.Pop (Reg2 ());
+        // Fall through
+    VM_HANDLER (OP_ARRAY_INDEX_UNCHECKED)
+
+        // As ARRAY_INDEX, but the compiler has proved that the array exists
+        // and the index is in range.
+        assert (m_data.IndexValid (m_reg2.IntVal ()));
+        assert (m_data.IndexValid (m_reg2.IntVal () + 1));
+        assert (m_reg.IntVal () >= 0 && m_reg.IntVal () < m_data.Data () [m_reg2.IntVal ()].IntVal ());
+        m_reg.IntVal () = m_reg2.IntVal () + 2 + m_reg.IntVal () * m_data.Data () [m_reg2.IntVal () + 1].IntVal ();
+        VM_NEXT;
+
+    VM_HANDLER (OP_ARRAY_INDEX_N) {
+
+        // Index through each dimension of a multi-dimensional array.
+        // Each row is a nested array with its own header, so the element
+        // address is found by indexing one dimension at a time.
+        // Indices were stacked after the array address, except the last which
+        // is in reg.
+        int count   = instruction->m_value.IntVal () & 0xff;
+        int checked = instruction->m_value.IntVal () >> 8;
+        int top     = m_stack.Size () - count;
+        assert (count > 1 && top >= 0);
+        vmValue *stack = &m_stack [top];
+        vmInt address = stack [0].IntVal ();
+        if (address == 0) {
+            SetError (ErrUnsetPointer);
+            break;
+        }
+        vmValue *data = m_data.Data ();
+        int i;
+        for (i = 1; i <= count; i++) {
+            vmInt index = i < count ? stack [i].IntVal () : m_reg.IntVal ();
+            assert (m_data.IndexValid (address + 1));
+            if (!(checked & (1 << (i - 1))) && (index < 0 || index >= data [address].IntVal ()))
+                break;
+            address += 2 + index * data [address + 1].IntVal ();
+        }
+        if (i <= count) {
+            SetError (ErrBadArrayIndex);
+            break;
+        }
+        m_stack.Resize (top);
+        m_reg.IntVal () = address;
+        VM_NEXT;
+    }
+
+    VM_HANDLER (OP_ARRAY_INDEX_FIELD) {
+
+        // As ARRAY_INDEX_N, except the last array stores field major
+        // structures, so each field is stored in a column of its own.
+        int count   = instruction->m_value.IntVal () & 0xff;
+        int checked = (instruction->m_value.IntVal () >> 8) & 0x3ff;
+        int field   = instruction->m_value.IntVal () >> 18;
+        int top     = m_stack.Size () - count;
+        assert (count > 0 && top >= 0);
+        vmValue *stack = &m_stack [top];
+        vmInt address = stack [0].IntVal ();
+        if (address == 0) {
+            SetError (ErrUnsetPointer);
+            break;
+        }
+        vmValue *data = m_data.Data ();
+        int i;
+        for (i = 1; i < count; i++) {
+            vmInt index = stack [i].IntVal ();
+            assert (m_data.IndexValid (address + 1));
+            if (!(checked & (1 << (i - 1))) && (index < 0 || index >= data [address].IntVal ()))
+                break;
+            address += 2 + index * data [address + 1].IntVal ();
+        }
+        vmInt index = m_reg.IntVal ();
+        assert (i < count || m_data.IndexValid (address + 1));
+        if (i < count || (!(checked & (1 << (count - 1))) && (index < 0 || index >= data [address].IntVal ()))) {
+            SetError (ErrBadArrayIndex);
+            break;
+        }
+        address += 2 + field * data [address].IntVal () + index;
+        m_stack.Resize (top);
+        m_reg.IntVal () = address;
+        VM_NEXT;
+    }
+
+    VM_HANDLER (OP_PUSH)
 
         // Push register to stack
         if (instruction->m_type == VTP_STRING)  m_stack.PushString (RegString ());
         else                                    m_stack.Push (Reg ());
-        goto nextStep;
+        VM_NEXT;
 
-    case OP_POP:
+    VM_HANDLER (OP_POP)
 
         // Pop reg2 from stack
         if (instruction->m_type == VTP_STRING)  m_stack.PopString (Reg2String ());
         else                                    m_stack.Pop (Reg2 ());
-        goto nextStep;
+        VM_NEXT;
 
-    case OP_SAVE: {
+    VM_HANDLER (OP_POP_SAVE)
+        m_stack.Pop (Reg2 ());
+        // Fall through
+    VM_HANDLER (OP_SAVE) {
 
         // Save reg into [reg2]
         if (m_reg2.IntVal () > 0) {
@@ -248,16 +843,16 @@ step:
             case VTP_INT:
             case VTP_REAL:
                 dest = m_reg;
-                goto nextStep;
+                VM_NEXT;
             case VTP_STRING:
 
                 // Allocate string space if necessary
                 if (dest.IntVal () == 0)
-                    dest.IntVal () = m_strings.Alloc ();
+                    dest.IntVal () = AllocString ();
 
                 // Copy string value
                 m_strings.Value (dest.IntVal ()) = m_regString;
-                goto nextStep;
+                VM_NEXT;
             }
             assert (false);
         }
@@ -265,17 +860,17 @@ step:
         break;
     }
 
-    case OP_COPY: {
+    VM_HANDLER (OP_COPY) {
 
         // Copy data
         if (CopyData (  m_reg.IntVal (),
                         m_reg2.IntVal (),
                         m_typeSet.GetValType (instruction->m_value.IntVal ())))
-            goto nextStep;
+            VM_NEXT;
         else
             break;
     }
-    case OP_DECLARE: {
+    VM_HANDLER (OP_DECLARE) {
 
         // Allocate variable.
         assert (m_variables.IndexValid (instruction->m_value.IntVal ()));
@@ -298,86 +893,189 @@ step:
 
         // Allocate variable
         var.Allocate (m_data, m_dataTypes);
-        goto nextStep;
+        if (!var.Allocated ()) {
+            SetError (ErrOutOfMemory);
+            break;
+        }
+        VM_NEXT;
     }
 
-    case OP_JUMP:
+    VM_HANDLER (OP_REDIM) {
+
+        // Resize array variable, preserving its contents.
+        assert (m_variables.IndexValid (instruction->m_value.IntVal ()));
+        vmVariable& var = m_variables.Variables () [instruction->m_value.IntVal ()];
+        vmValType type = var.m_type;
+        if (!PopArrayDimensions (type))
+            break;
+
+        // Variables that haven't been allocated yet are simply DIMmed
+        if (!var.Allocated ()) {
+            if (!ValidateTypeSize (type))
+                break;
+            var.m_type = type;
+            var.Allocate (m_data, m_dataTypes);
+            if (!var.Allocated ()) {
+                SetError (ErrOutOfMemory);
+                break;
+            }
+            VM_NEXT;
+        }
+
+        bool moved;
+        if (!ResizeArray (var, type, moved))
+            break;
+
+        // If the data moved, instructions that referred to the old data have
+        // been restored, and must be decoded again. So return.
+        if (moved) {
+            stepCount += m_ip + 1 - blockStart;
+            m_ip++;
+            goto finish;
+        }
+        VM_NEXT;
+    }
+
+    VM_HANDLER (OP_JUMP)
 
         // Jump
         assert (instruction->m_value.IntVal () >= 0);
         assert (instruction->m_value.IntVal () < m_code.size ());
-        m_ip = instruction->m_value.IntVal ();
-        goto step;
+#ifdef VM_JIT
+        if (m_jitEnabled && (unsigned int) instruction->m_value.IntVal () <= m_ip) {
+
+            // Backward jump. Run hot loops as native code
+            vmJitLoop *loop = m_jit.Loop (m_code, m_ip, m_variables);
+            stepCount += m_ip + 1 - blockStart;
+            m_ip = instruction->m_value.IntVal ();
+            if (stepCount >= steps)
+                goto outOfSteps;
+            if (loop != NULL) {
+                RunLoop (*loop, stepCount, steps);
+                if (stepCount >= steps)
+                    goto outOfSteps;
+            }
+            blockStart = m_ip;
+            VM_DISPATCH;
+        }
+#endif
+        VM_BRANCH (instruction->m_value.IntVal ());
 
-    case OP_JUMP_TRUE:
+    VM_HANDLER (OP_JUMP_TRUE)
 
         // Jump if reg != 0
         assert (instruction->m_value.IntVal () >= 0);
         assert (instruction->m_value.IntVal () < m_code.size ());
-        if (Reg ().IntVal () != 0) {
-            m_ip = instruction->m_value.IntVal ();
-            goto step;
-        }
-        goto nextStep;
-
-    case OP_JUMP_FALSE:
+        if (Reg ().IntVal () != 0)
+            VM_BRANCH (instruction->m_value.IntVal ());
+        VM_NEXT;
+
+    VM_HANDLER (OP_POP_EQUAL_INT_JUMP_FALSE)
+        m_stack.Pop (Reg2 ());
+        Reg ().IntVal () = Reg2 ().IntVal () == Reg ().IntVal () ? -1 : 0;
+        goto jumpFalse;
+    VM_HANDLER (OP_POP_EQUAL_REAL_JUMP_FALSE)
+        m_stack.Pop (Reg2 ());
+        Reg ().IntVal () = Reg2 ().RealVal () == Reg ().RealVal () ? -1 : 0;
+        goto jumpFalse;
+    VM_HANDLER (OP_POP_NOT_EQUAL_INT_JUMP_FALSE)
+        m_stack.Pop (Reg2 ());
+        Reg ().IntVal () = Reg2 ().IntVal () != Reg ().IntVal () ? -1 : 0;
+        goto jumpFalse;
+    VM_HANDLER (OP_POP_NOT_EQUAL_REAL_JUMP_FALSE)
+        m_stack.Pop (Reg2 ());
+        Reg ().IntVal () = Reg2 ().RealVal () != Reg ().RealVal () ? -1 : 0;
+        goto jumpFalse;
+    VM_HANDLER (OP_POP_GREATER_INT_JUMP_FALSE)
+        m_stack.Pop (Reg2 ());
+        Reg ().IntVal () = Reg2 ().IntVal () > Reg ().IntVal () ? -1 : 0;
+        goto jumpFalse;
+    VM_HANDLER (OP_POP_GREATER_REAL_JUMP_FALSE)
+        m_stack.Pop (Reg2 ());
+        Reg ().IntVal () = Reg2 ().RealVal () > Reg ().RealVal () ? -1 : 0;
+        goto jumpFalse;
+    VM_HANDLER (OP_POP_GREATER_EQUAL_INT_JUMP_FALSE)
+        m_stack.Pop (Reg2 ());
+        Reg ().IntVal () = Reg2 ().IntVal () >= Reg ().IntVal () ? -1 : 0;
+        goto jumpFalse;
+    VM_HANDLER (OP_POP_GREATER_EQUAL_REAL_JUMP_FALSE)
+        m_stack.Pop (Reg2 ());
+        Reg ().IntVal () = Reg2 ().RealVal () >= Reg ().RealVal () ? -1 : 0;
+        goto jumpFalse;
+    VM_HANDLER (OP_POP_LESS_INT_JUMP_FALSE)
+        m_stack.Pop (Reg2 ());
+        Reg ().IntVal () = Reg2 ().IntVal () < Reg ().IntVal () ? -1 : 0;
+        goto jumpFalse;
+    VM_HANDLER (OP_POP_LESS_REAL_JUMP_FALSE)
+        m_stack.Pop (Reg2 ());
+        Reg ().IntVal () = Reg2 ().RealVal () < Reg ().RealVal () ? -1 : 0;
+        goto jumpFalse;
+    VM_HANDLER (OP_POP_LESS_EQUAL_INT_JUMP_FALSE)
+        m_stack.Pop (Reg2 ());
+        Reg ().IntVal () = Reg2 ().IntVal () <= Reg ().IntVal () ? -1 : 0;
+        goto jumpFalse;
+    VM_HANDLER (OP_POP_LESS_EQUAL_REAL_JUMP_FALSE)
+        m_stack.Pop (Reg2 ());
+        Reg ().IntVal () = Reg2 ().RealVal () <= Reg ().RealVal () ? -1 : 0;
+        goto jumpFalse;
+
+    VM_HANDLER (OP_JUMP_FALSE)
+    jumpFalse:
 
         // Jump if reg == 0
         assert (instruction->m_value.IntVal () >= 0);
         assert (instruction->m_value.IntVal () < m_code.size ());
-        if (Reg ().IntVal () == 0) {
-            m_ip = instruction->m_value.IntVal ();
-            goto step;
-        }
-        goto nextStep;
+        if (Reg ().IntVal () == 0)
+            VM_BRANCH (instruction->m_value.IntVal ());
+        VM_NEXT;
 
-    case OP_OP_NEG:
+    VM_HANDLER (OP_OP_NEG)
         if (instruction->m_type == VTP_INT)         Reg ().IntVal ()  = -Reg ().IntVal ();
         else if (instruction->m_type == VTP_REAL)   Reg ().RealVal () = -Reg ().RealVal ();
         else {
             SetError (ErrBadOperator);
             break;
         }
-        goto nextStep;
+        VM_NEXT;
 
-    case OP_OP_PLUS:
+    VM_HANDLER (OP_OP_PLUS)
         if (instruction->m_type == VTP_INT)         Reg ().IntVal () += Reg2 ().IntVal ();
         else if (instruction->m_type == VTP_REAL)   Reg ().RealVal () += Reg2 ().RealVal ();
-        else if (instruction->m_type == VTP_STRING) RegString () = Reg2String () + RegString ();
+        else if (instruction->m_type == VTP_STRING) ConcatRegStrings ();
         else {
             SetError (ErrBadOperator);
             break;
         }
-        goto nextStep;
+        VM_NEXT;
 
-    case OP_OP_MINUS:
+    VM_HANDLER (OP_OP_MINUS)
         if (instruction->m_type == VTP_INT)         Reg ().IntVal () = Reg2 ().IntVal () - Reg ().IntVal ();
         else if (instruction->m_type == VTP_REAL)   Reg ().RealVal () = Reg2 ().RealVal () - Reg ().RealVal ();
         else {
             SetError (ErrBadOperator);
             break;
         }
-        goto nextStep;
+        VM_NEXT;
 
-    case OP_OP_TIMES:
+    VM_HANDLER (OP_OP_TIMES)
         if (instruction->m_type == VTP_INT)         Reg ().IntVal () *= Reg2 ().IntVal ();
         else if (instruction->m_type == VTP_REAL)   Reg ().RealVal () *= Reg2 ().RealVal ();
         else {
             SetError (ErrBadOperator);
             break;
         }
-        goto nextStep;
+        VM_NEXT;
 
-    case OP_OP_DIV:
+    VM_HANDLER (OP_OP_DIV)
         if (instruction->m_type == VTP_INT)         Reg ().IntVal () = Reg2 ().IntVal () / Reg ().IntVal ();
         else if (instruction->m_type == VTP_REAL)   Reg ().RealVal () = Reg2 ().RealVal () / Reg ().RealVal ();
         else {
             SetError (ErrBadOperator);
             break;
         }
-        goto nextStep;
+        VM_NEXT;
 
-    case OP_OP_MOD:
+    VM_HANDLER (OP_OP_MOD)
         if (instruction->m_type == VTP_INT) {
             vmInt i = Reg2 ().IntVal () % Reg ().IntVal ();
             if (i >= 0) Reg ().IntVal () = i;
@@ -387,17 +1085,17 @@ step:
             SetError (ErrBadOperator);
             break;
         }
-        goto nextStep;
+        VM_NEXT;
 
-    case OP_OP_NOT:
+    VM_HANDLER (OP_OP_NOT)
         if (instruction->m_type == VTP_INT)         Reg ().IntVal () = Reg ().IntVal () == 0 ? -1 : 0;
         else {
             SetError (ErrBadOperator);
             break;
         }
-        goto nextStep;
+        VM_NEXT;
 
-    case OP_OP_EQUAL:
+    VM_HANDLER (OP_OP_EQUAL)
         if (instruction->m_type == VTP_INT)         Reg ().IntVal () = Reg2 ().IntVal () == Reg ().IntVal () ? -1 : 0;
         else if (instruction->m_type == VTP_REAL)   Reg ().IntVal () = Reg2 ().RealVal () == Reg ().RealVal () ? -1 : 0;
         else if (instruction->m_type == VTP_STRING) Reg ().IntVal () = Reg2String () == RegString () ? -1 : 0;
@@ -405,9 +1103,9 @@ step:
             SetError (ErrBadOperator);
             break;
         }
-        goto nextStep;
+        VM_NEXT;
 
-    case OP_OP_NOT_EQUAL:
+    VM_HANDLER (OP_OP_NOT_EQUAL)
         if (instruction->m_type == VTP_INT)         Reg ().IntVal () = Reg2 ().IntVal () != Reg ().IntVal () ? -1 : 0;
         else if (instruction->m_type == VTP_REAL)   Reg ().IntVal () = Reg2 ().RealVal () != Reg ().RealVal () ? -1 : 0;
         else if (instruction->m_type == VTP_STRING) Reg ().IntVal () = Reg2String () != RegString () ? -1 : 0;
@@ -415,9 +1113,9 @@ step:
             SetError (ErrBadOperator);
             break;
         }
-        goto nextStep;
+        VM_NEXT;
 
-    case OP_OP_GREATER:
+    VM_HANDLER (OP_OP_GREATER)
         if (instruction->m_type == VTP_INT)         Reg ().IntVal () = Reg2 ().IntVal () > Reg ().IntVal () ? -1 : 0;
         else if (instruction->m_type == VTP_REAL)   Reg ().IntVal () = Reg2 ().RealVal () > Reg ().RealVal () ? -1 : 0;
         else if (instruction->m_type == VTP_STRING) Reg ().IntVal () = Reg2String () > RegString () ? -1 : 0;
@@ -425,9 +1123,9 @@ step:
             SetError (ErrBadOperator);
             break;
         }
-        goto nextStep;
+        VM_NEXT;
 
-    case OP_OP_GREATER_EQUAL:
+    VM_HANDLER (OP_OP_GREATER_EQUAL)
         if (instruction->m_type == VTP_INT)         Reg ().IntVal () = Reg2 ().IntVal () >= Reg ().IntVal () ? -1 : 0;
         else if (instruction->m_type == VTP_REAL)   Reg ().IntVal () = Reg2 ().RealVal () >= Reg ().RealVal () ? -1 : 0;
         else if (instruction->m_type == VTP_STRING) Reg ().IntVal () = Reg2String () >= RegString () ? -1 : 0;
@@ -435,9 +1133,9 @@ step:
             SetError (ErrBadOperator);
             break;
         }
-        goto nextStep;
+        VM_NEXT;
 
-    case OP_OP_LESS:
+    VM_HANDLER (OP_OP_LESS)
         if (instruction->m_type == VTP_INT)         Reg ().IntVal () = Reg2 ().IntVal () < Reg ().IntVal () ? -1 : 0;
         else if (instruction->m_type == VTP_REAL)   Reg ().IntVal () = Reg2 ().RealVal () < Reg ().RealVal () ? -1 : 0;
         else if (instruction->m_type == VTP_STRING) Reg ().IntVal () = Reg2String () < RegString () ? -1 : 0;
@@ -445,9 +1143,9 @@ step:
             SetError (ErrBadOperator);
             break;
         }
-        goto nextStep;
+        VM_NEXT;
 
-    case OP_OP_LESS_EQUAL:
+    VM_HANDLER (OP_OP_LESS_EQUAL)
         if (instruction->m_type == VTP_INT)         Reg ().IntVal () = Reg2 ().IntVal () <= Reg ().IntVal () ? -1 : 0;
         else if (instruction->m_type == VTP_REAL)   Reg ().IntVal () = Reg2 ().RealVal () <= Reg ().RealVal () ? -1 : 0;
         else if (instruction->m_type == VTP_STRING) Reg ().IntVal () = Reg2String () <= RegString () ? -1 : 0;
@@ -455,83 +1153,223 @@ step:
             SetError (ErrBadOperator);
             break;
         }
-        goto nextStep;
+        VM_NEXT;
 
-    case OP_CONV_INT_REAL:
+    VM_HANDLER (OP_CONV_INT_REAL)
         Reg ().RealVal () = Reg ().IntVal ();
-        goto nextStep;
+        VM_NEXT;
 
-    case OP_CONV_INT_REAL2:
+    VM_HANDLER (OP_CONV_INT_REAL2)
         Reg2 ().RealVal () = Reg2 ().IntVal ();
-        goto nextStep;
+        VM_NEXT;
 
-    case OP_CONV_REAL_INT:
+    VM_HANDLER (OP_CONV_REAL_INT)
         Reg ().IntVal () = Reg ().RealVal ();
-        goto nextStep;
+        VM_NEXT;
 
-    case OP_CONV_REAL_INT2:
+    VM_HANDLER (OP_CONV_REAL_INT2)
         Reg2 ().IntVal () = Reg2 ().RealVal ();
-        goto nextStep;
+        VM_NEXT;
 
-    case OP_CONV_INT_STRING:
+    VM_HANDLER (OP_CONV_INT_STRING)
         RegString () = IntToString (Reg ().IntVal ());
-        goto nextStep;
+        VM_NEXT;
 
-    case OP_CONV_REAL_STRING:
+    VM_HANDLER (OP_CONV_REAL_STRING)
         RegString () = RealToString (Reg ().RealVal ());
-        goto nextStep;
+        VM_NEXT;
 
-    case OP_CONV_INT_STRING2:
+    VM_HANDLER (OP_CONV_INT_STRING2)
         Reg2String () = IntToString (Reg2 ().IntVal ());
-        goto nextStep;
+        VM_NEXT;
 
-    case OP_CONV_REAL_STRING2:
+    VM_HANDLER (OP_CONV_REAL_STRING2)
         Reg2String () = RealToString (Reg2 ().RealVal ());
-        goto nextStep;
+        VM_NEXT;
 
-    case OP_OP_AND:
+    VM_HANDLER (OP_POP_AND)
+        m_stack.Pop (Reg2 ());
+        // Fall through
+    VM_HANDLER (OP_OP_AND)
         Reg ().IntVal () = Reg ().IntVal () & Reg2 ().IntVal ();
-        goto nextStep;
+        VM_NEXT;
 
-    case OP_OP_OR:
+    VM_HANDLER (OP_POP_OR)
+        m_stack.Pop (Reg2 ());
+        // Fall through
+    VM_HANDLER (OP_OP_OR)
         Reg ().IntVal () = Reg ().IntVal () | Reg2 ().IntVal ();
-        goto nextStep;
+        VM_NEXT;
 
-    case OP_OP_XOR:
+    VM_HANDLER (OP_POP_XOR)
+        m_stack.Pop (Reg2 ());
+        // Fall through
+    VM_HANDLER (OP_OP_XOR)
         Reg ().IntVal () = Reg ().IntVal () ^ Reg2 ().IntVal ();
-        goto nextStep;
-
-    case OP_CALL_FUNC:
+        VM_NEXT;
+
+    // Type specialised operations.
+    // (POP + operation superinstructions pop reg2 then fall through.)
+    VM_HANDLER (OP_OP_NEG_INT)                 Reg ().IntVal ()  = -Reg ().IntVal ();                      VM_NEXT;
+    VM_HANDLER (OP_OP_NEG_REAL)                Reg ().RealVal () = -Reg ().RealVal ();                     VM_NEXT;
+    VM_HANDLER (OP_POP_PLUS_INT)               m_stack.Pop (Reg2 ());
+    VM_HANDLER (OP_OP_PLUS_INT)                Reg ().IntVal ()  += Reg2 ().IntVal ();                     VM_NEXT;
+    VM_HANDLER (OP_POP_PLUS_REAL)              m_stack.Pop (Reg2 ());
+    VM_HANDLER (OP_OP_PLUS_REAL)               Reg ().RealVal () += Reg2 ().RealVal ();                    VM_NEXT;
+    VM_HANDLER (OP_POP_PLUS_STRING)            m_stack.PopString (Reg2String ());
+    VM_HANDLER (OP_OP_PLUS_STRING)             ConcatRegStrings ();                                        VM_NEXT;
+    VM_HANDLER (OP_POP_MINUS_INT)              m_stack.Pop (Reg2 ());
+    VM_HANDLER (OP_OP_MINUS_INT)               Reg ().IntVal ()  = Reg2 ().IntVal () - Reg ().IntVal ();   VM_NEXT;
+    VM_HANDLER (OP_POP_MINUS_REAL)             m_stack.Pop (Reg2 ());
+    VM_HANDLER (OP_OP_MINUS_REAL)              Reg ().RealVal () = Reg2 ().RealVal () - Reg ().RealVal (); VM_NEXT;
+    VM_HANDLER (OP_POP_TIMES_INT)              m_stack.Pop (Reg2 ());
+    VM_HANDLER (OP_OP_TIMES_INT)               Reg ().IntVal ()  *= Reg2 ().IntVal ();                     VM_NEXT;
+    VM_HANDLER (OP_POP_TIMES_REAL)             m_stack.Pop (Reg2 ());
+    VM_HANDLER (OP_OP_TIMES_REAL)              Reg ().RealVal () *= Reg2 ().RealVal ();                    VM_NEXT;
+    VM_HANDLER (OP_POP_DIV_INT)                m_stack.Pop (Reg2 ());
+    VM_HANDLER (OP_OP_DIV_INT)                 Reg ().IntVal ()  = Reg2 ().IntVal () / Reg ().IntVal ();   VM_NEXT;
+    VM_HANDLER (OP_POP_DIV_REAL)               m_stack.Pop (Reg2 ());
+    VM_HANDLER (OP_OP_DIV_REAL)                Reg ().RealVal () = Reg2 ().RealVal () / Reg ().RealVal (); VM_NEXT;
+    VM_HANDLER (OP_POP_MOD_INT)                m_stack.Pop (Reg2 ());
+    VM_HANDLER (OP_OP_MOD_INT) {
+        vmInt i = Reg2 ().IntVal () % Reg ().IntVal ();
+        if (i >= 0) Reg ().IntVal () = i;
+        else        Reg ().IntVal () += i;
+        VM_NEXT;
+    }
+    VM_HANDLER (OP_POP_EQUAL_INT)              m_stack.Pop (Reg2 ());
+    VM_HANDLER (OP_OP_EQUAL_INT)               Reg ().IntVal () = Reg2 ().IntVal () == Reg ().IntVal () ? -1 : 0; VM_NEXT;
+    VM_HANDLER (OP_POP_EQUAL_REAL)             m_stack.Pop (Reg2 ());
+    VM_HANDLER (OP_OP_EQUAL_REAL)              Reg ().IntVal () = Reg2 ().RealVal () == Reg ().RealVal () ? -1 : 0; VM_NEXT;
+    VM_HANDLER (OP_OP_EQUAL_STRING)            Reg ().IntVal () = Reg2String () == RegString () ? -1 : 0; VM_NEXT;
+    VM_HANDLER (OP_POP_NOT_EQUAL_INT)          m_stack.Pop (Reg2 ());
+    VM_HANDLER (OP_OP_NOT_EQUAL_INT)           Reg ().IntVal () = Reg2 ().IntVal () != Reg ().IntVal () ? -1 : 0; VM_NEXT;
+    VM_HANDLER (OP_POP_NOT_EQUAL_REAL)         m_stack.Pop (Reg2 ());
+    VM_HANDLER (OP_OP_NOT_EQUAL_REAL)          Reg ().IntVal () = Reg2 ().RealVal () != Reg ().RealVal () ? -1 : 0; VM_NEXT;
+    VM_HANDLER (OP_OP_NOT_EQUAL_STRING)        Reg ().IntVal () = Reg2String () != RegString () ? -1 : 0; VM_NEXT;
+    VM_HANDLER (OP_POP_GREATER_INT)            m_stack.Pop (Reg2 ());
+    VM_HANDLER (OP_OP_GREATER_INT)             Reg ().IntVal () = Reg2 ().IntVal () > Reg ().IntVal () ? -1 : 0; VM_NEXT;
+    VM_HANDLER (OP_POP_GREATER_REAL)           m_stack.Pop (Reg2 ());
+    VM_HANDLER (OP_OP_GREATER_REAL)            Reg ().IntVal () = Reg2 ().RealVal () > Reg ().RealVal () ? -1 : 0; VM_NEXT;
+    VM_HANDLER (OP_OP_GREATER_STRING)          Reg ().IntVal () = Reg2String () > RegString () ? -1 : 0; VM_NEXT;
+    VM_HANDLER (OP_POP_GREATER_EQUAL_INT)      m_stack.Pop (Reg2 ());
+    VM_HANDLER (OP_OP_GREATER_EQUAL_INT)       Reg ().IntVal () = Reg2 ().IntVal () >= Reg ().IntVal () ? -1 : 0; VM_NEXT;
+    VM_HANDLER (OP_POP_GREATER_EQUAL_REAL)     m_stack.Pop (Reg2 ());
+    VM_HANDLER (OP_OP_GREATER_EQUAL_REAL)      Reg ().IntVal () = Reg2 ().RealVal () >= Reg ().RealVal () ? -1 : 0; VM_NEXT;
+    VM_HANDLER (OP_OP_GREATER_EQUAL_STRING)    Reg ().IntVal () = Reg2String () >= RegString () ? -1 : 0; VM_NEXT;
+    VM_HANDLER (OP_POP_LESS_INT)               m_stack.Pop (Reg2 ());
+    VM_HANDLER (OP_OP_LESS_INT)                Reg ().IntVal () = Reg2 ().IntVal () < Reg ().IntVal () ? -1 : 0; VM_NEXT;
+    VM_HANDLER (OP_POP_LESS_REAL)              m_stack.Pop (Reg2 ());
+    VM_HANDLER (OP_OP_LESS_REAL)               Reg ().IntVal () = Reg2 ().RealVal () < Reg ().RealVal () ? -1 : 0; VM_NEXT;
+    VM_HANDLER (OP_OP_LESS_STRING)             Reg ().IntVal () = Reg2String () < RegString () ? -1 : 0; VM_NEXT;
+    VM_HANDLER (OP_POP_LESS_EQUAL_INT)         m_stack.Pop (Reg2 ());
+    VM_HANDLER (OP_OP_LESS_EQUAL_INT)          Reg ().IntVal () = Reg2 ().IntVal () <= Reg ().IntVal () ? -1 : 0; VM_NEXT;
+    VM_HANDLER (OP_POP_LESS_EQUAL_REAL)        m_stack.Pop (Reg2 ());
+    VM_HANDLER (OP_OP_LESS_EQUAL_REAL)         Reg ().IntVal () = Reg2 ().RealVal () <= Reg ().RealVal () ? -1 : 0; VM_NEXT;
+    VM_HANDLER (OP_OP_LESS_EQUAL_STRING)       Reg ().IntVal () = Reg2String () <= RegString () ? -1 : 0; VM_NEXT;
+
+    // Register machine
+    VM_HANDLER (OP_R_LOAD_CONST)
+        VM_RD = instruction->m_value;
+        VM_NEXT;
+
+    VM_HANDLER (OP_R_LOAD_VAR) {
+        assert (m_variables.IndexValid (instruction->m_value.IntVal ()));
+        vmVariable& var = m_variables.Variables () [instruction->m_value.IntVal ()];
+        if (var.Allocated ()) {
+            assert (m_data.IndexValid (var.m_dataIndex));
+            VM_RD = m_data.Data () [var.m_dataIndex];
+            VM_RESOLVE_VAR (OP_R_LOAD_DATA, var.m_dataIndex);
+            VM_NEXT;
+        }
+        SetError (ErrUnDIMmedVariable);
+        break;
+    }
+    VM_HANDLER (OP_R_SAVE_VAR) {
+        assert (m_variables.IndexValid (instruction->m_value.IntVal ()));
+        vmVariable& var = m_variables.Variables () [instruction->m_value.IntVal ()];
+        if (var.Allocated ()) {
+            assert (m_data.IndexValid (var.m_dataIndex));
+            m_data.Data () [var.m_dataIndex] = VM_RD;
+            VM_RESOLVE_VAR (OP_R_SAVE_DATA, var.m_dataIndex);
+            VM_NEXT;
+        }
+        SetError (ErrUnDIMmedVariable);
+        break;
+    }
+    VM_HANDLER (OP_R_MOVE)                  m_reg = VM_RD;                                          VM_NEXT;
+    VM_HANDLER (OP_R_CONV_INT_REAL)         VM_RD.RealVal () = VM_RA.IntVal ();                     VM_NEXT;
+    VM_HANDLER (OP_R_CONV_REAL_INT)         VM_RD.IntVal ()  = VM_RA.RealVal ();                    VM_NEXT;
+    VM_HANDLER (OP_R_NEG_INT)               VM_RD.IntVal ()  = -VM_RA.IntVal ();                    VM_NEXT;
+    VM_HANDLER (OP_R_NEG_REAL)              VM_RD.RealVal () = -VM_RA.RealVal ();                   VM_NEXT;
+    VM_HANDLER (OP_R_NOT)                   VM_RD.IntVal ()  = VM_RA.IntVal () == 0 ? -1 : 0;       VM_NEXT;
+    VM_HANDLER (OP_R_PLUS_INT)              VM_RD.IntVal ()  = VM_RA.IntVal () + VM_RB.IntVal ();   VM_NEXT;
+    VM_HANDLER (OP_R_PLUS_REAL)             VM_RD.RealVal () = VM_RA.RealVal () + VM_RB.RealVal (); VM_NEXT;
+    VM_HANDLER (OP_R_MINUS_INT)             VM_RD.IntVal ()  = VM_RA.IntVal () - VM_RB.IntVal ();   VM_NEXT;
+    VM_HANDLER (OP_R_MINUS_REAL)            VM_RD.RealVal () = VM_RA.RealVal () - VM_RB.RealVal (); VM_NEXT;
+    VM_HANDLER (OP_R_TIMES_INT)             VM_RD.IntVal ()  = VM_RA.IntVal () * VM_RB.IntVal ();   VM_NEXT;
+    VM_HANDLER (OP_R_TIMES_REAL)            VM_RD.RealVal () = VM_RA.RealVal () * VM_RB.RealVal (); VM_NEXT;
+    VM_HANDLER (OP_R_DIV_INT)               VM_RD.IntVal ()  = VM_RA.IntVal () / VM_RB.IntVal ();   VM_NEXT;
+    VM_HANDLER (OP_R_DIV_REAL)              VM_RD.RealVal () = VM_RA.RealVal () / VM_RB.RealVal (); VM_NEXT;
+    VM_HANDLER (OP_R_MOD_INT) {
+        vmInt i = VM_RA.IntVal () % VM_RB.IntVal ();
+        if (i >= 0) VM_RD.IntVal () = i;
+        else        VM_RD.IntVal () = VM_RB.IntVal () + i;
+        VM_NEXT;
+    }
+    VM_HANDLER (OP_R_EQUAL_INT)             VM_RD.IntVal () = VM_RA.IntVal () == VM_RB.IntVal () ? -1 : 0;      VM_NEXT;
+    VM_HANDLER (OP_R_EQUAL_REAL)            VM_RD.IntVal () = VM_RA.RealVal () == VM_RB.RealVal () ? -1 : 0;    VM_NEXT;
+    VM_HANDLER (OP_R_NOT_EQUAL_INT)         VM_RD.IntVal () = VM_RA.IntVal () != VM_RB.IntVal () ? -1 : 0;      VM_NEXT;
+    VM_HANDLER (OP_R_NOT_EQUAL_REAL)        VM_RD.IntVal () = VM_RA.RealVal () != VM_RB.RealVal () ? -1 : 0;    VM_NEXT;
+    VM_HANDLER (OP_R_GREATER_INT)           VM_RD.IntVal () = VM_RA.IntVal () > VM_RB.IntVal () ? -1 : 0;       VM_NEXT;
+    VM_HANDLER (OP_R_GREATER_REAL)          VM_RD.IntVal () = VM_RA.RealVal () > VM_RB.RealVal () ? -1 : 0;     VM_NEXT;
+    VM_HANDLER (OP_R_GREATER_EQUAL_INT)     VM_RD.IntVal () = VM_RA.IntVal () >= VM_RB.IntVal () ? -1 : 0;      VM_NEXT;
+    VM_HANDLER (OP_R_GREATER_EQUAL_REAL)    VM_RD.IntVal () = VM_RA.RealVal () >= VM_RB.RealVal () ? -1 : 0;    VM_NEXT;
+    VM_HANDLER (OP_R_LESS_INT)              VM_RD.IntVal () = VM_RA.IntVal () < VM_RB.IntVal () ? -1 : 0;       VM_NEXT;
+    VM_HANDLER (OP_R_LESS_REAL)             VM_RD.IntVal () = VM_RA.RealVal () < VM_RB.RealVal () ? -1 : 0;     VM_NEXT;
+    VM_HANDLER (OP_R_LESS_EQUAL_INT)        VM_RD.IntVal () = VM_RA.IntVal () <= VM_RB.IntVal () ? -1 : 0;      VM_NEXT;
+    VM_HANDLER (OP_R_LESS_EQUAL_REAL)       VM_RD.IntVal () = VM_RA.RealVal () <= VM_RB.RealVal () ? -1 : 0;    VM_NEXT;
+    VM_HANDLER (OP_R_AND)                   VM_RD.IntVal () = VM_RA.IntVal () & VM_RB.IntVal ();    VM_NEXT;
+    VM_HANDLER (OP_R_OR)                    VM_RD.IntVal () = VM_RA.IntVal () | VM_RB.IntVal ();    VM_NEXT;
+    VM_HANDLER (OP_R_XOR)                   VM_RD.IntVal () = VM_RA.IntVal () ^ VM_RB.IntVal ();    VM_NEXT;
+
+    VM_HANDLER (OP_CALL_FUNC)
 
         assert (instruction->m_value.IntVal () >= 0);
         assert (instruction->m_value.IntVal () < m_functions.size ());
 
-        // Call external function
+        // Call external function.
+        // (Functions returning arrays allocate temp data, which can run out.)
         m_functions [instruction->m_value.IntVal ()] (*this);
+        if (m_data.AllocFailed ())
+            SetError (ErrOutOfMemory);
         if (!Error ())
-            goto nextStep;
+            VM_NEXT;
         break;
 
-    case OP_CALL_OPERATOR_FUNC:
+    VM_HANDLER (OP_CALL_OPERATOR_FUNC)
 
         assert (instruction->m_value.IntVal () >= 0);
         assert (instruction->m_value.IntVal () < m_operatorFunctions.size ());
 
         // Call external function
         m_operatorFunctions [instruction->m_value.IntVal ()] (*this);
+        if (m_data.AllocFailed ())
+            SetError (ErrOutOfMemory);
         if (!Error ())
-            goto nextStep;
+            VM_NEXT;
         break;
 
-    case OP_TIMESHARE:
+    VM_HANDLER (OP_TIMESHARE)
+        stepCount += m_ip + 1 - blockStart;
         m_ip++;                             // Move on to next instruction
-        break;                              // And return
+        goto finish;                        // And return
 
-    case OP_FREE_TEMP:
+    VM_HANDLER (OP_FREE_TEMP)
         m_data.FreeTemp ();                 // Free temporary data
-        goto nextStep;
+        VM_NEXT;
 
-    case OP_ALLOC: {
+    VM_HANDLER (OP_ALLOC) {
 
         // Extract type, and array dimensions
         vmValType type = m_typeSet.GetValType (instruction->m_value.IntVal ());
@@ -539,17 +1377,25 @@ step:
             break;
 
         // Validate type size
-        if (!ValidateTypeSize (type))
+        if (m_dataTypes.DataSizeBiggerThan (type, m_data.MaxDataSize ())) {
+            SetError (ErrVariableTooBig);
             break;
+        }
 
-        // Allocate and initialise new data
-        m_reg.IntVal() = m_data.Allocate (m_dataTypes.DataSize (type));
+        // Allocate and initialise new data.
+        // (Allocated from the heap, so that it can be reclaimed once nothing
+        // points to it.)
+        m_reg.IntVal() = AllocHeapData (m_dataTypes.DataSize (type));
+        if (m_reg.IntVal () == 0) {
+            SetError (ErrOutOfMemory);
+            break;
+        }
         m_data.InitData (m_reg.IntVal(), type, m_dataTypes);
         
-        goto nextStep;
+        VM_NEXT;
     }
 
-    case OP_CALL: {
+    VM_HANDLER (OP_CALL) {
 
         // Call
         assert (instruction->m_value.IntVal () >= 0);
@@ -568,10 +1414,9 @@ step:
 //        m_stack.Push (vmValue ((int) m_ip + 1));
 
         // Jump to subroutine
-        m_ip = instruction->m_value.IntVal ();
-        goto step;
+        VM_BRANCH_CHECKED (instruction->m_value.IntVal ());
     }
-    case OP_RETURN:
+    VM_HANDLER (OP_RETURN)
 
         // Pop and validate return address
         if (m_callStack.empty ()) {
@@ -586,35 +1431,58 @@ step:
         }
 
         // Jump to return address
-        m_ip = tempI;
-        goto step;
+        VM_BRANCH_CHECKED (tempI);
 
-    case OP_DATA_READ:
+    VM_HANDLER (OP_DATA_READ)
 
         // Read program data into register
         if (ReadProgramData ((vmBasicValType) instruction->m_type))
-            goto nextStep;
+            VM_NEXT;
         else
             break;
 
-    case OP_DATA_RESET:
+    VM_HANDLER (OP_DATA_RESET)
 
         m_programDataOffset = instruction->m_value.IntVal ();
-        goto nextStep;
+        VM_NEXT;
 
-    case OP_RUN:
+    VM_HANDLER (OP_RUN)
+        stepCount += m_ip + 1 - blockStart;
         Reset ();                           // Reset program
-        break;                              // Timeshare break
+        goto finish;                        // Timeshare break
 
-    case OP_BREAKPT:
+    VM_HANDLER (OP_BREAKPT)
         m_paused = true;                    // Pause program
         break;                              // Timeshare break
 
     default:
+    VM_INVALID_HANDLER
         SetError (ErrInvalid);
     }
+
+    // Stopped on instruction m_ip (end of program, breakpoint or error)
+    stepCount += m_ip + 1 - blockStart;
+finish:
+    m_stepCount = stepCount;
+    return;
+
+outOfSteps:
+    m_stepCount = stepCount;
+    m_outOfSteps = true;
 }
 
+#undef VM_HANDLER
+#undef VM_INVALID_HANDLER
+#undef VM_REGISTER_HANDLER
+#undef VM_DISPATCH
+#undef VM_NEXT
+#undef VM_RESOLVE_VAR
+#undef VM_BRANCH
+#undef VM_BRANCH_CHECKED
+#undef VM_RD
+#undef VM_RA
+#undef VM_RB
+
 int TomVM::StoreStringConstant (std::string str) {
     int index = m_stringConstants.size ();
     m_stringConstants.push_back (str);
@@ -628,8 +1496,108 @@ void TomVM::BlockCopy      (int sourceIndex, int destIndex, int size) {
     assert (m_data.IndexValid (sourceIndex + size - 1));
     assert (m_data.IndexValid (destIndex));
     assert (m_data.IndexValid (destIndex + size - 1));
-    for (int i = 0; i < size; i++)
-        m_data.Data () [destIndex + i] = m_data.Data () [sourceIndex + i];
+    vmValue *data = m_data.Data ();
+    if (destIndex < sourceIndex)
+        std::copy (data + sourceIndex, data + sourceIndex + size, data + destIndex);
+    else                                            // (Regions can overlap)
+        std::copy_backward (data + sourceIndex, data + sourceIndex + size, data + destIndex + size);
+}
+
+void TomVM::CopyString     (int sourceIndex, int destIndex) {
+    vmValue& dest = m_data.Data () [destIndex];
+
+    // Allocate string space if necessary
+    if (dest.IntVal () == 0)
+        dest.IntVal () = AllocString ();
+
+    // Copy string value
+    m_strings.Value (dest.IntVal ()) = m_strings.Value (m_data.Data () [sourceIndex].IntVal ());
+}
+
+vmCopyPlan& TomVM::CopyPlan (int structure) {
+    assert (structure >= 0 && structure < (int) m_dataTypes.Structures ().size ());
+
+    // Find plan, building it if necessary
+    if (structure >= (int) m_copyPlans.size ())
+        m_copyPlans.resize (m_dataTypes.Structures ().size ());
+    vmCopyPlan& plan = m_copyPlans [structure];
+    if (!plan.m_built) {
+        vmValType type ((vmBasicValType) structure);
+        BuildCopyPlan (plan, 0, type);
+        plan.m_built = true;
+    }
+    return plan;
+}
+
+static void AddCopyRun (vmCopyPlan& plan, int offset, int size) {
+
+    // Extend the previous run if adjacent
+    if (size <= 0)
+        return;
+    if (!plan.m_runs.empty () && plan.m_runs.back ().m_offset + plan.m_runs.back ().m_size == offset)
+        plan.m_runs.back ().m_size += size;
+    else {
+        vmCopyRun run;
+        run.m_offset    = offset;
+        run.m_size      = size;
+        plan.m_runs.push_back (run);
+    }
+}
+
+void TomVM::BuildCopyPlan (vmCopyPlan& plan, int offset, vmValType& type) {
+    assert (m_dataTypes.TypeValid (type));
+
+    // Data without strings is block copied
+    if (!m_dataTypes.ContainsString (type))
+        AddCopyRun (plan, offset, m_dataTypes.DataSize (type));
+
+    // Strings are copied individually
+    else if (type == VTP_STRING)
+        plan.m_strings.push_back (offset);
+
+    // Arrays of field major structures are planned column by column
+    else if (m_dataTypes.FieldMajorArray (type)) {
+        AddCopyRun (plan, offset, 2);
+        vmStructure &s = m_dataTypes.Structures () [type.m_basicType];
+        int count = type.m_arrayDims [0];
+        for (int i = 0; i < s.m_fieldCount; i++) {
+            vmStructureField& f = m_dataTypes.Fields () [s.m_firstField + i];
+            int column = offset + 2 + f.m_dataOffset * count;
+            if (f.m_type == VTP_STRING)
+                for (int j = 0; j < count; j++)
+                    plan.m_strings.push_back (column + j);
+            else
+                AddCopyRun (plan, column, count);
+        }
+    }
+
+    // Arrays in structures have fixed dimensions, so their elements can be
+    // planned individually. (The header is copied too. It is identical.)
+    else if (type.m_arrayLevel > 0) {
+        AddCopyRun (plan, offset, 2);
+        vmValType elementType = type;
+        elementType.m_arrayLevel--;
+        int elementSize = m_dataTypes.DataSize (elementType);
+        for (unsigned int i = 0; i < type.m_arrayDims [type.m_arrayLevel - 1]; i++)
+            BuildCopyPlan (plan, offset + 2 + i * elementSize, elementType);
+    }
+
+    // Structures are planned field by field
+    else {
+        vmStructure &s = m_dataTypes.Structures () [type.m_basicType];
+        for (int i = 0; i < s.m_fieldCount; i++) {
+            vmStructureField& f = m_dataTypes.Fields () [s.m_firstField + i];
+            BuildCopyPlan (plan, offset + f.m_dataOffset, f.m_type);
+        }
+    }
+}
+
+void TomVM::CopyWithPlan (vmCopyPlan& plan, int sourceIndex, int destIndex) {
+    unsigned int i;
+    for (i = 0; i < plan.m_runs.size (); i++)
+        BlockCopy (sourceIndex + plan.m_runs [i].m_offset, destIndex + plan.m_runs [i].m_offset, plan.m_runs [i].m_size);
+    for (i = 0; i < plan.m_strings.size (); i++)
+        CopyString (sourceIndex + plan.m_strings [i], destIndex + plan.m_strings [i]);
 }
 
 void TomVM::CopyStructure  (int sourceIndex, int destIndex, vmValType& type) {
@@ -638,14 +1606,7 @@ void TomVM::CopyStructure  (int sourceIndex, int destIndex, vmValType& type) {
     assert (type.m_arrayLevel == 0);
     assert (type.m_basicType >= 0);
 
-    // Find structure definition
-    vmStructure &s = m_dataTypes.Structures () [type.m_basicType];
-
-    // Copy fields in structure
-    for (int i = 0; i < s.m_fieldCount; i++) {
-        vmStructureField& f = m_dataTypes.Fields () [s.m_firstField + i];
-        CopyField (sourceIndex + f.m_dataOffset, destIndex + f.m_dataOffset, f.m_type);
-    }
+    CopyWithPlan (CopyPlan (type.m_basicType), sourceIndex, destIndex);
 }
 
 void TomVM::CopyArray      (int sourceIndex, int destIndex, vmValType& type) {
@@ -663,15 +1624,36 @@ void TomVM::CopyArray      (int sourceIndex, int destIndex, vmValType& type) {
     int elementSize = m_data.Data () [sourceIndex + 1].IntVal ();
 
     // Copy elements
-    for (int i = 0; i < m_data.Data () [sourceIndex].IntVal (); i++) {
-        if (elementType.m_arrayLevel > 0)
+    int count = m_data.Data () [sourceIndex].IntVal ();
+    int i;
+    if (elementType.m_arrayLevel > 0) {
+        for (i = 0; i < count; i++)
             CopyArray ( sourceIndex + 2 + i * elementSize,
                         destIndex + 2 + i * elementSize,
                         elementType);
-        else
-            CopyField ( sourceIndex + 2 + i * elementSize,
-                        destIndex + 2 + i * elementSize,
-                        elementType);
+    }
+    else if (elementType == VTP_STRING) {
+        for (i = 0; i < count; i++)
+            CopyString (sourceIndex + 2 + i, destIndex + 2 + i);
+    }
+    else if (m_dataTypes.FieldMajorArray (type)) {
+
+        // Field major structures. Each field is a column of count values
+        vmStructure& s = m_dataTypes.Structures () [elementType.m_basicType];
+        for (int f = 0; f < s.m_fieldCount; f++) {
+            vmStructureField& field = m_dataTypes.Fields () [s.m_firstField + f];
+            int column = 2 + field.m_dataOffset * count;
+            if (field.m_type == VTP_STRING)
+                for (i = 0; i < count; i++)
+                    CopyString (sourceIndex + column + i, destIndex + column + i);
+            else
+                BlockCopy (sourceIndex + column, destIndex + column, count);
+        }
+    }
+    else {
+        vmCopyPlan& plan = CopyPlan (elementType.m_basicType);
+        for (i = 0; i < count; i++)
+            CopyWithPlan (plan, sourceIndex + 2 + i * elementSize, destIndex + 2 + i * elementSize);
     }
 }
 
@@ -680,16 +1662,8 @@ void TomVM::CopyField      (int sourceIndex, int destIndex, vmValType& type) {
     assert (m_dataTypes.TypeValid (type));
 
     // If type is basic string, copy string value
-    if (type == VTP_STRING) {
-        vmValue& dest = m_data.Data () [destIndex];
-
-        // Allocate string space if necessary
-        if (dest.IntVal () == 0)
-            dest.IntVal () = m_strings.Alloc ();
-
-        // Copy string value
-        m_strings.Value (dest.IntVal ()) = m_strings.Value (m_data.Data () [sourceIndex].IntVal ());
-    }
+    if (type == VTP_STRING)
+        CopyString (sourceIndex, destIndex);
 
     // If type is basic, or pointer then just copy value
     else if (type.IsBasic () || type.VirtualPointerLevel () > 0)
@@ -707,6 +1681,22 @@ void TomVM::CopyField      (int sourceIndex, int destIndex, vmValType& type) {
 }
 
 bool TomVM::CopyData       (int sourceIndex, int destIndex, vmValType type) {
+
+    // Check data can be copied, and find size
+    int size;
+    if (!CheckCopy (sourceIndex, destIndex, type, size))
+        return false;
+
+    // If data type doesn't contain strings, can do a straight block copy
+    if (!m_dataTypes.ContainsString (type))
+        BlockCopy (sourceIndex, destIndex, size);
+    else
+        CopyField (sourceIndex, destIndex, type);
+
+    return true;
+}
+
+bool TomVM::CheckCopy      (int sourceIndex, int destIndex, vmValType& type, int& size) {
     assert (m_dataTypes.TypeValid (type));
     assert (type.VirtualPointerLevel () == 0);
 
@@ -724,7 +1714,7 @@ bool TomVM::CopyData       (int sourceIndex, int destIndex, vmValType type) {
     }
     
     // Calculate element size
-    int size = 1;
+    size = 1;
     if (type.m_basicType >= 0)
         size = m_dataTypes.Structures () [type.m_basicType].m_dataSize;
 
@@ -742,25 +1732,277 @@ bool TomVM::CopyData       (int sourceIndex, int destIndex, vmValType type) {
                 return false;
             }
 
-            // Update data size
-            size *= m_data.Data () [s].IntVal ();
-            size += 2;
-
             // Point to first element in array
             s += 2; 
             d += 2;
         }
-    }
 
-    // If data type doesn't contain strings, can do a straight block copy
-    if (!m_dataTypes.ContainsString (type))
-        BlockCopy (sourceIndex, destIndex, size);
-    else
-        CopyField (sourceIndex, destIndex, type);
+        // Data size is the header plus the elements. (The outermost header
+        // stores the element size, including any nested array headers.)
+        size = m_data.Data () [sourceIndex].IntVal () * m_data.Data () [sourceIndex + 1].IntVal () + 2;
+    }
 
     return true;
 }
 
+void TomVM::DeferCopy      (int sourceIndex, int destIndex, int size) {
+    if (sourceIndex == destIndex)
+        return;
+
+    // Resolve interactions with copies already deferred:
+    //  * A copy into the destination is dropped. (It would be overwritten.)
+    //  * A copy from the destination is completed, as the destination is
+    //    about to change.
+    //  * A copy into the source is completed, so that the source holds the
+    //    data being copied.
+    // Thus no deferred copy ever reads the destination of another.
+    unsigned int i = 0;
+    while (i < m_deferredCopies.size ()) {
+        vmDeferredCopy& copy = m_deferredCopies [i];
+        if (copy.m_dest == destIndex)
+            m_deferredCopies.erase (m_deferredCopies.begin () + i);
+        else if (copy.m_source == destIndex || copy.m_dest == sourceIndex) {
+            BlockCopy (copy.m_source, copy.m_dest, copy.m_size);
+            m_deferredCopies.erase (m_deferredCopies.begin () + i);
+        }
+        else
+            i++;
+    }
+
+    // Defer copy
+    vmDeferredCopy copy;
+    copy.m_source   = sourceIndex;
+    copy.m_dest     = destIndex;
+    copy.m_size     = size;
+    m_deferredCopies.push_back (copy);
+}
+
+void TomVM::CompleteCopies (int index) {
+
+    // Complete deferred copies to or from data at index
+    unsigned int i = 0;
+    while (i < m_deferredCopies.size ()) {
+        vmDeferredCopy& copy = m_deferredCopies [i];
+        if (copy.m_source == index || copy.m_dest == index) {
+            BlockCopy (copy.m_source, copy.m_dest, copy.m_size);
+            m_deferredCopies.erase (m_deferredCopies.begin () + i);
+        }
+        else
+            i++;
+    }
+}
+
+void TomVM::CompleteCopies () {
+    for (unsigned int i = 0; i < m_deferredCopies.size (); i++)
+        BlockCopy (m_deferredCopies [i].m_source, m_deferredCopies [i].m_dest, m_deferredCopies [i].m_size);
+    m_deferredCopies.clear ();
+}
+
+int TomVM::DeferredCopySource (int index) {
+
+    // Return where data at index can be read from. This is the source of the
+    // deferred copy into it (if any).
+    for (unsigned int i = 0; i < m_deferredCopies.size (); i++)
+        if (m_deferredCopies [i].m_dest == index)
+            return m_deferredCopies [i].m_source;
+    return index;
+}
+
+bool TomVM::RefersToStrings (vmValType& type, std::vector<bool>& strucRefs) {
+    return      type.m_pointerLevel > 0
+            ||  type.m_basicType == VTP_STRING
+            ||  (type.m_basicType >= 0 && strucRefs [type.m_basicType]);
+}
+
+void TomVM::MarkBlock (int index, std::vector<char>& blocks, std::vector<int>& untyped, bool scan) {
+
+    // Mark the heap block containing index (if any) as reachable.
+    // If scan is set, every value in the block is also treated as a potential
+    // reference (see MarkUntyped), as its layout is not known.
+    int b = m_data.HeapBlockContaining (index);
+    if (b < 0 || blocks [b] == 2)
+        return;
+    if (scan) {
+        blocks [b] = 2;
+        untyped.push_back (b);
+    }
+    else
+        blocks [b] = 1;
+}
+
+void TomVM::MarkUntyped (vmValue& value, std::vector<bool>& marked, std::vector<char>& blocks, std::vector<int>& untyped) {
+
+    // Value has no type information, so it could be a string index or a
+    // pointer. Treat it as both.
+    MarkString (value.IntVal (), marked);
+    MarkBlock (value.IntVal (), blocks, untyped, true);
+}
+
+void TomVM::CollectGarbage (bool freeBlocks) {
+
+    // Mark and sweep collection of string slots and ALLOCated heap blocks.
+    // Strings in temporary data, and in allocated data that is no longer
+    // pointed to, are never explicitly freed. This reclaims them.
+    //
+    // Variable data is walked using its type information, following pointers
+    // into allocated data. A block is kept if anything points anywhere into
+    // it. The value stack, registers and temporary data have no type
+    // information, so any value in them that is an allocated string index is
+    // treated as a reference, and any value that points into a heap block
+    // keeps it (and everything its values could refer to).
+    std::vector<bool> marked (m_strings.Array ().size (), false);
+    marked [0] = true;                                  // Blank string is never freed
+    std::vector<char> blocks (m_data.HeapBlockCount (), 0);     // 1 = reachable, 2 = reachable and scanned as untyped
+    std::vector<int> untyped;                           // Blocks to scan as untyped
+
+    // Find structures that can refer to strings, directly or through pointers
+    std::vector<bool> strucRefs (m_dataTypes.Structures ().size (), false);
+    int i;
+    for (i = 0; i < (int) strucRefs.size (); i++) {
+        vmStructure& s = m_dataTypes.Structures () [i];
+        bool refs = s.m_containsString;
+        for (int j = 0; j < s.m_fieldCount && !refs; j++)
+            refs = RefersToStrings (m_dataTypes.Fields () [s.m_firstField + j].m_type, strucRefs);
+        strucRefs [i] = refs;
+    }
+
+    // Variables are the roots
+    std::vector<std::pair<int, vmValType> > pending;
+    std::set<std::pair<int, int> > followed;            // Pointer targets already walked (index, type)
+    for (   vmVariableArray::iterator v = m_variables.Variables ().begin ();
+            v != m_variables.Variables ().end ();
+            v++)
+        if ((*v).Allocated ()) {
+            MarkBlock ((*v).m_dataIndex, blocks, untyped, false);     // (REDIMmed arrays live in heap blocks)
+            if (RefersToStrings ((*v).m_type, strucRefs))
+                pending.push_back (std::make_pair ((int) (*v).m_dataIndex, (*v).m_type));
+        }
+
+    // Mark strings and blocks reachable from them
+    vmValue *data = m_data.Data ();
+    while (!pending.empty ()) {
+        int index = pending.back ().first;
+        vmValType type = pending.back ().second;
+        pending.pop_back ();
+        if (!m_data.IndexValid (index))
+            continue;
+
+        if (type.m_pointerLevel > 0) {
+
+            // Follow pointer to its target. (Each target is walked once, so
+            // cyclic structures terminate.)
+            int target = data [index].IntVal ();
+            MarkBlock (target, blocks, untyped, false);
+            type.m_pointerLevel--;
+            int key = ((type.m_basicType + 256) << 16) + (type.m_pointerLevel << 8) + type.m_arrayLevel;
+            if (target > 0
+            &&  RefersToStrings (type, strucRefs)
+            &&  followed.insert (std::make_pair (target, key)).second)
+                pending.push_back (std::make_pair (target, type));
+        }
+        else if (type.m_arrayLevel > 0) {
+            if (!m_data.IndexValid (index + 1))
+                continue;
+            int count       = data [index].IntVal ();
+            int elementSize = data [index + 1].IntVal ();
+            if (count <= 0 || elementSize <= 0 || !m_data.IndexValid (index + 1 + count * elementSize))
+                continue;
+            if (m_dataTypes.FieldMajorArray (type)) {
+
+                // Field major structures. Walk the columns of fields that can
+                // refer to strings.
+                vmStructure& s = m_dataTypes.Structures () [type.m_basicType];
+                for (int f = 0; f < s.m_fieldCount; f++) {
+                    vmStructureField& field = m_dataTypes.Fields () [s.m_firstField + f];
+                    int column = index + 2 + field.m_dataOffset * count;
+                    if (field.m_type == VTP_STRING)
+                        for (int e = 0; e < count; e++)
+                            MarkString (data [column + e].IntVal (), marked);
+                    else if (RefersToStrings (field.m_type, strucRefs))
+                        for (int e = 0; e < count; e++)
+                            pending.push_back (std::make_pair (column + e, field.m_type));
+                }
+                continue;
+            }
+            type.m_arrayLevel--;
+            for (int e = 0; e < count; e++) {
+                int element = index + 2 + e * elementSize;
+                if (type == VTP_STRING)
+                    MarkString (data [element].IntVal (), marked);
+                else
+                    pending.push_back (std::make_pair (element, type));
+            }
+        }
+        else if (type.m_basicType == VTP_STRING)
+            MarkString (data [index].IntVal (), marked);
+        else if (type.m_basicType >= 0) {
+            vmStructure& s = m_dataTypes.Structures () [type.m_basicType];
+            for (int f = 0; f < s.m_fieldCount; f++) {
+                vmStructureField& field = m_dataTypes.Fields () [s.m_firstField + f];
+                if (RefersToStrings (field.m_type, strucRefs))
+                    pending.push_back (std::make_pair (index + field.m_dataOffset, field.m_type));
+            }
+        }
+    }
+
+    // Value stack and registers
+    for (i = 0; i < m_stack.Size (); i++)
+        MarkUntyped (m_stack [i], marked, blocks, untyped);
+    MarkUntyped (m_reg, marked, blocks, untyped);
+    MarkUntyped (m_reg2, marked, blocks, untyped);
+    for (i = 0; i < VM_MAXREGISTERS; i++)
+        MarkUntyped (m_regFile [i], marked, blocks, untyped);
+
+    // Temporary data, including any made permanent by GetState
+    int tempStart = m_data.TempStart ();
+    if (m_savedTempStart >= 0 && (tempStart < 0 || m_savedTempStart < tempStart))
+        tempStart = m_savedTempStart;
+    if (tempStart >= 0)
+        for (i = tempStart; i < m_data.Size (); i++)
+            MarkUntyped (data [i], marked, blocks, untyped);
+
+    // Deferred copies still to read their source
+    for (i = 0; i < (int) m_deferredCopies.size (); i++) {
+        MarkBlock (m_deferredCopies [i].m_source, blocks, untyped, true);
+        MarkBlock (m_deferredCopies [i].m_dest, blocks, untyped, true);
+    }
+
+    // Scan blocks reached without type information
+    while (!untyped.empty ()) {
+        vmHeapBlock& block = m_data.HeapBlockAt (untyped.back ());
+        untyped.pop_back ();
+        for (i = block.m_start; i < block.m_start + block.m_size; i++)
+            MarkUntyped (data [i], marked, blocks, untyped);
+    }
+
+    // Sweep unmarked strings
+    for (i = 1; i < (int) marked.size (); i++)
+        if (!marked [i] && m_strings.Allocated (i)) {
+            vmString ().swap (m_strings.Value (i));     // Release string buffer
+            m_strings.Free (i);
+            m_reclaimedStrings++;
+        }
+
+    // Collect again once the store has doubled
+    m_stringCollectAt = m_strings.Count () * 2;
+    if (m_stringCollectAt < VM_MINSTRINGCOLLECT)
+        m_stringCollectAt = VM_MINSTRINGCOLLECT;
+
+    // Sweep unmarked blocks.
+    // (Only at points where the VM holds no data indices outside of its
+    // registers and stack. Strings can be collected in the middle of an
+    // instruction, so blocks are only freed when asked.)
+    if (freeBlocks) {
+        std::vector<bool> reachable (blocks.size ());
+        for (i = 0; i < (int) blocks.size (); i++)
+            reachable [i] = blocks [i] != 0;
+        m_reclaimedBlocks += m_data.HeapSweep (reachable);
+        m_heapCollectAt = m_data.HeapInUse () * 2;
+        if (m_heapCollectAt < VM_MINHEAPCOLLECT)
+            m_heapCollectAt = VM_MINHEAPCOLLECT;
+    }
+}
+
 bool TomVM::PopArrayDimensions (vmValType& type) {
     assert (m_dataTypes.TypeValid (type));
     assert (type.VirtualPointerLevel () == 0);
@@ -799,6 +2041,134 @@ bool TomVM::ValidateTypeSize (vmValType& type) {
     return true;
 }
 
+bool TomVM::ResizeArray (vmVariable& var, vmValType& type, bool& moved) {
+    assert (var.Allocated ());
+    assert (type.m_arrayLevel > 0);
+    assert (type.PhysicalPointerLevel () == 0);
+    moved = false;
+
+    if (m_dataTypes.DataSizeBiggerThan (type, m_data.MaxDataSize ())) {
+        SetError (ErrVariableTooBig);
+        return false;
+    }
+
+    // Complete any deferred copies to or from the array first
+    int index = var.m_dataIndex;
+    CompleteCopies (index);
+
+    // Find sizes. Capacity is the heap block size if the array has been
+    // moved before, otherwise just the size it was DIMmed to.
+    int oldSize     = m_dataTypes.DataSize (var.m_type);
+    int size        = m_dataTypes.DataSize (type);
+    int capacity    = m_data.HeapBlockSize (index);
+    if (capacity == 0)
+        capacity = oldSize;
+
+    // If only the first dimension changes (and the array isn't field major)
+    // the existing elements stay where they are, and elements are simply
+    // added or removed at the end.
+    bool sameLayout = !m_dataTypes.FieldMajorArray (type);
+    for (int i = 0; i < type.m_arrayLevel - 1 && sameLayout; i++)
+        sameLayout = type.m_arrayDims [i] == var.m_type.m_arrayDims [i];
+
+    // Resize in place if the array has room, or is the last allocation
+    if (sameLayout && (size <= capacity || m_data.Resize (index, capacity, size))) {
+        vmValue *data = m_data.Data ();
+        int oldCount    = data [index].IntVal ();
+        int count       = type.m_arrayDims [type.m_arrayLevel - 1];
+        int elementSize = data [index + 1].IntVal ();
+        if (size < oldSize) {
+
+            // Clear removed elements, so that they are zero if the array
+            // grows again.
+            // (The space is kept rather than returned, as pointers into the
+            // removed elements can still exist.)
+            std::fill (data + index + size, data + index + oldSize, vmValue ());
+        }
+        else if (size > oldSize) {
+
+            // Initialise new elements
+            std::fill (data + index + oldSize, data + index + size, vmValue ());
+            vmValType elementType = type;
+            elementType.m_arrayLevel--;
+            if (m_dataTypes.ContainsArray (elementType))
+                for (int i = oldCount; i < count; i++)
+                    m_data.InitData (index + 2 + i * elementSize, elementType, m_dataTypes);
+        }
+        data [index].IntVal () = count;
+        var.m_type = type;
+        return true;
+    }
+
+    // Otherwise move to a new heap block.
+    // A growing array gets at least twice its current space, so that growing
+    // it an element at a time takes amortised constant time.
+    int count = size;
+    if (size > capacity && size < capacity * 2 && m_data.RoomFor (capacity * 2 + 1))
+        count = capacity * 2;
+    int newIndex = AllocHeapData (count);
+    if (newIndex == 0) {
+        SetError (ErrOutOfMemory);
+        return false;
+    }
+    m_data.InitData (newIndex, type, m_dataTypes);
+    MoveArrayData (index, newIndex, type);
+
+    // Clear the old storage, so that it no longer shares strings with the new
+    // array. It is not freed, as pointers into it can still exist. (Heap
+    // blocks are reclaimed by CollectGarbage once nothing points to them.)
+    std::fill (m_data.Data () + index, m_data.Data () + index + oldSize, vmValue ());
+    var.m_dataIndex = newIndex;
+    var.m_type      = type;
+
+    // Instructions and compiled loops can refer to the old data
+    UnresolveVars ();
+    CodeChanged (0);
+    moved = true;
+    return true;
+}
+
+void TomVM::MoveArrayData (int sourceIndex, int destIndex, vmValType& type) {
+    assert (m_dataTypes.TypeValid (type));
+    assert (type.m_arrayLevel > 0);
+    assert (m_data.IndexValid (sourceIndex + 1));
+    assert (m_data.IndexValid (destIndex + 1));
+
+    // Move elements of an array into a newly initialised array with different
+    // dimensions. Elements that are in range in both arrays are moved.
+    // (Strings are moved by index rather than copied, as the source array is
+    // being discarded.)
+    vmValue *data       = m_data.Data ();
+    int sourceCount     = data [sourceIndex].IntVal ();
+    int sourceSize      = data [sourceIndex + 1].IntVal ();
+    int destCount       = data [destIndex].IntVal ();
+    int destSize        = data [destIndex + 1].IntVal ();
+    int count           = sourceCount < destCount ? sourceCount : destCount;
+    vmValType elementType = type;
+    elementType.m_arrayLevel--;
+    if (elementType.m_arrayLevel > 0) {
+        for (int i = 0; i < count; i++)
+            MoveArrayData ( sourceIndex + 2 + i * sourceSize,
+                            destIndex + 2 + i * destSize,
+                            elementType);
+    }
+    else if (m_dataTypes.FieldMajorArray (type)) {
+
+        // Field major structures. Columns start at different offsets
+        vmStructure& s = m_dataTypes.Structures () [elementType.m_basicType];
+        for (int f = 0; f < s.m_fieldCount; f++) {
+            vmStructureField& field = m_dataTypes.Fields () [s.m_firstField + f];
+            BlockCopy ( sourceIndex + 2 + field.m_dataOffset * sourceCount,
+                        destIndex + 2 + field.m_dataOffset * destCount,
+                        count);
+        }
+    }
+    else if (sourceSize > 0) {
+        assert (sourceSize == destSize);
+        BlockCopy (sourceIndex + 2, destIndex + 2, count * sourceSize);
+    }
+}
+
 void TomVM::PatchInBreakPt (unsigned int offset) {
 
     // Only patch if offset is valid and there is no breakpoint there already.
@@ -814,17 +2184,68 @@ void TomVM::PatchInBreakPt (unsigned int offset) {
 
         // Patch in breakpoint
         m_code [offset].m_opCode = OP_BREAKPT;
+        CodeChanged (offset);
     }
 }
 
+void TomVM::ResolveVar (unsigned int offset, vmOpCode opCode, unsigned int dataIndex) {
+
+    // Rewrite a variable access instruction to use the variable's data index
+    // directly, instead of looking up the variable each time.
+    // The original instruction is recorded so that it can be restored when
+    // the variables are deallocated (Clr, Reset, OP_RUN), or the code is
+    // modified.
+    assert (offset < m_code.size ());
+    vmResolvedVar rv;
+    rv.m_offset = offset;
+    rv.m_opCode = (vmOpCode) m_code [offset].m_opCode;
+    rv.m_var    = m_code [offset].m_value.IntVal ();
+    m_resolvedVars.push_back (rv);
+
+    m_code [offset].m_opCode            = opCode;
+    m_code [offset].m_value.IntVal ()   = dataIndex;
+}
+
+void TomVM::InternalUnresolveVars () {
+
+    // Restore instructions rewritten by ResolveVar
+    unsigned int first = m_code.size ();
+    for (   vmResolvedVarList::iterator i = m_resolvedVars.begin ();
+            i != m_resolvedVars.end ();
+            i++)
+        if ((*i).m_offset < m_code.size ()) {
+            vmInstruction& instruction = m_code [(*i).m_offset];
+            instruction.m_value.IntVal () = (*i).m_var;
+
+            // If a breakpoint is patched over the instruction, restore the
+            // op-code that it will be patched out to instead.
+            if (instruction.m_opCode == OP_BREAKPT) {
+                for (   vmPatchedBreakPtList::iterator j = m_patchedBreakPts.begin ();
+                        j != m_patchedBreakPts.end ();
+                        j++)
+                    if ((*j).m_offset == (*i).m_offset)
+                        (*j).m_replacedOpCode = (*i).m_opCode;
+            }
+            else
+                instruction.m_opCode = (*i).m_opCode;
+
+            if ((*i).m_offset < first)
+                first = (*i).m_offset;
+        }
+    m_resolvedVars.clear ();
+    CodeChanged (first);
+}
+
 void TomVM::InternalPatchOut () {
 
     // Patch out breakpoints and restore program to its no breakpoint state.
     for (   vmPatchedBreakPtList::iterator i = m_patchedBreakPts.begin ();
             i != m_patchedBreakPts.end ();
             i++)
-        if ((*i).m_offset < m_code.size ())
+        if ((*i).m_offset < m_code.size ()) {
             m_code [(*i).m_offset].m_opCode = (*i).m_replacedOpCode;
+            CodeChanged ((*i).m_offset);
+        }
     m_patchedBreakPts.clear ();
     m_breakPtsPatched = false;
 }
@@ -839,18 +2260,11 @@ void TomVM::InternalPatchIn () {
 
     // User breakpts
     // Convert from line numbers to offsets
-    unsigned int offset = 0;
     vmUserBreakPts::iterator i;
     for (   i  = m_userBreakPts.begin ();                                               // Loop through breakpoints
             i != m_userBreakPts.end ();
-            i++) {
-        while (offset < m_code.size () && m_code [offset].m_sourceLine < (*i).first)
-            offset++;
-        if (offset < m_code.size () && m_code [offset].m_sourceLine == (*i).first)      // Is breakpoint line valid?
-            (*i).second.m_offset = offset;
-        else
-            (*i).second.m_offset = 0xffff;                                              // 0xffff means line invalid
-    }
+            i++)
+        (*i).second.m_offset = CalcBreakPtOffset ((*i).first);
 
     // Patch in user breakpts
     for (   i  = m_userBreakPts.begin ();                                               // Loop through breakpoints
@@ -868,13 +2282,7 @@ void TomVM::InternalPatchIn () {
 }
 
 unsigned int TomVM::CalcBreakPtOffset (unsigned int line) {
-    unsigned int offset = 0;
-    while (offset < m_code.size () && m_code [offset].m_sourceLine < line)
-        offset++;
-    if (offset < m_code.size () && m_code [offset].m_sourceLine == line)        // Is breakpoint line valid?
-        return offset;
-    else
-        return 0xffff;                                                          // 0xffff means line invalid
+    return m_lines.FindLine (line, m_code.size ());                             // 0xffff means line invalid
 }
 
 void TomVM::AddStepBreakPts (bool stepInto) {
@@ -885,18 +2293,8 @@ void TomVM::AddStepBreakPts (bool stepInto) {
     PatchOut ();
 
     // Calculate op-code range that corresponds to the current line.
-    unsigned int line, startOffset, endOffset;
-    startOffset = m_ip;
-    line        = m_code [startOffset].m_sourceLine;
-
-    // Search for start of line
-    while (startOffset > 0 && m_code [startOffset - 1].m_sourceLine == line)
-        startOffset--;
-
-    // Search for start of next line
-    endOffset = m_ip + 1;
-    while (endOffset < m_code.size () && m_code [endOffset].m_sourceLine == line)
-        endOffset++;
+    unsigned int startOffset, endOffset;
+    m_lines.LineRange (m_ip, m_code.size (), startOffset, endOffset);
 
     // Create breakpoint on next line
     m_tempBreakPts.push_back (TempBreakPt (endOffset));
@@ -917,6 +2315,9 @@ void TomVM::AddStepBreakPts (bool stepInto) {
             if (!m_callStack.empty ())                      // Look at call stack and place breakpoint on return
                 dest = m_callStack [m_callStack.size () - 1];
             break;
+        default:
+            if (vmIsJump ((vmOpCode) m_code [i].m_opCode))  // Superinstructions containing a jump
+                dest = m_code [i].m_value.IntVal ();
         }
 
         if (dest < m_code.size ()                           // Destination valid?
@@ -938,9 +2339,20 @@ bool TomVM::AddStepOutBreakPt () {
     return false;
 }
 
+void TomVM::FuseInstructions (const std::vector<unsigned int>& entryPoints, std::vector<unsigned int>& offsetMap) {
+    PatchOut ();
+    UnresolveVars ();
+    vmFuseInstructions (m_code, m_lines, entryPoints, offsetMap);
+    m_ip = offsetMap [m_ip];
+    CodeChanged (0);
+}
+
 vmState TomVM::GetState () {
     vmState s;
 
+    // Debugging code reads variables directly
+    CompleteCopies ();
+
     // Instruction pointer
     s.ip = m_ip;
 
@@ -949,6 +2361,8 @@ vmState TomVM::GetState () {
     s.reg2          = m_reg2;
     s.regString     = m_regString;
     s.reg2String    = m_reg2String;
+    for (int i = 0; i < VM_MAXREGISTERS; i++)
+        s.regFile [i] = m_regFile [i];
 
     // Stacks
     s.stackTop      = m_stack.Size ();
@@ -959,6 +2373,8 @@ vmState TomVM::GetState () {
 
     // Variable data
     m_data.GetState (s.dataSize, s.tempDataStart);
+    if (m_savedTempStart < 0)
+        m_savedTempStart = (int) s.tempDataStart;       // Temp data is now permanent. Keep its strings.
 
     // Error state
     s.error         = Error ();
@@ -973,6 +2389,9 @@ vmState TomVM::GetState () {
 
 void TomVM::SetState (vmState& state) {
 
+    // Restore variable access instructions. (Code may be rolled back below.)
+    UnresolveVars ();
+
     // Instruction pointer
     m_ip                = state.ip;
 
@@ -981,6 +2400,8 @@ void TomVM::SetState (vmState& state) {
     m_reg2              = state.reg2;
     m_regString         = state.regString;
     m_reg2String        = state.reg2String;
+    for (int i = 0; i < VM_MAXREGISTERS; i++)
+        m_regFile [i] = state.regFile [i];
 
     // Stacks
     if (state.stackTop < m_stack.Size ())
@@ -989,11 +2410,15 @@ void TomVM::SetState (vmState& state) {
         m_callStack.resize (state.callStackTop);
 
     // Top of program
-    if (state.codeSize < m_code.size ())
+    if (state.codeSize < m_code.size ()) {
         m_code.resize (state.codeSize);
+        m_lines.Rollback (state.codeSize);
+        CodeChanged (state.codeSize);
+    }
 
     // Variable data
     m_data.SetState (state.dataSize, state.tempDataStart);
+    m_savedTempStart = -1;
 
     // Error state
     if (state.error)    SetError (state.errorString);
@@ -1089,18 +2514,25 @@ std::string TomVM::ValToString (vmValue val, vmValType type, int& maxChars) {
 
         // Enumerate elements
         std::string result = TrimToLength ("{", maxChars);
+        bool fieldMajor = m_dataTypes.FieldMajorArray (type);
         for (int i = 0; i < elements && maxChars > 0; i++) {
-            vmValue element = vmValue (arrayStart + i * elementSize);   // Address of element
-            vmValType elementType = type;       // Element type.
-            elementType.m_arrayLevel--;         // Less one array level.
-            elementType.m_pointerLevel = 1;     // Currently have a pointer
-            elementType.m_byRef = false;
-
-            // Deref to reach data
-            Deref (element, elementType);
 
-            // Describe element
-            result += ValToString (element, elementType, maxChars);
+            // Field major structures' fields are spread across the columns
+            if (fieldMajor)
+                result += StrucToString (arrayStart + i, elements, m_dataTypes.Structures () [type.m_basicType], maxChars);
+            else {
+                vmValue element = vmValue (arrayStart + i * elementSize);   // Address of element
+                vmValType elementType = type;       // Element type.
+                elementType.m_arrayLevel--;         // Less one array level.
+                elementType.m_pointerLevel = 1;     // Currently have a pointer
+                elementType.m_byRef = false;
+
+                // Deref to reach data
+                Deref (element, elementType);
+
+                // Describe element
+                result += ValToString (element, elementType, maxChars);
+            }
             if (i < elements - 1)
                 result += TrimToLength (", ", maxChars);
         }
@@ -1109,27 +2541,33 @@ std::string TomVM::ValToString (vmValue val, vmValType type, int& maxChars) {
     }
 
     // Structures
-    if (type.m_basicType >= 0) {
-        std::string result = TrimToLength ("{", maxChars);
-        vmStructure& structure = m_dataTypes.Structures () [type.m_basicType];
-        for (int i = 0; i < structure.m_fieldCount && maxChars > 0; i++) {
-            vmStructureField& field = m_dataTypes.Fields () [structure.m_firstField + i];
-            vmValue fieldVal    = vmValue (dataIndex + field.m_dataOffset);
-            vmValType fieldType = field.m_type;
-            fieldType.m_pointerLevel++;
-            Deref (fieldVal, fieldType);
-            result += TrimToLength (field.m_name + "=", maxChars) + ValToString (fieldVal, fieldType, maxChars);
-            if (i < structure.m_fieldCount - 1)
-                result += TrimToLength (", ", maxChars);
-        }
-        result += TrimToLength ("}", maxChars);
-        return result;
-    }
+    if (type.m_basicType >= 0)
+        return StrucToString (dataIndex, 1, m_dataTypes.Structures () [type.m_basicType], maxChars);
 
     return "???";
 }
 
+std::string TomVM::StrucToString (int dataIndex, int fieldStride, vmStructure& structure, int& maxChars) {
+
+    // Describe structure. Fields are at dataIndex + data offset * fieldStride.
+    // (The stride is the element count for field major structure arrays.)
+    std::string result = TrimToLength ("{", maxChars);
+    for (int i = 0; i < structure.m_fieldCount && maxChars > 0; i++) {
+        vmStructureField& field = m_dataTypes.Fields () [structure.m_firstField + i];
+        vmValue fieldVal    = vmValue (dataIndex + field.m_dataOffset * fieldStride);
+        vmValType fieldType = field.m_type;
+        fieldType.m_pointerLevel++;
+        Deref (fieldVal, fieldType);
+        result += TrimToLength (field.m_name + "=", maxChars) + ValToString (fieldVal, fieldType, maxChars);
+        if (i < structure.m_fieldCount - 1)
+            result += TrimToLength (", ", maxChars);
+    }
+    result += TrimToLength ("}", maxChars);
+    return result;
+}
+
 std::string TomVM::VarToString (vmVariable& v, int maxChars) {
+    CompleteCopies ();
     vmValue     val = vmValue ((int) v.m_dataIndex);
     vmValType   type = v.m_type;
     type.m_pointerLevel++;
@@ -1206,6 +2644,9 @@ bool TomVM::ReadProgramData    (vmBasicValType type) {
 void TomVM::StreamOut (std::ostream& stream) {
     int i;
 
+    // Stream the program as compiled
+    UnresolveVars ();
+
     // Stream header
     WriteString (stream, streamHeader);
     WriteLong (stream, streamVersion);
@@ -1225,6 +2666,9 @@ void TomVM::StreamOut (std::ostream& stream) {
     WriteLong (stream, m_code.size ());
     for (i = 0; i < m_code.size (); i++)
         m_code [i].StreamOut (stream);
+#ifdef STREAM_NAMES
+    m_lines.StreamOut (stream);
+#endif
 
     // Program data (for "DATA" statements)
     WriteLong (stream, m_programData.size ());
@@ -1276,6 +2720,10 @@ void TomVM::StreamIn (std::istream& stream) {
     m_code.resize (count);
     for (i = 0; i < count; i++)
         m_code [i].StreamIn (stream);
+#ifdef STREAM_NAMES
+    m_lines.StreamIn (stream);
+#endif
+    CodeChanged (0);
 
     // Program data (for "DATA" statements)
     count = ReadLong (stream);
@@ -12,11 +12,25 @@
 #include "HasErrorState.h"
 #include "vmFunction.h"
 #include "vmDebugger.h"
+#include "vmPeephole.h"
+#include "vmJit.h"
 //#include "EmbeddedFiles.h"
 
 #define VM_MAXSTACKCALLS 1000000        // 1,000,000 stack calls (4 meg stack space)
 #define VM_MAXDATA       100000000      // 100,000,000 variables (.4 gig of memory)
 #define VM_DATATOSTRINGMAXCHARS 4000
+#define VM_MINTIMESLICE  1000           // Minimum steps run between clock checks by ContinueFor
+#define VM_MAXTIMESLICE  10000000       // Maximum steps run between clock checks by ContinueFor
+#define VM_MINSTRINGCOLLECT 10000       // Minimum # of allocated strings before unreferenced strings are collected
+#define VM_MINHEAPCOLLECT 100000        // Minimum # of ALLOCated values before unreachable heap blocks are collected
+
+// Direct threaded dispatch.
+// Uses the "labels as values" extension, so is only available with GCC
+// compatible compilers. Define VM_NO_THREADED_DISPATCH to always use the
+// portable switch based dispatch.
+#if defined (__GNUC__) && !defined (VM_NO_THREADED_DISPATCH)
+#define VM_THREADED_DISPATCH
+#endif
 
 ////////////////////////////////////////////////////////////////////////////////
 // VM state
@@ -33,6 +47,7 @@ struct vmState {
     // Registers
     vmValue         reg, reg2;
     std::string     regString, reg2String;
+    vmValue         regFile [VM_MAXREGISTERS];
 
     // Stacks
     unsigned int    stackTop, callStackTop;
@@ -51,6 +66,51 @@ struct vmState {
     bool            paused;
 };
 
+////////////////////////////////////////////////////////////////////////////////
+// vmResolvedVar
+//
+// An instruction that the VM has rewritten to access its variable's data
+// directly, once the variable was allocated. Recorded so that the instruction
+// can be restored when the variables are deallocated.
+
+struct vmResolvedVar {
+    unsigned int    m_offset;           // Instruction offset
+    vmOpCode        m_opCode;           // Original op-code
+    vmInt           m_var;              // Original value (variable index)
+};
+typedef std::vector<vmResolvedVar> vmResolvedVarList;
+
+////////////////////////////////////////////////////////////////////////////////
+// vmCopyPlan
+//
+// Describes how to copy a structure that contains strings. Runs of values
+// without strings are block copied, then the strings are copied individually.
+// Built on first use, and cached by structure index.
+
+struct vmCopyRun {
+    int             m_offset;           // Offset of first value
+    int             m_size;             // # of values
+};
+struct vmCopyPlan {
+    bool                    m_built;
+    std::vector<vmCopyRun>  m_runs;     // Runs of values to block copy
+    std::vector<int>        m_strings;  // Offsets of string values
+    vmCopyPlan () : m_built (false) { ; }
+};
+typedef std::vector<vmCopyPlan> vmCopyPlanList;
+
+////////////////////////////////////////////////////////////////////////////////
+// vmDeferredCopy
+//
+// A copy-on-write array assignment that has not been performed yet.
+
+struct vmDeferredCopy {
+    int             m_source;           // Source data index
+    int             m_dest;             // Destination data index
+    int             m_size;             // # of values
+};
+typedef std::vector<vmDeferredCopy> vmDeferredCopyList;
+
 ////////////////////////////////////////////////////////////////////////////////
 // TomVM
 //
@@ -69,6 +129,13 @@ class TomVM : public HasErrorState {
     vmStore<vmString>           m_strings;
     std::list<vmResources *>    m_resources;
 
+    // String collection
+    int                         m_stringCollectAt;      // Collect unreferenced strings when this many are allocated
+    unsigned int                m_reclaimedStrings;     // # of strings reclaimed since the last Clr
+    int                         m_heapCollectAt;        // Collect unreachable heap blocks when this much heap data is in use
+    unsigned int                m_reclaimedBlocks;      // # of heap blocks reclaimed since the last Clr
+    int                         m_savedTempStart;       // Start of temp data made permanent by GetState, or -1
+
     // Program data
     vmProgramData               m_programData;          // General purpose program data (e.g declared with "DATA" keyword in BASIC)
     unsigned int                m_programDataOffset;
@@ -78,6 +145,11 @@ class TomVM : public HasErrorState {
                                 m_reg2;
     std::string                 m_regString,            // Register values when string
                                 m_reg2String;
+    vmValue                     m_regFile [VM_MAXREGISTERS];
+        // Register file used by register machine instructions (OP_R_...).
+        // Register machine code is only generated for expressions that do not
+        // call functions or gosubs, so registers are never live across a call
+        // and every frame can share the one register file.
 
     // Runtime stacks
     vmValueStack                m_stack;                // Used for expression evaluation
@@ -88,11 +160,22 @@ class TomVM : public HasErrorState {
 
     // Instructions
     std::vector<vmInstruction>  m_code;
+    vmLineTable                 m_lines;                // Source code positions
     vmValTypeSet                m_typeSet;
 
     // Instruction pointer
     unsigned int                m_ip;
 
+    // Variable access instructions rewritten to use data indices directly
+    vmResolvedVarList           m_resolvedVars;
+
+    // Structure copy plans, by structure index
+    vmCopyPlanList              m_copyPlans;
+
+    // Copy-on-write array assignment
+    bool                        m_copyOnWrite;
+    vmDeferredCopyList          m_deferredCopies;
+
     // Debugging
     vmPatchedBreakPtList        m_patchedBreakPts;      // Patched in breakpoints
     vmTempBreakPtList           m_tempBreakPts;         // Temporary breakpoints, generated for stepping over a line
@@ -101,14 +184,40 @@ class TomVM : public HasErrorState {
     bool                        m_paused,               // Set to true when program hits a breakpoint. (Or can be set by caller.)
                                 m_breakPtsPatched;      // Set to true if breakpoints are patched and in synchronisation with compiled code
 
+    // Step accounting
+    unsigned int                m_stepCount;            // Instructions executed by the last Continue
+    bool                        m_outOfSteps;           // True if the last Continue stopped because its step budget ran out
+    unsigned int                m_timeSlice;            // Steps per slice in ContinueFor (adapted to the execution speed)
+
+    // Threaded dispatch
+    bool                        m_threaded;             // True to execute using pre-decoded handler addresses
+    std::vector<const void *>   m_handlers;             // Handler address for each instruction in m_code
+    unsigned int                m_handlersValid;        // Number of m_handlers entries that are in sync with m_code
+
+    // Native code
+    bool                        m_jitEnabled;           // True to compile hot loops to native code
+#ifdef VM_JIT
+    vmJit                       m_jit;
+#endif
+
     // Internal methods
     void BlockCopy          (int sourceIndex, int destIndex, int size);
+    void CopyString         (int sourceIndex, int destIndex);
+    vmCopyPlan& CopyPlan    (int structure);
+    void BuildCopyPlan      (vmCopyPlan& plan, int offset, vmValType& type);
+    void CopyWithPlan       (vmCopyPlan& plan, int sourceIndex, int destIndex);
     void CopyStructure      (int sourceIndex, int destIndex, vmValType& type);
     void CopyArray          (int sourceIndex, int destIndex, vmValType& type);
     void CopyField          (int sourceIndex, int destIndex, vmValType& type);
     bool CopyData           (int sourceIndex, int destIndex, vmValType type);
+    bool CheckCopy          (int sourceIndex, int destIndex, vmValType& type, int& size);
+    void DeferCopy          (int sourceIndex, int destIndex, int size);
+    void CompleteCopies     (int index);
+    int DeferredCopySource  (int index);
     bool PopArrayDimensions (vmValType& type);
     bool ValidateTypeSize   (vmValType& type);
+    bool ResizeArray        (vmVariable& var, vmValType& type, bool& moved);
+    void MoveArrayData      (int sourceIndex, int destIndex, vmValType& type);
     bool ReadProgramData    (vmBasicValType type);
     void PatchInBreakPt (unsigned int offset);
     void InternalPatchOut ();
@@ -118,7 +227,66 @@ class TomVM : public HasErrorState {
             InternalPatchOut ();
     }
     unsigned int CalcBreakPtOffset (unsigned int line);
+    void ResolveVar (unsigned int offset, vmOpCode opCode, unsigned int dataIndex);
+    void InternalUnresolveVars ();
+    void UnresolveVars () {
+        if (!m_resolvedVars.empty ())
+            InternalUnresolveVars ();
+    }
     void Deref (vmValue& val, vmValType& type);
+    std::string StrucToString (int dataIndex, int fieldStride, vmStructure& structure, int& maxChars);
+    bool RefersToStrings (vmValType& type, std::vector<bool>& strucRefs);
+    void MarkString (int index, std::vector<bool>& marked) {
+        if (index > 0 && index < (int) marked.size () && m_strings.Allocated (index))
+            marked [index] = true;
+    }
+    void MarkBlock (int index, std::vector<char>& blocks, std::vector<int>& untyped, bool scan);
+    void MarkUntyped (vmValue& value, std::vector<bool>& marked, std::vector<char>& blocks, std::vector<int>& untyped);
+    int AllocString () {
+
+        // Allocate a string for variable data.
+        // Unreferenced strings are collected first if the store has grown.
+        if (m_strings.Count () >= m_stringCollectAt)
+            CollectGarbage (false);
+        return m_strings.Alloc ();
+    }
+    int AllocHeapData (int count) {
+
+        // Allocate heap data. Returns 0 if there is no room.
+        // Unreachable blocks are collected first if the heap has grown, and
+        // again if there is no room.
+        if (m_data.HeapInUse () >= m_heapCollectAt)
+            CollectGarbage (true);
+        int index = m_data.HeapAllocate (count);
+        if (index == 0) {
+            CollectGarbage (true);
+            index = m_data.HeapAllocate (count);
+        }
+        return index;
+    }
+    void ConcatRegStrings () {
+
+        // reg = reg2 + reg.
+        // Appends to reg2's buffer and swaps the buffers, rather than building
+        // a temporary string. (reg2 is left holding the old reg value.)
+        m_reg2String += m_regString;
+        m_regString.swap (m_reg2String);
+    }
+    template<bool threaded> void Execute (unsigned int steps);
+#ifdef VM_JIT
+    void RunLoop (vmJitLoop& loop, unsigned int& stepCount, unsigned int steps);
+#endif
+    void CodeChanged (unsigned int offset) {
+
+        // Instructions from offset onwards have been modified, and must be
+        // decoded again before the next threaded run. Compiled loops that
+        // contain them are discarded.
+        if (offset < m_handlersValid)
+            m_handlersValid = offset;
+#ifdef VM_JIT
+        m_jit.Invalidate (offset);
+#endif
+    }
 
 public:
     TomVM (int maxDataSize = VM_MAXDATA);
@@ -128,14 +296,41 @@ public:
     void Clr ();                                        // Clear variables
     void Reset ();
     void Continue (unsigned int steps = 0xffffffff);    // Continue execution from last position
+    void CollectGarbage (bool freeBlocks = true);      // Free strings (and optionally heap blocks) that are not referenced by any data
+    unsigned int LiveStrings ()         { return m_strings.Count () - 1; }
+    unsigned int ReclaimedStrings ()    { return m_reclaimedStrings; }
+    unsigned int ReclaimedBlocks ()     { return m_reclaimedBlocks; }
+    void ContinueFor (unsigned int microseconds);       // Continue execution until a wall clock deadline
+    unsigned int StepCount ()       { return m_stepCount; }
     bool Done () {
         assert (m_ip < m_code.size ());
         return m_code [m_ip].m_opCode == OP_END;        // Reached end of program?
     }
+    void SetThreadedDispatch (bool threaded) {
+#ifdef VM_THREADED_DISPATCH
+        m_threaded = threaded;
+#endif
+    }
+    bool ThreadedDispatch ()        { return m_threaded; }
+    void SetJIT (bool enabled) {
+#ifdef VM_JIT
+        m_jitEnabled = enabled;
+#endif
+    }
+    bool JIT ()                     { return m_jitEnabled; }
+    void SetCopyOnWrite (bool enabled) {
+        CompleteCopies ();
+        m_copyOnWrite = enabled;
+    }
+    bool CopyOnWrite ()             { return m_copyOnWrite; }
+    void CompleteCopies ();                             // Perform all deferred copy-on-write array assignments
     void GetIPInSourceCode (int& line, int& col) {
         assert (m_ip < m_code.size ());
-        line    = m_code [m_ip].m_sourceLine;
-        col     = m_code [m_ip].m_sourceChar;
+        m_lines.GetPos (m_ip, line, col);
+    }
+    void GetSourcePos (unsigned int offset, int& line, int& col) {
+        assert (offset < m_code.size ());
+        m_lines.GetPos (offset, line, col);
     }
 
     // External functions
@@ -205,23 +400,49 @@ public:
 
     // Building raw VM instructions
     unsigned int InstructionCount ()        { return m_code.size (); }
-    void AddInstruction (vmInstruction i)   { PatchOut (); m_code.push_back (i); }
+    void AddInstruction (vmInstruction i, unsigned int line = 0, unsigned int col = 0) {
+        PatchOut ();
+        UnresolveVars ();
+        m_lines.Add (m_code.size (), line, col);
+        m_code.push_back (i);
+    }
     void RollbackProgram (int size) {
         assert (size >= 0);
         assert (size <= InstructionCount());
+        UnresolveVars ();
         while (size < InstructionCount ())
             m_code.pop_back ();
+        m_lines.Rollback (size);
+        CodeChanged (size);
     }
     vmInstruction& Instruction (unsigned int index)  {
         assert (index < m_code.size ());
         PatchOut ();
+        UnresolveVars ();
+        CodeChanged (index);                // (Caller can modify the instruction)
         return m_code [index];
     }
     void RemoveLastInstruction () {
+        UnresolveVars ();
         m_code.pop_back ();
+        m_lines.Rollback (m_code.size ());
+        CodeChanged (m_code.size ());
+    }
+    void FuseInstructions (const std::vector<unsigned int>& entryPoints, std::vector<unsigned int>& offsetMap);
+    void CopyProgram (std::vector<vmInstruction>& code, vmLineTable& lines) {
+        PatchOut ();
+        UnresolveVars ();
+        code  = m_code;
+        lines = m_lines;
     }
+    void RestoreProgram (const std::vector<vmInstruction>& code, const vmLineTable& lines, unsigned int size);
+        // Replace program with the first size instructions of a copy made by
+        // CopyProgram. (Used to roll back to a point in the program and
+        // compile onwards from there.) Variables are cleared.
     int StoreType (vmValType& type)         { return m_typeSet.GetIndex (type); }
     vmValType& GetStoredType (int index)    { return m_typeSet.GetValType (index); }
+    int StoredTypeCount ()                  { return m_typeSet.Size (); }
+    void TruncateStoredTypes (int count)    { m_typeSet.Truncate (count); }
 
     // Program data
     void StoreProgramData (vmBasicValType t, vmValue v) {
@@ -31,8 +31,53 @@ std::string vmOpCodeName (vmOpCode code) {
     case OP_TIMESHARE:          return  "TIMESHARE";
     case OP_FREE_TEMP:          return  "FREE_TEMP";
     case OP_ALLOC:              return  "ALLOC";
+    case OP_REDIM:              return  "REDIM";
     case OP_DATA_READ:          return  "DATA_READ";
     case OP_DATA_RESET:         return  "DATA_RESET";
+    case OP_R_LOAD_CONST:       return  "R_LOAD_CONST";
+    case OP_R_LOAD_VAR:         return  "R_LOAD_VAR";
+    case OP_R_SAVE_VAR:         return  "R_SAVE_VAR";
+    case OP_R_MOVE:             return  "R_MOVE";
+    case OP_R_CONV_INT_REAL:    return  "R_CONV_INT_REAL";
+    case OP_R_CONV_REAL_INT:    return  "R_CONV_REAL_INT";
+    case OP_R_NEG_INT:          return  "R_NEG_INT";
+    case OP_R_NEG_REAL:         return  "R_NEG_REAL";
+    case OP_R_NOT:              return  "R_NOT";
+    case OP_ARRAY_INDEX_UNCHECKED:      return  "ARRAY_INDEX_UNCHECKED";
+    case OP_POP_ARRAY_INDEX_UNCHECKED:  return  "POP_ARRAY_INDEX_UNCHECKED";
+    case OP_ARRAY_INDEX_N:              return  "ARRAY_INDEX_N";
+    case OP_ARRAY_INDEX_FIELD:          return  "ARRAY_INDEX_FIELD";
+    case OP_LOAD_VAR_DEREF:              return  "LOAD_VAR_DEREF";
+    case OP_LOAD_VAR_PUSH:               return  "LOAD_VAR_PUSH";
+    case OP_PUSH_VAR:                    return  "PUSH_VAR";
+    case OP_PUSH_CONST:                  return  "PUSH_CONST";
+    case OP_POP_SAVE:                    return  "POP_SAVE";
+    case OP_POP_ARRAY_INDEX:             return  "POP_ARRAY_INDEX";
+    case OP_POP_PLUS_INT:                return  "POP_PLUS_INT";
+    case OP_POP_PLUS_REAL:               return  "POP_PLUS_REAL";
+    case OP_POP_PLUS_STRING:             return  "POP_PLUS_STRING";
+    case OP_POP_MINUS_INT:               return  "POP_MINUS_INT";
+    case OP_POP_MINUS_REAL:              return  "POP_MINUS_REAL";
+    case OP_POP_TIMES_INT:               return  "POP_TIMES_INT";
+    case OP_POP_TIMES_REAL:              return  "POP_TIMES_REAL";
+    case OP_POP_DIV_INT:                 return  "POP_DIV_INT";
+    case OP_POP_DIV_REAL:                return  "POP_DIV_REAL";
+    case OP_POP_MOD_INT:                 return  "POP_MOD_INT";
+    case OP_POP_EQUAL_INT:               return  "POP_EQUAL_INT";
+    case OP_POP_EQUAL_REAL:              return  "POP_EQUAL_REAL";
+    case OP_POP_NOT_EQUAL_INT:           return  "POP_NOT_EQUAL_INT";
+    case OP_POP_NOT_EQUAL_REAL:          return  "POP_NOT_EQUAL_REAL";
+    case OP_POP_GREATER_INT:             return  "POP_GREATER_INT";
+    case OP_POP_GREATER_REAL:            return  "POP_GREATER_REAL";
+    case OP_POP_GREATER_EQUAL_INT:       return  "POP_GREATER_EQUAL_INT";
+    case OP_POP_GREATER_EQUAL_REAL:      return  "POP_GREATER_EQUAL_REAL";
+    case OP_POP_LESS_INT:                return  "POP_LESS_INT";
+    case OP_POP_LESS_REAL:               return  "POP_LESS_REAL";
+    case OP_POP_LESS_EQUAL_INT:          return  "POP_LESS_EQUAL_INT";
+    case OP_POP_LESS_EQUAL_REAL:         return  "POP_LESS_EQUAL_REAL";
+    case OP_POP_AND:                     return  "POP_AND";
+    case OP_POP_OR:                      return  "POP_OR";
+    case OP_POP_XOR:                     return  "POP_XOR";
     case OP_JUMP:               return  "JUMP";
     case OP_JUMP_TRUE:          return  "JUMP_TRUE";
     case OP_JUMP_FALSE:         return  "JUMP_FALSE";
@@ -40,12 +85,36 @@ std::string vmOpCodeName (vmOpCode code) {
     case OP_CALL_OPERATOR_FUNC: return  "CALL_OPERATOR_FUNC";
     case OP_CALL:               return  "CALL";
     case OP_RETURN:             return  "RETURN";
+    case OP_POP_EQUAL_INT_JUMP_FALSE:    return  "POP_EQUAL_INT_JUMP_FALSE";
+    case OP_POP_EQUAL_REAL_JUMP_FALSE:   return  "POP_EQUAL_REAL_JUMP_FALSE";
+    case OP_POP_NOT_EQUAL_INT_JUMP_FALSE: return  "POP_NOT_EQUAL_INT_JUMP_FALSE";
+    case OP_POP_NOT_EQUAL_REAL_JUMP_FALSE: return  "POP_NOT_EQUAL_REAL_JUMP_FALSE";
+    case OP_POP_GREATER_INT_JUMP_FALSE:  return  "POP_GREATER_INT_JUMP_FALSE";
+    case OP_POP_GREATER_REAL_JUMP_FALSE: return  "POP_GREATER_REAL_JUMP_FALSE";
+    case OP_POP_GREATER_EQUAL_INT_JUMP_FALSE: return  "POP_GREATER_EQUAL_INT_JUMP_FALSE";
+    case OP_POP_GREATER_EQUAL_REAL_JUMP_FALSE: return  "POP_GREATER_EQUAL_REAL_JUMP_FALSE";
+    case OP_POP_LESS_INT_JUMP_FALSE:     return  "POP_LESS_INT_JUMP_FALSE";
+    case OP_POP_LESS_REAL_JUMP_FALSE:    return  "POP_LESS_REAL_JUMP_FALSE";
+    case OP_POP_LESS_EQUAL_INT_JUMP_FALSE: return  "POP_LESS_EQUAL_INT_JUMP_FALSE";
+    case OP_POP_LESS_EQUAL_REAL_JUMP_FALSE: return  "POP_LESS_EQUAL_REAL_JUMP_FALSE";
     case OP_OP_NEG:             return  "OP_NEG";
     case OP_OP_PLUS:            return  "OP_PLUS";
     case OP_OP_MINUS:           return  "OP_MINUS";
     case OP_OP_TIMES:           return  "OP_TIMES";
     case OP_OP_DIV:             return  "OP_DIV";
     case OP_OP_MOD:             return  "OP_MOD";
+    case OP_OP_NEG_INT:         return  "OP_NEG_INT";
+    case OP_OP_NEG_REAL:        return  "OP_NEG_REAL";
+    case OP_OP_PLUS_INT:        return  "OP_PLUS_INT";
+    case OP_OP_PLUS_REAL:       return  "OP_PLUS_REAL";
+    case OP_OP_PLUS_STRING:     return  "OP_PLUS_STRING";
+    case OP_OP_MINUS_INT:       return  "OP_MINUS_INT";
+    case OP_OP_MINUS_REAL:      return  "OP_MINUS_REAL";
+    case OP_OP_TIMES_INT:       return  "OP_TIMES_INT";
+    case OP_OP_TIMES_REAL:      return  "OP_TIMES_REAL";
+    case OP_OP_DIV_INT:         return  "OP_DIV_INT";
+    case OP_OP_DIV_REAL:        return  "OP_DIV_REAL";
+    case OP_OP_MOD_INT:         return  "OP_MOD_INT";
     case OP_OP_NOT:             return  "OP_NOT";
     case OP_OP_EQUAL:           return  "OP_EQUAL";
     case OP_OP_NOT_EQUAL:       return  "OP_NOT_EQUAL";
@@ -53,6 +122,24 @@ std::string vmOpCodeName (vmOpCode code) {
     case OP_OP_GREATER_EQUAL:   return  "OP_GREATER_EQUAL";
     case OP_OP_LESS:            return  "OP_LESS";
     case OP_OP_LESS_EQUAL:      return  "OP_LESS_EQUAL";
+    case OP_OP_EQUAL_INT:               return  "OP_EQUAL_INT";
+    case OP_OP_EQUAL_REAL:              return  "OP_EQUAL_REAL";
+    case OP_OP_EQUAL_STRING:            return  "OP_EQUAL_STRING";
+    case OP_OP_NOT_EQUAL_INT:           return  "OP_NOT_EQUAL_INT";
+    case OP_OP_NOT_EQUAL_REAL:          return  "OP_NOT_EQUAL_REAL";
+    case OP_OP_NOT_EQUAL_STRING:        return  "OP_NOT_EQUAL_STRING";
+    case OP_OP_GREATER_INT:             return  "OP_GREATER_INT";
+    case OP_OP_GREATER_REAL:            return  "OP_GREATER_REAL";
+    case OP_OP_GREATER_STRING:          return  "OP_GREATER_STRING";
+    case OP_OP_GREATER_EQUAL_INT:       return  "OP_GREATER_EQUAL_INT";
+    case OP_OP_GREATER_EQUAL_REAL:      return  "OP_GREATER_EQUAL_REAL";
+    case OP_OP_GREATER_EQUAL_STRING:    return  "OP_GREATER_EQUAL_STRING";
+    case OP_OP_LESS_INT:                return  "OP_LESS_INT";
+    case OP_OP_LESS_REAL:               return  "OP_LESS_REAL";
+    case OP_OP_LESS_STRING:             return  "OP_LESS_STRING";
+    case OP_OP_LESS_EQUAL_INT:          return  "OP_LESS_EQUAL_INT";
+    case OP_OP_LESS_EQUAL_REAL:         return  "OP_LESS_EQUAL_REAL";
+    case OP_OP_LESS_EQUAL_STRING:       return  "OP_LESS_EQUAL_STRING";
     case OP_CONV_INT_REAL:      return  "CONV_INT_REAL";
     case OP_CONV_INT_STRING:    return  "CONV_INT_STRING";
     case OP_CONV_REAL_STRING:   return  "CONV_REAL_STRING";
@@ -64,12 +151,115 @@ std::string vmOpCodeName (vmOpCode code) {
     case OP_OP_XOR:             return  "OP_XOR";
     case OP_CONV_REAL_INT:      return  "CONV_REAL_INT";
     case OP_CONV_REAL_INT2:     return  "CONV_REAL_INT2";
+    case OP_R_PLUS_INT:         return  "R_PLUS_INT";
+    case OP_R_PLUS_REAL:        return  "R_PLUS_REAL";
+    case OP_R_MINUS_INT:        return  "R_MINUS_INT";
+    case OP_R_MINUS_REAL:       return  "R_MINUS_REAL";
+    case OP_R_TIMES_INT:        return  "R_TIMES_INT";
+    case OP_R_TIMES_REAL:       return  "R_TIMES_REAL";
+    case OP_R_DIV_INT:          return  "R_DIV_INT";
+    case OP_R_DIV_REAL:         return  "R_DIV_REAL";
+    case OP_R_MOD_INT:          return  "R_MOD_INT";
+    case OP_R_EQUAL_INT:        return  "R_EQUAL_INT";
+    case OP_R_EQUAL_REAL:       return  "R_EQUAL_REAL";
+    case OP_R_NOT_EQUAL_INT:    return  "R_NOT_EQUAL_INT";
+    case OP_R_NOT_EQUAL_REAL:   return  "R_NOT_EQUAL_REAL";
+    case OP_R_GREATER_INT:      return  "R_GREATER_INT";
+    case OP_R_GREATER_REAL:     return  "R_GREATER_REAL";
+    case OP_R_GREATER_EQUAL_INT:    return  "R_GREATER_EQUAL_INT";
+    case OP_R_GREATER_EQUAL_REAL:   return  "R_GREATER_EQUAL_REAL";
+    case OP_R_LESS_INT:         return  "R_LESS_INT";
+    case OP_R_LESS_REAL:        return  "R_LESS_REAL";
+    case OP_R_LESS_EQUAL_INT:   return  "R_LESS_EQUAL_INT";
+    case OP_R_LESS_EQUAL_REAL:  return  "R_LESS_EQUAL_REAL";
+    case OP_R_AND:              return  "R_AND";
+    case OP_R_OR:               return  "R_OR";
+    case OP_R_XOR:              return  "R_XOR";
     case OP_RUN:                return  "OP_RUN";
+    case OP_LOAD_DATA:          return  "LOAD_DATA";
+    case OP_PUSH_DATA:          return  "PUSH_DATA";
+    case OP_R_LOAD_DATA:        return  "R_LOAD_DATA";
+    case OP_R_SAVE_DATA:        return  "R_SAVE_DATA";
+    case OP_COPY_COW:           return  "COPY_COW";
+    case OP_LOAD_VAR_COW:       return  "LOAD_VAR_COW";
+    case OP_LOAD_VAR_COW_READ:  return  "LOAD_VAR_COW_READ";
     case OP_BREAKPT:            return  "OP_BREAKPT";
     default:                    return  "???";
     };
 }
 
+vmOpCode vmTypedOpCode (vmOpCode code, vmBasicValType type) {
+
+    // Find specialised op-code for type.
+    // Note: Specialised op-codes are declared in int, real, string order
+    // (where applicable).
+    int offset;
+    switch (type) {
+    case VTP_INT:       offset = 0; break;
+    case VTP_REAL:      offset = 1; break;
+    case VTP_STRING:    offset = 2; break;
+    default:            return code;
+    }
+
+    switch (code) {
+    case OP_OP_NEG:             if (offset < 2) return (vmOpCode) (OP_OP_NEG_INT + offset);     break;
+    case OP_OP_PLUS:            return (vmOpCode) (OP_OP_PLUS_INT + offset);
+    case OP_OP_MINUS:           if (offset < 2) return (vmOpCode) (OP_OP_MINUS_INT + offset);   break;
+    case OP_OP_TIMES:           if (offset < 2) return (vmOpCode) (OP_OP_TIMES_INT + offset);   break;
+    case OP_OP_DIV:             if (offset < 2) return (vmOpCode) (OP_OP_DIV_INT + offset);     break;
+    case OP_OP_MOD:             if (offset < 1) return OP_OP_MOD_INT;                           break;
+    case OP_OP_EQUAL:           return (vmOpCode) (OP_OP_EQUAL_INT + offset);
+    case OP_OP_NOT_EQUAL:       return (vmOpCode) (OP_OP_NOT_EQUAL_INT + offset);
+    case OP_OP_GREATER:         return (vmOpCode) (OP_OP_GREATER_INT + offset);
+    case OP_OP_GREATER_EQUAL:   return (vmOpCode) (OP_OP_GREATER_EQUAL_INT + offset);
+    case OP_OP_LESS:            return (vmOpCode) (OP_OP_LESS_INT + offset);
+    case OP_OP_LESS_EQUAL:      return (vmOpCode) (OP_OP_LESS_EQUAL_INT + offset);
+    default:                    break;
+    }
+    return code;
+}
+
+bool vmIsJump (vmOpCode code) {
+    return  code == OP_JUMP
+        ||  code == OP_JUMP_TRUE
+        ||  code == OP_JUMP_FALSE
+        ||  code == OP_CALL
+        ||  (code >= OP_POP_EQUAL_INT_JUMP_FALSE && code <= OP_POP_LESS_EQUAL_REAL_JUMP_FALSE);
+}
+
+vmOpCode vmRegisterOpCode (vmOpCode code) {
+    switch (code) {
+    case OP_OP_NEG_INT:             return OP_R_NEG_INT;
+    case OP_OP_NEG_REAL:            return OP_R_NEG_REAL;
+    case OP_OP_NOT:                 return OP_R_NOT;
+    case OP_OP_PLUS_INT:            return OP_R_PLUS_INT;
+    case OP_OP_PLUS_REAL:           return OP_R_PLUS_REAL;
+    case OP_OP_MINUS_INT:           return OP_R_MINUS_INT;
+    case OP_OP_MINUS_REAL:          return OP_R_MINUS_REAL;
+    case OP_OP_TIMES_INT:           return OP_R_TIMES_INT;
+    case OP_OP_TIMES_REAL:          return OP_R_TIMES_REAL;
+    case OP_OP_DIV_INT:             return OP_R_DIV_INT;
+    case OP_OP_DIV_REAL:            return OP_R_DIV_REAL;
+    case OP_OP_MOD_INT:             return OP_R_MOD_INT;
+    case OP_OP_EQUAL_INT:           return OP_R_EQUAL_INT;
+    case OP_OP_EQUAL_REAL:          return OP_R_EQUAL_REAL;
+    case OP_OP_NOT_EQUAL_INT:       return OP_R_NOT_EQUAL_INT;
+    case OP_OP_NOT_EQUAL_REAL:      return OP_R_NOT_EQUAL_REAL;
+    case OP_OP_GREATER_INT:         return OP_R_GREATER_INT;
+    case OP_OP_GREATER_REAL:        return OP_R_GREATER_REAL;
+    case OP_OP_GREATER_EQUAL_INT:   return OP_R_GREATER_EQUAL_INT;
+    case OP_OP_GREATER_EQUAL_REAL:  return OP_R_GREATER_EQUAL_REAL;
+    case OP_OP_LESS_INT:            return OP_R_LESS_INT;
+    case OP_OP_LESS_REAL:           return OP_R_LESS_REAL;
+    case OP_OP_LESS_EQUAL_INT:      return OP_R_LESS_EQUAL_INT;
+    case OP_OP_LESS_EQUAL_REAL:     return OP_R_LESS_EQUAL_REAL;
+    case OP_OP_AND:                 return OP_R_AND;
+    case OP_OP_OR:                  return OP_R_OR;
+    case OP_OP_XOR:                 return OP_R_XOR;
+    default:                        return OP_NOP;
+    }
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 // vmInstruction
 #ifdef VM_STATE_STREAMING
@@ -77,20 +267,142 @@ void vmInstruction::StreamOut (std::ostream& stream) {
     WriteByte (stream, m_opCode);
     WriteByte (stream, m_type);
     m_value.StreamOut (stream);
-#ifdef STREAM_NAMES
-    WriteLong (stream, m_sourceLine);
-    WriteShort (stream, m_sourceChar);
-#endif
 }
 
 void vmInstruction::StreamIn (std::istream& stream) {
     m_opCode        = ReadByte (stream);
     m_type          = ReadByte (stream);
     m_value.StreamIn (stream);
-#ifdef STREAM_NAMES
-    m_sourceLine    = ReadLong (stream);
-    m_sourceChar    = ReadShort (stream);
+}
 #endif
+
+////////////////////////////////////////////////////////////////////////////////
+// vmLineTable
+
+int vmLineTable::FindEntry (unsigned int offset) {
+
+    // Binary search for last entry starting at or before offset
+    int lo = 0, hi = m_entries.size ();
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (m_entries [mid].m_offset <= offset)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo - 1;
+}
+
+void vmLineTable::Add (unsigned int offset, unsigned int line, unsigned int col) {
+    if (!m_entries.empty ()) {
+        vmLineTableEntry& last = m_entries.back ();
+        assert (offset >= last.m_offset);
+        if (last.m_line == line && last.m_col == col)
+            return;
+        if (last.m_offset == offset) {
+            last.m_line = line;
+            last.m_col  = col;
+            return;
+        }
+    }
+    m_entries.push_back (vmLineTableEntry (offset, line, col));
+}
+
+void vmLineTable::Rollback (unsigned int offset) {
+    while (!m_entries.empty () && m_entries.back ().m_offset >= offset)
+        m_entries.pop_back ();
+}
+
+void vmLineTable::Remap (const std::vector<unsigned int>& offsetMap) {
+
+    // Each new instruction takes the position of the first old instruction
+    // that maps to it
+    std::vector<vmLineTableEntry> old;
+    old.swap (m_entries);
+    unsigned int size = offsetMap.empty () ? 0 : offsetMap.size () - 1;
+    unsigned int e = 0;
+    for (unsigned int i = 0; i < size; i++) {
+        while (e + 1 < old.size () && old [e + 1].m_offset <= i)
+            e++;
+        if (e < old.size () && old [e].m_offset <= i && (i == 0 || offsetMap [i] != offsetMap [i - 1]))
+            Add (offsetMap [i], old [e].m_line, old [e].m_col);
+    }
+}
+
+void vmLineTable::GetPos (unsigned int offset, int& line, int& col) {
+    int i = FindEntry (offset);
+    if (i >= 0) {
+        line    = m_entries [i].m_line;
+        col     = m_entries [i].m_col;
+    }
+    else {
+        line    = 0;
+        col     = 0;
+    }
+}
+
+unsigned int vmLineTable::Line (unsigned int offset) {
+    int i = FindEntry (offset);
+    return i >= 0 ? m_entries [i].m_line : 0;
+}
+
+void vmLineTable::InstructionLines (unsigned int codeSize, std::vector<unsigned int>& lines) {
+    lines.resize (codeSize);
+    unsigned int e = 0, line = 0;
+    for (unsigned int i = 0; i < codeSize; i++) {
+        while (e < m_entries.size () && m_entries [e].m_offset <= i)
+            line = m_entries [e++].m_line;
+        lines [i] = line;
+    }
+}
+
+unsigned int vmLineTable::FindLine (unsigned int line, unsigned int codeSize) {
+    for (unsigned int i = 0; i < m_entries.size () && m_entries [i].m_offset < codeSize; i++)
+        if (m_entries [i].m_line >= line)
+            return m_entries [i].m_line == line ? m_entries [i].m_offset : 0xffff;
+    return 0xffff;
+}
+
+void vmLineTable::LineRange (unsigned int offset, unsigned int codeSize, unsigned int& start, unsigned int& end) {
+    start   = 0;
+    end     = codeSize;
+    int i = FindEntry (offset);
+    if (i < 0)
+        return;
+    unsigned int line = m_entries [i].m_line;
+
+    // Search for start of line
+    int j = i;
+    while (j > 0 && m_entries [j - 1].m_line == line)
+        j--;
+    start = m_entries [j].m_offset;
+
+    // Search for start of next line
+    j = i + 1;
+    while (j < (int) m_entries.size () && m_entries [j].m_line == line)
+        j++;
+    if (j < (int) m_entries.size () && m_entries [j].m_offset < codeSize)
+        end = m_entries [j].m_offset;
+}
+
+#ifdef VM_STATE_STREAMING
+void vmLineTable::StreamOut (std::ostream& stream) {
+    WriteLong (stream, m_entries.size ());
+    for (unsigned int i = 0; i < m_entries.size (); i++) {
+        WriteLong (stream, m_entries [i].m_offset);
+        WriteLong (stream, m_entries [i].m_line);
+        WriteLong (stream, m_entries [i].m_col);
+    }
+}
+
+void vmLineTable::StreamIn (std::istream& stream) {
+    int count = ReadLong (stream);
+    m_entries.resize (count);
+    for (int i = 0; i < count; i++) {
+        m_entries [i].m_offset  = ReadLong (stream);
+        m_entries [i].m_line    = ReadLong (stream);
+        m_entries [i].m_col     = ReadLong (stream);
+    }
 }
 #endif
 
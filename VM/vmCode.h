@@ -40,6 +40,83 @@ enum vmOpCode {
     OP_DATA_READ,           // Read program data into data at [reg]. Instruction contains target data type.
     OP_DATA_RESET,          // Reset program data pointer
 
+    // Register machine.
+    // Generated by the compiler's register code generator for numeric
+    // expressions. Operands are held in the register file (TomVM::m_regFile)
+    // rather than in reg, reg2 and the stack.
+    // The instruction type holds the destination register. The instruction
+    // value holds the source registers (see vmRegOperands), a variable index
+    // or a constant.
+    OP_R_LOAD_CONST = 0x11,     // Load constant into register
+    OP_R_LOAD_VAR,              // Load int or real variable into register
+    OP_R_SAVE_VAR,              // Save register into int or real variable. (Type holds the source register.)
+    OP_R_MOVE,                  // Copy register into reg. (Type holds the source register.)
+    OP_R_CONV_INT_REAL,
+    OP_R_CONV_REAL_INT,
+    OP_R_NEG_INT,
+    OP_R_NEG_REAL,
+    OP_R_NOT,
+
+    // Unchecked array indexing.
+    // Generated by the compiler in place of ARRAY_INDEX when the index is
+    // known to be within the array bounds (e.g. a "for" loop variable whose
+    // range fits the array size).
+    OP_ARRAY_INDEX_UNCHECKED = 0x1c,    // ARRAY_INDEX without null pointer or range checks
+    OP_POP_ARRAY_INDEX_UNCHECKED,       // POP, ARRAY_INDEX_UNCHECKED
+
+    // Multi-dimensional array indexing.
+    // Indexes through every dimension in one step. The instruction value holds
+    // the number of indices in the low byte. Bit 8 + n is set when the
+    // compiler has proved index n is within range.
+    // IN:  stack = array address, then each index except the last.
+    //      reg   = last index.
+    // OUT: reg   = element address. Stack entries are popped.
+    OP_ARRAY_INDEX_N = 0x1e,
+
+    // Field major structure array indexing (see vmStructure).
+    // As ARRAY_INDEX_N, but the last dimension is an array of field major
+    // structures, and the output is the address of a field. Bits 18 and up of
+    // the instruction value hold the field's data offset.
+    OP_ARRAY_INDEX_FIELD,
+
+    // Superinstructions.
+    // Generated by the peephole optimiser (see vmPeephole.h) from common
+    // instruction sequences. Each one has exactly the same effect as the
+    // sequence it replaces.
+    OP_LOAD_VAR_DEREF = 0x20,   // LOAD_VAR, DEREF (int or real)
+    OP_LOAD_VAR_PUSH,           // LOAD_VAR, PUSH
+    OP_PUSH_VAR,                // LOAD_VAR, DEREF, PUSH (int or real)
+    OP_PUSH_CONST,              // LOAD_CONST, PUSH (int or real)
+    OP_POP_SAVE,                // POP, SAVE (int or real)
+    OP_POP_ARRAY_INDEX,         // POP, ARRAY_INDEX
+
+    // POP followed by a type specialised operator
+    OP_POP_PLUS_INT = 0x26,
+    OP_POP_PLUS_REAL,
+    OP_POP_PLUS_STRING,
+    OP_POP_MINUS_INT,
+    OP_POP_MINUS_REAL,
+    OP_POP_TIMES_INT,
+    OP_POP_TIMES_REAL,
+    OP_POP_DIV_INT,
+    OP_POP_DIV_REAL,
+    OP_POP_MOD_INT,
+    OP_POP_EQUAL_INT = 0x30,
+    OP_POP_EQUAL_REAL,
+    OP_POP_NOT_EQUAL_INT,
+    OP_POP_NOT_EQUAL_REAL,
+    OP_POP_GREATER_INT,
+    OP_POP_GREATER_REAL,
+    OP_POP_GREATER_EQUAL_INT,
+    OP_POP_GREATER_EQUAL_REAL,
+    OP_POP_LESS_INT,
+    OP_POP_LESS_REAL,
+    OP_POP_LESS_EQUAL_INT,
+    OP_POP_LESS_EQUAL_REAL,
+    OP_POP_AND,
+    OP_POP_OR,
+    OP_POP_XOR,
+
     // Flow control
     OP_JUMP = 0x40,         // Unconditional jump
     OP_JUMP_TRUE,           // Jump if reg <> 0
@@ -49,6 +126,21 @@ enum vmOpCode {
     OP_CALL,                // Call VM function
     OP_RETURN,              // Return from VM function
 
+    // Flow control superinstructions.
+    // POP, type specialised comparison, JUMP_FALSE
+    OP_POP_EQUAL_INT_JUMP_FALSE = 0x48,
+    OP_POP_EQUAL_REAL_JUMP_FALSE,
+    OP_POP_NOT_EQUAL_INT_JUMP_FALSE,
+    OP_POP_NOT_EQUAL_REAL_JUMP_FALSE,
+    OP_POP_GREATER_INT_JUMP_FALSE,
+    OP_POP_GREATER_REAL_JUMP_FALSE,
+    OP_POP_GREATER_EQUAL_INT_JUMP_FALSE,
+    OP_POP_GREATER_EQUAL_REAL_JUMP_FALSE,
+    OP_POP_LESS_INT_JUMP_FALSE,
+    OP_POP_LESS_REAL_JUMP_FALSE,
+    OP_POP_LESS_EQUAL_INT_JUMP_FALSE,
+    OP_POP_LESS_EQUAL_REAL_JUMP_FALSE,
+
     // Operations
     // Mathematical
     OP_OP_NEG = 0x60,
@@ -58,6 +150,22 @@ enum vmOpCode {
     OP_OP_DIV,
     OP_OP_MOD,
 
+    // Type specialised mathematical operations.
+    // Equivalent to the above with the operand type built into the op-code,
+    // so the VM doesn't need to inspect the instruction type.
+    OP_OP_NEG_INT = 0x68,
+    OP_OP_NEG_REAL,
+    OP_OP_PLUS_INT,
+    OP_OP_PLUS_REAL,
+    OP_OP_PLUS_STRING,
+    OP_OP_MINUS_INT,
+    OP_OP_MINUS_REAL,
+    OP_OP_TIMES_INT,
+    OP_OP_TIMES_REAL,
+    OP_OP_DIV_INT,
+    OP_OP_DIV_REAL,
+    OP_OP_MOD_INT,
+
     // Logical
     OP_OP_NOT = 0x80,
     OP_OP_EQUAL,
@@ -70,6 +178,26 @@ enum vmOpCode {
     OP_OP_OR,
     OP_OP_XOR,
 
+    // Type specialised comparisons
+    OP_OP_EQUAL_INT = 0x8a,
+    OP_OP_EQUAL_REAL,
+    OP_OP_EQUAL_STRING,
+    OP_OP_NOT_EQUAL_INT,
+    OP_OP_NOT_EQUAL_REAL,
+    OP_OP_NOT_EQUAL_STRING,
+    OP_OP_GREATER_INT,
+    OP_OP_GREATER_REAL,
+    OP_OP_GREATER_STRING,
+    OP_OP_GREATER_EQUAL_INT,
+    OP_OP_GREATER_EQUAL_REAL,
+    OP_OP_GREATER_EQUAL_STRING,
+    OP_OP_LESS_INT,
+    OP_OP_LESS_REAL,
+    OP_OP_LESS_STRING,
+    OP_OP_LESS_EQUAL_INT,
+    OP_OP_LESS_EQUAL_REAL,
+    OP_OP_LESS_EQUAL_STRING,
+
     // Conversion
     OP_CONV_INT_REAL = 0xa0,    // Convert integer in reg to real
     OP_CONV_INT_STRING,         // Convert integer in reg to string
@@ -80,8 +208,55 @@ enum vmOpCode {
     OP_CONV_REAL_STRING2,       // Convert real in reg2 to string
     OP_CONV_REAL_INT2,
 
+    // Register machine operations.
+    // Destination = source A operator source B.
+    // (Same ordering as the POP + operator superinstructions.)
+    OP_R_PLUS_INT = 0xa8,
+    OP_R_PLUS_REAL,
+    OP_R_MINUS_INT,
+    OP_R_MINUS_REAL,
+    OP_R_TIMES_INT,
+    OP_R_TIMES_REAL,
+    OP_R_DIV_INT,
+    OP_R_DIV_REAL,
+    OP_R_MOD_INT,
+    OP_R_EQUAL_INT,
+    OP_R_EQUAL_REAL,
+    OP_R_NOT_EQUAL_INT,
+    OP_R_NOT_EQUAL_REAL,
+    OP_R_GREATER_INT,
+    OP_R_GREATER_REAL,
+    OP_R_GREATER_EQUAL_INT,
+    OP_R_GREATER_EQUAL_REAL,
+    OP_R_LESS_INT,
+    OP_R_LESS_REAL,
+    OP_R_LESS_EQUAL_INT,
+    OP_R_LESS_EQUAL_REAL,
+    OP_R_AND,
+    OP_R_OR,
+    OP_R_XOR,
+
     // Misc routine
     OP_RUN = 0xc0,              // Restart program. Reinitialises variables, display, state e.t.c
+    OP_REDIM,                   // Resize an array variable, preserving its contents. (Allocates it if necessary.)
+
+    // Resolved variable access.
+    // The VM rewrites variable access instructions into these (or into
+    // LOAD_CONST and PUSH_CONST) once the variable is allocated. The
+    // instruction value holds the variable's data index. Never generated by
+    // the compiler.
+    OP_LOAD_DATA = 0xc8,        // Resolved LOAD_VAR_DEREF
+    OP_PUSH_DATA,               // Resolved PUSH_VAR
+    OP_R_LOAD_DATA,             // Resolved R_LOAD_VAR
+    OP_R_SAVE_DATA,             // Resolved R_SAVE_VAR
+
+    // Copy-on-write array assignment.
+    // Generated by the compiler for whole array assignments between variables
+    // whose address is never taken, and for every other load of those
+    // variables. (See TomVM::SetCopyOnWrite.)
+    OP_COPY_COW = 0xd0,         // COPY, deferred until either array is next loaded
+    OP_LOAD_VAR_COW,            // LOAD_VAR, completing deferred copies to or from the variable first
+    OP_LOAD_VAR_COW_READ,       // LOAD_VAR to read a single value. Reads a deferred copy from its source.
 
     // Debugging
     OP_BREAKPT = 0xe0           // Breakpoint
@@ -89,42 +264,58 @@ enum vmOpCode {
 
 std::string vmOpCodeName (vmOpCode code);
 
+// Return the type specialised version of a generic operator op-code.
+// Returns the op-code unchanged if there is no specialised version for the
+// given type.
+vmOpCode vmTypedOpCode (vmOpCode code, vmBasicValType type);
+
+// Return true if the instruction's value is the offset of another instruction
+// (i.e. the op-code is a jump or a call).
+bool vmIsJump (vmOpCode code);
+
+// Return the register machine version of a type specialised operator op-code.
+// Returns OP_NOP if there is no register machine version.
+vmOpCode vmRegisterOpCode (vmOpCode code);
+
+// Register machine operands.
+// Registers are numbered 0 to VM_MAXREGISTERS - 1, so that each fits in a
+// byte.
+#define VM_MAXREGISTERS 256
+inline vmValue vmRegOperands (int a, int b = 0) {
+    assert (a >= 0 && a < VM_MAXREGISTERS);
+    assert (b >= 0 && b < VM_MAXREGISTERS);
+    return vmValue ((vmInt) (a | (b << 8)));
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 // vmInstruction
-#pragma pack (push, 1)
 struct vmInstruction {
 
-    // Note:    vmInstruction size = 12 bytes.
-    //          Ordering of member fields is important, as the two 4 byte members
-    //          are first (and hence aligned to a 4 byte boundary).
-    //          m_sourceChar is next, and aligned to a 2 byte boundary.
-    //          Single byte fields are last, as their alignment is unimportant.
+    // Note:    vmInstruction size = 8 bytes, so that instructions are
+    //          aligned and never straddle a cache line.
+    //          Source code positions are stored separately in a vmLineTable.
     vmValue         m_value;                // Value
-    unsigned int    m_sourceLine;           // For debugging
-    unsigned short  m_sourceChar;
     byte            m_opCode;               // (vmOpCode)
     char            m_type;                 // (vmBasicVarType)
+    unsigned short  m_reserved;             // Padding
 
     vmInstruction () {
         m_opCode        = 0;
         m_type          = 0;
-        m_sourceLine    = 0;
-        m_sourceChar    = 0;
+        m_reserved      = 0;
         m_value         = 0;
     }
     vmInstruction (const vmInstruction& i) {
         m_opCode        = i.m_opCode;
         m_type          = i.m_type;
-        m_sourceChar    = i.m_sourceChar;
-        m_sourceLine    = i.m_sourceLine;
+        m_reserved      = i.m_reserved;
         m_value         = i.m_value;
     }
-    vmInstruction (byte opCode, byte type, vmValue val, int sourceLine = 0, int sourceChar = 0) {
+    vmInstruction (byte opCode, byte type, vmValue val) {
         m_opCode        = opCode;
         m_type          = type;
+        m_reserved      = 0;
         m_value         = val;
-        m_sourceLine    = sourceLine;
-        m_sourceChar    = sourceChar;
     }
 
     // Streaming
@@ -133,6 +324,59 @@ struct vmInstruction {
     void StreamIn (std::istream& stream);
 #endif
 };
-#pragma pack (pop)
+
+////////////////////////////////////////////////////////////////////////////////
+// vmLineTable
+//
+// Source code position of each instruction, for debugging.
+// Consecutive instructions compiled from the same source position share a
+// single entry, so the table is usually much smaller than the program.
+
+struct vmLineTableEntry {
+    unsigned int    m_offset;               // First instruction at this position
+    unsigned int    m_line;
+    unsigned int    m_col;
+
+    vmLineTableEntry (unsigned int offset = 0, unsigned int line = 0, unsigned int col = 0)
+        : m_offset (offset), m_line (line), m_col (col) { ; }
+};
+
+class vmLineTable {
+    std::vector<vmLineTableEntry> m_entries;        // Sorted by offset
+
+    int FindEntry (unsigned int offset);            // Entry containing offset. -1 if none
+public:
+    void Clear ()                       { m_entries.clear (); }
+
+    // Set position of instructions from offset onwards.
+    // Offset must not be less than that of any previous call.
+    void Add (unsigned int offset, unsigned int line, unsigned int col);
+
+    // Discard positions of instructions from offset onwards
+    void Rollback (unsigned int offset);
+
+    // Update positions after instructions have been moved.
+    // offsetMap maps each old offset to its new offset (see vmFuseInstructions)
+    void Remap (const std::vector<unsigned int>& offsetMap);
+
+    // Queries
+    void GetPos (unsigned int offset, int& line, int& col);
+    unsigned int Line (unsigned int offset);
+    void InstructionLines (unsigned int codeSize, std::vector<unsigned int>& lines);
+        // Returns the line of each of the first codeSize instructions.
+        // (Quicker than calling Line for each one.)
+    unsigned int FindLine (unsigned int line, unsigned int codeSize);
+        // Returns offset of first instruction on line, or 0xffff if there is
+        // none. (Lines before the first instruction with line >= the one
+        // requested are not searched.)
+    void LineRange (unsigned int offset, unsigned int codeSize, unsigned int& start, unsigned int& end);
+        // Returns the range of instructions around offset on the same line
+
+    // Streaming
+#ifdef VM_STATE_STREAMING
+    void StreamOut (std::ostream& stream);
+    void StreamIn (std::istream& stream);
+#endif
+};
 
 #endif
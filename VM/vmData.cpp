@@ -4,6 +4,12 @@
 #pragma hdrstop
 
 #include "vmData.h"
+#include <new>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
 
 //---------------------------------------------------------------------------
 
@@ -29,6 +35,259 @@ void vmIntHandleResources::Clear () {
 ////////////////////////////////////////////////////////////////////////////////
 // vmData
 
+static vmValue *ReserveMemory (int count) {
+#ifdef _WIN32
+    return (vmValue *) VirtualAlloc (NULL, (SIZE_T) count * sizeof (vmValue), MEM_RESERVE, PAGE_NOACCESS);
+#else
+    void *p = mmap (NULL, (size_t) count * sizeof (vmValue), PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    return p == MAP_FAILED ? NULL : (vmValue *) p;
+#endif
+}
+
+static void ReleaseMemory (vmValue *p, int count) {
+#ifdef _WIN32
+    VirtualFree (p, 0, MEM_RELEASE);
+#else
+    munmap (p, (size_t) count * sizeof (vmValue));
+#endif
+}
+
+vmData::vmData (int maxDataSize) {
+    assert (maxDataSize > 0);
+
+    // Reserve address space for the permanent data, plus room for temp data
+    // allocated after it. If the address space is not available (e.g. on 32
+    // bit platforms) reduce the maximum data size until it is.
+    m_data = NULL;
+    while (m_data == NULL) {
+        m_reserved  = maxDataSize + VM_MAXTEMPDATA;
+        m_data      = ReserveMemory (m_reserved);
+        if (m_data == NULL) {
+            if (maxDataSize <= VM_DATASEGMENT)
+                throw std::bad_alloc ();
+            maxDataSize /= 2;
+        }
+    }
+    m_maxDataSize   = maxDataSize;
+    m_committed     = 0;
+    Clear ();
+}
+
+vmData::~vmData () {
+    ReleaseMemory (m_data, m_reserved);
+}
+
+bool vmData::Commit (int size) {
+    assert (size > m_committed);
+
+    // Round up to a whole segment
+    int newCommitted = ((size + VM_DATASEGMENT - 1) / VM_DATASEGMENT) * VM_DATASEGMENT;
+    if (newCommitted > m_reserved)
+        newCommitted = m_reserved;
+    if (size > newCommitted)
+        return false;                       // Past the reserved address space
+
+    // Commit the new memory. The OS supplies it zero filled.
+#ifdef _WIN32
+    if (VirtualAlloc (m_data + m_committed, (SIZE_T) (newCommitted - m_committed) * sizeof (vmValue), MEM_COMMIT, PAGE_READWRITE) == NULL)
+        return false;
+#else
+    if (mprotect (m_data + m_committed, (size_t) (newCommitted - m_committed) * sizeof (vmValue), PROT_READ | PROT_WRITE) != 0)
+        return false;
+#endif
+    m_committed = newCommitted;
+    return true;
+}
+
+void vmData::Decommit () {
+    if (m_committed == 0)
+        return;
+
+    // Return memory to the OS. Address space remains reserved.
+#ifdef _WIN32
+    VirtualFree (m_data, (SIZE_T) m_committed * sizeof (vmValue), MEM_DECOMMIT);
+#else
+    madvise (m_data, (size_t) m_committed * sizeof (vmValue), MADV_DONTNEED);
+    mprotect (m_data, (size_t) m_committed * sizeof (vmValue), PROT_NONE);
+#endif
+    m_committed = 0;
+}
+
+static int HeapSizeClass (int count) {
+    assert (count > 0);
+
+    // Find size class for a block of count values
+    if (count <= VM_HEAPEXACTCLASSES)
+        return count - 1;
+    int sizeClass = VM_HEAPEXACTCLASSES, size = VM_HEAPEXACTCLASSES * 2;
+    while (size < count && size < VM_HEAPMAXCLASSSIZE * 2) {
+        sizeClass++;
+        size <<= 1;
+    }
+    return sizeClass;
+}
+
+static int HeapClassSize (int sizeClass, int count) {
+
+    // Size of a block in sizeClass that holds count values
+    if (sizeClass < VM_HEAPEXACTCLASSES)
+        return sizeClass + 1;
+    int size = (VM_HEAPEXACTCLASSES * 2) << (sizeClass - VM_HEAPEXACTCLASSES);
+    return size <= VM_HEAPMAXCLASSSIZE ? size : count;      // Bigger blocks are not rounded up
+}
+
+int vmData::HeapAllocate (int count) {
+    if (m_heapFree.empty ())
+        m_heapFree.resize (HeapSizeClass (VM_HEAPMAXCLASSSIZE + 1) + 1, VM_HEAPEND);
+
+    // Reuse a free block if possible.
+    // (Only blocks too big for a size class can be too small.)
+    int sizeClass = HeapSizeClass (count);
+    int *link = &m_heapFree [sizeClass];
+    while (*link != VM_HEAPEND && m_heapBlocks [*link].m_size < count)
+        link = &m_heapBlocks [*link].m_nextFree;
+    if (*link != VM_HEAPEND) {
+        vmHeapBlock& block = m_heapBlocks [*link];
+        *link = block.m_nextFree;
+        block.m_nextFree = VM_HEAPALLOCATED;
+        std::fill (m_data + block.m_start, m_data + block.m_start + count, vmValue ());
+        m_heapInUse += block.m_size;
+        return block.m_start;
+    }
+
+    // Otherwise allocate a new block, after a header
+    int size = HeapClassSize (sizeClass, count);
+    if (!RoomFor (size + 1))
+        return 0;
+    int header = Allocate (size + 1);
+    if (header == 0)
+        return 0;
+    vmHeapBlock block;
+    block.m_start       = header + 1;
+    block.m_size        = size;
+    block.m_nextFree    = VM_HEAPALLOCATED;
+    m_data [header].IntVal () = m_heapBlocks.size ();
+    m_heapBlocks.push_back (block);
+    m_heapInUse += size;
+    return block.m_start;
+}
+
+int vmData::HeapBlockContaining (int index) {
+
+    // Binary search the block table, which is in address order
+    int lo = 0, hi = m_heapBlocks.size ();
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (m_heapBlocks [mid].m_start <= index)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo == 0)
+        return -1;
+    vmHeapBlock& block = m_heapBlocks [lo - 1];
+    if (index >= block.m_start + block.m_size || block.m_nextFree != VM_HEAPALLOCATED)
+        return -1;
+    return lo - 1;
+}
+
+int vmData::HeapSweep (std::vector<bool>& marked) {
+    assert ((int) marked.size () >= HeapBlockCount ());
+    int freed = 0;
+    for (int b = 0; b < HeapBlockCount (); b++)
+        if (!marked [b] && m_heapBlocks [b].m_nextFree == VM_HEAPALLOCATED && m_heapBlocks [b].m_start != 0) {
+            HeapFree (m_heapBlocks [b].m_start);
+            freed++;
+        }
+    return freed;
+}
+
+int vmData::HeapBlock (int index) {
+
+    // Find block from header, and check it starts at index
+    if (index < 2 || index >= m_size)
+        return -1;
+    int b = m_data [index - 1].IntVal ();
+    if (b < 0 || b >= (int) m_heapBlocks.size ())
+        return -1;
+    vmHeapBlock& block = m_heapBlocks [b];
+    if (block.m_start != index || block.m_nextFree != VM_HEAPALLOCATED)
+        return -1;
+    return b;
+}
+
+bool vmData::HeapFree (int index) {
+    int b = HeapBlock (index);
+    if (b < 0)
+        return false;
+
+    // Add to free list
+    vmHeapBlock& block = m_heapBlocks [b];
+    int sizeClass = HeapSizeClass (block.m_size);
+    block.m_nextFree = m_heapFree [sizeClass];
+    m_heapFree [sizeClass] = b;
+    m_heapInUse -= block.m_size;
+    return true;
+}
+
+bool vmData::Resize (int index, int size, int count) {
+    assert (index > 0);
+    assert (size > 0);
+    assert (count > 0);
+
+    // Heap blocks keep to their size classes
+    int b = HeapBlock (index);
+    if (b >= 0) {
+        assert (size == m_heapBlocks [b].m_size);
+        count = HeapClassSize (HeapSizeClass (count), count);
+    }
+
+    // Data must be the last permanent allocation
+    if (index + size != (m_tempStart >= 0 ? m_tempStart : m_size))
+        return false;
+    if (count > size && !RoomFor (count - size))
+        return false;
+
+    // Move top of data.
+    // (Temp data is freed first, as for Allocate.)
+    FreeTemp ();
+    if (count > size) {
+        if (InternalAllocate (count - size) == 0)
+            return false;
+    }
+    else
+        m_size = index + count;
+    if (b >= 0) {
+        m_heapInUse += count - m_heapBlocks [b].m_size;
+        m_heapBlocks [b].m_size = count;
+    }
+    return true;
+}
+
+void vmData::TrimHeap () {
+
+    // Discard blocks above the top of data (after SetState), and rebuild the
+    // free lists without them.
+    std::fill (m_heapFree.begin (), m_heapFree.end (), VM_HEAPEND);
+    m_heapInUse = 0;
+    for (unsigned int i = 0; i < m_heapBlocks.size (); i++) {
+        vmHeapBlock& block = m_heapBlocks [i];
+        if (block.m_start + block.m_size > m_size) {
+            block.m_start       = 0;
+            block.m_nextFree    = VM_HEAPALLOCATED;
+        }
+        else if (block.m_nextFree == VM_HEAPALLOCATED)
+            m_heapInUse += block.m_size;
+        else {
+            int sizeClass = HeapSizeClass (block.m_size);
+            block.m_nextFree = m_heapFree [sizeClass];
+            m_heapFree [sizeClass] = i;
+        }
+    }
+    while (!m_heapBlocks.empty () && m_heapBlocks.back ().m_start == 0)
+        m_heapBlocks.pop_back ();
+}
+
 void vmData::InitData (int i, vmValType& type, vmTypeLibrary& typeLib) {
     assert (typeLib.TypeValid (type));
 
@@ -50,7 +309,9 @@ void vmData::InitData (int i, vmValType& type, vmTypeLibrary& typeLib) {
         m_data [i].IntVal ()        = type.m_arrayDims [type.m_arrayLevel - 1]; // First value  = # of elements
         m_data [i + 1].IntVal ()    = elementSize;                              // Second value = element size
 
-        // Initialise elements (if necessary)
+        // Initialise elements (if necessary).
+        // (Field major structures never contain arrays, so their column
+        // layout needs nothing more than the header.)
         if (typeLib.ContainsArray (elementType)) {
             for (unsigned int i2 = 0; i2 < type.m_arrayDims [type.m_arrayLevel - 1]; i2++)
                 InitData (i + 2 + i2 * elementSize, elementType, typeLib);
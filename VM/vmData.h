@@ -8,6 +8,7 @@
 #define vmDataH
 #include "vmTypes.h"
 #include <list>
+#include <algorithm>
 #include <set>
 //---------------------------------------------------------------------------
 
@@ -59,18 +60,26 @@ struct vmValue {
 // Used for strings, pointers, handles e.t.c.
 // The virtual machine stores only the array index, and thus VM programs avoid
 // having to see and manipulate pointers, handles e.t.c.
+//
+// Free elements are chained together into a free list through m_links, so
+// Alloc and Free are O(1) and never allocate memory (other than to grow the
+// array). m_links doubles as the allocation map.
+#define VMSTORE_ALLOCATED   -2                  // m_links value for allocated elements
+#define VMSTORE_END         -1                  // m_links value for the last free element
+
 template<class T> class vmStore {
     std::vector<T>      m_array;
-    std::vector<bool>   m_valAllocated;
-    std::list<int>      m_freeList;             // List of free indices
+    std::vector<int>    m_links;                // Allocated elements: VMSTORE_ALLOCATED. Free elements: Index of next free element, or VMSTORE_END
+    int                 m_freeHead;             // First free element, or VMSTORE_END
+    int                 m_count;                // # of allocated elements
     T                   m_blankElement;         // New elements are initialised to this
 
 public:
-    vmStore (T blankElement) : m_blankElement (blankElement) { ; }
+    vmStore (T blankElement) : m_freeHead (VMSTORE_END), m_count (0), m_blankElement (blankElement) { ; }
     bool IndexValid (int index) {               // Return true if index is a valid allocated index
         return      index >= 0
                 &&  index < m_array.size ()
-                &&  m_valAllocated [index];
+                &&  m_links [index] == VMSTORE_ALLOCATED;
     }
     bool IndexStored (int index) {
         return index != 0 && IndexValid (index);
@@ -84,30 +93,34 @@ public:
     void Clear ();
 
     std::vector<T>&     Array ()        { return m_array; }
-    std::vector<bool>&  ValAllocated () { return m_valAllocated; }
+    bool                Allocated (int index) {
+        assert (index >= 0 && index < (int) m_array.size ());
+        return m_links [index] == VMSTORE_ALLOCATED;
+    }
     T&                  BlankElement () { return m_blankElement; }
+    int                 Count ()        { return m_count; }
 };
 
 template<class T> int vmStore<T>::Alloc () {
     int index;
-    if (m_freeList.empty ()) {
+    if (m_freeHead == VMSTORE_END) {
 
         // Extend array by a single item, and return index of that item
         index = m_array.size ();
         m_array.push_back (m_blankElement);
-        m_valAllocated.push_back (true);        // Mark element as in use
+        m_links.push_back (VMSTORE_ALLOCATED);  // Mark element as in use
     }
     else {
 
-        // Reuse previously freed index
-        std::list<int>::iterator i = m_freeList.begin ();
-        index = *i;
-        m_freeList.erase (i);
+        // Reuse most recently freed index
+        index = m_freeHead;
+        m_freeHead = m_links [index];
 
         // Initialise element
-        m_array [index]         = m_blankElement;
-        m_valAllocated [index]  = true;
+        m_array [index] = m_blankElement;
+        m_links [index] = VMSTORE_ALLOCATED;
     }
+    m_count++;
     return index;
 }
 
@@ -115,16 +128,18 @@ template<class T> void vmStore<T>::Free (int index) {
 
     // Deallocate index and return to array
     assert (IndexValid (index));
-    m_valAllocated [index]  = false;
-    m_freeList.insert (m_freeList.begin (), index);
+    m_links [index] = m_freeHead;
+    m_freeHead = index;
+    m_count--;
 }
 
 template<class T> void vmStore<T>::Clear () {
 
     // Clear allocated values
-    m_freeList.clear ();
     m_array.clear ();
-    m_valAllocated.clear ();
+    m_links.clear ();
+    m_freeHead = VMSTORE_END;
+    m_count = 0;
 
     // Allocate a "blank" value for the 0th element.
     // Basic4GL uses 0 to indicate that data hasn't been allocated yet.
@@ -165,10 +180,12 @@ public:
     void PopString (std::string& str) {
         assert (!Empty ());
 
-        // Copy string value from stack
+        // Move string value from stack.
+        // (Swapping leaves str's old buffer in the string slot, ready to be
+        // reused by the next PushString.)
         int index = TOS ().IntVal ();
         assert (m_strings.IndexValid (index));
-        str = m_strings.Value (index);
+        str.swap (m_strings.Value (index));
 
         // Deallocate stacked string
         m_strings.Free (index);
@@ -262,7 +279,7 @@ template<class T> void vmResourceStore<T>::Clear () {
 
     // Delete each individual element
     for (int i = 0; i < m_store.Array ().size (); i++)
-        if (m_store.ValAllocated () [i])
+        if (m_store.Allocated (i))
             DeleteElement (i);
 
     // Clear store
@@ -290,10 +307,50 @@ template<class T> void vmPointerResourceStore<T>::DeleteElement (int index) {
 ////////////////////////////////////////////////////////////////////////////////
 // vmData
 //
-// A resizeable array of vmValue objects
-typedef std::vector<vmValue> vmValueArray;
+// A resizeable array of vmValue objects.
+//
+// The address space for the largest possible array is reserved up front, and
+// memory is committed in segments as the data grows. Data therefore never
+// moves (so pointers into it remain valid) and growing never copies. Newly
+// committed memory is zero filled by the operating system.
+//
+// Size() is the logical top of data. Freeing data (e.g. temporary data at the
+// end of each statement) just lowers it, and the space is reused by the next
+// allocation. Temporary data is therefore a bump allocator on top of the
+// permanent data, in the same index space, so VM code can address it like any
+// other data.
+//
+// Data allocated with ALLOC comes from a heap within the permanent data, so
+// that it can be reclaimed and reused once it is unreachable (see
+// TomVM::CollectGarbage). Each heap block is preceded by a header value
+// holding its index in the block table, which in turn records where the block
+// starts. Blocks are carved from the top of data, so the table is in address
+// order, and the block containing any index can be found by binary search.
+// Free blocks are kept in a list per size class, so allocating and freeing
+// are O(1).
+//
+// The last permanent allocation (heap block or not) can be resized in place
+// (see Resize), which lets REDIM grow an array without moving it.
+#define VM_DATASEGMENT  65536           // Memory is committed in segments of this many values
+#define VM_MAXTEMPDATA  1048576         // Space reserved for temp data above the permanent data
+
+#define VM_HEAPEXACTCLASSES 32          // Blocks up to this size have a size class of their own
+#define VM_HEAPMAXCLASSSIZE 65536       // Larger blocks are rounded up to a power of 2, up to this size
+#define VM_HEAPALLOCATED    -2          // vmHeapBlock::m_nextFree value for allocated blocks
+#define VM_HEAPEND          -1          // End of free list
+
+struct vmHeapBlock {
+    int     m_start;                    // Index of first value (after the header). 0 = discarded
+    int     m_size;                     // # of values
+    int     m_nextFree;                 // Next free block of the same size class, or VM_HEAPEND. VM_HEAPALLOCATED if allocated
+};
+
 class vmData {
-    vmValueArray    m_data;
+    vmValue        *m_data;                 // Reserved address space
+    int             m_reserved;             // # of values reserved
+    int             m_committed;            // # of values backed by memory
+    int             m_zeroTop;              // Values from here up have never been used, and are still zero
+    int             m_size;                 // Logical top of data. m_data [m_size] onwards is unused
     int             m_tempStart;            // All data below tempStart is permanent
                                             // Any data between tempStart and Size() is temporary
     int             m_maxDataSize;
@@ -302,40 +359,66 @@ class vmData {
         // ensure there is room for the data.
         // Limit is NOT enforced for AllocateTemp, as this data is small
         // and temporary.
+    std::vector<vmHeapBlock>    m_heapBlocks;   // Heap block table
+    std::vector<int>            m_heapFree;     // First free block of each size class. (Last is for blocks too big for a class.)
+    int                         m_heapInUse;    // # of values in allocated heap blocks
+    bool            m_allocFailed;          // An allocation has failed since AllocFailed was last called
     int InternalAllocate (int count) {
 
-        // Allocate "count" elements and return iterator pointing to first one
-        int top = Size ();
-        if (count > 0)
-            m_data.resize (Size () + count, vmValue ());
+        // Allocate "count" zeroed elements and return index of first one.
+        // Returns 0 if the memory could not be committed.
+        int top = m_size;
+        if (count > 0) {
+            if (m_size + count > m_committed && !Commit (m_size + count)) {
+                m_allocFailed = true;
+                return 0;
+            }
+            m_size += count;
+
+            // Zero any previously used elements
+            if (top < m_zeroTop)
+                std::fill (m_data + top, m_data + (m_size < m_zeroTop ? m_size : m_zeroTop), vmValue ());
+            if (m_size > m_zeroTop)
+                m_zeroTop = m_size;
+        }
         return top;
     }
+    bool Commit (int size);                 // Commit memory for at least "size" values. Returns false if there is none
+    void Decommit ();                       // Return all committed memory
+    void TrimHeap ();                       // Discard heap blocks above the top of data
+    int HeapBlock (int index);              // Block table index of allocated heap block starting at index, or -1
+
+    // Data cannot be copied
+    vmData (const vmData& d);
+    vmData& operator= (const vmData& d);
 
 public:
-    vmData (int maxDataSize) {
-        assert (maxDataSize > 0);
-
-        // Ensure the maxDataSize is less than the maximum # elements supported
-        // by the vector.
-        // We also subtract 1 meg to allow for temp data allocated after the
-        // permanent data.
-        if (maxDataSize > m_data.max_size () - 1048576)
-            maxDataSize = m_data.max_size () - 1048576;
-        m_maxDataSize = maxDataSize;
-        Clear ();
-    }
-    vmValueArray& Data ()       { return m_data; }
+    vmData (int maxDataSize);
+    ~vmData ();
+    vmValue *Data ()            { return m_data; }
     int MaxDataSize ()          { return m_maxDataSize; }
 
     void Clear ()               {
-        m_data.clear ();
-        m_data.push_back (vmValue ());      // Allocate a 0th element, so that no "real" data is placed there.
-                                            // Thus we can use 0 as "null" for pointer types.
+        Decommit ();                        // Release memory. (Recommitted memory is zero.)
+        m_zeroTop   = 0;
+        m_size      = 0;
         m_tempStart = -1;
+        m_heapBlocks.clear ();
+        m_heapFree.clear ();
+        m_heapInUse = 0;
+        m_allocFailed = false;
+        InternalAllocate (1);               // Allocate a 0th element, so that no "real" data is placed there.
+                                            // Thus we can use 0 as "null" for pointer types.
     }
-    int Size ()                 { return m_data.size (); }
+    int Size ()                 { return m_size; }
+    int TempStart ()            { return m_tempStart; }
     bool IndexValid (int i)     { return i >= 0 && i < Size (); }
-    int Allocate (int count) {
+    bool AllocFailed ()         {           // True if an allocation has failed since the last call
+        bool failed = m_allocFailed;
+        m_allocFailed = false;
+        return failed;
+    }
+    int Allocate (int count) {              // Returns 0 if out of memory
         assert (count > 0);
         assert (RoomFor (count));
 
@@ -347,6 +430,32 @@ public:
         return InternalAllocate (count);
     }
     void InitData (int i, vmValType& type, vmTypeLibrary& typeLib);             // Initialise a new block of data
+
+    // Heap
+    int HeapAllocate (int count);           // Allocate zeroed permanent data that can be freed. Returns 0 if there is no room
+    bool HeapFree (int index);              // Free heap data. Returns false if index is not the start of an allocated heap block
+    int HeapBlockSize (int index) {         // Size of allocated heap block starting at index, or 0 if index is not one
+        int b = HeapBlock (index);
+        return b >= 0 ? m_heapBlocks [b].m_size : 0;
+    }
+    int HeapInUse ()            { return m_heapInUse; }
+
+    // Garbage collection support.
+    // Blocks are identified by their block table index.
+    int HeapBlockCount ()       { return m_heapBlocks.size (); }
+    int HeapBlockContaining (int index);    // Allocated heap block containing index, or -1
+    vmHeapBlock& HeapBlockAt (int b) {
+        assert (b >= 0 && b < HeapBlockCount ());
+        return m_heapBlocks [b];
+    }
+    int HeapSweep (std::vector<bool>& marked);  // Free allocated blocks that are not marked. Returns # freed
+
+    // Resize the last permanent allocation in place.
+    // index is the start of the allocation and size is its current size. (For
+    // heap blocks this is the block size. The new size is rounded up to a size
+    // class.) Returns false if the data is not the last permanent allocation,
+    // or there is no room.
+    bool Resize (int index, int size, int count);
     bool RoomFor (int count) {
         assert (count > 0);
         int free = MaxDataSize () - (m_tempStart >= 0 ? m_tempStart : Size ());
@@ -354,7 +463,7 @@ public:
     }
 
     // Temporary data
-    int AllocateTemp (int count) {
+    int AllocateTemp (int count) {          // Returns 0 if out of memory
 
         // Set temp start marker
         if (m_tempStart < 0)
@@ -366,14 +475,14 @@ public:
     void FreeTemp () {
 
         // Free temporary data
-        if (m_tempStart >= 0 && m_tempStart < m_data.size ())
-            m_data.resize (m_tempStart);
+        if (m_tempStart >= 0 && m_tempStart < m_size)
+            m_size = m_tempStart;
         m_tempStart = -1;
     }
     void GetState (unsigned int& size, unsigned int& tempStart) {
 
         // Return state data
-        size        = m_data.size ();
+        size        = m_size;
         tempStart   = m_tempStart;
 
         // Set temp data as permanent for now.
@@ -389,8 +498,10 @@ public:
     void SetState (unsigned int size, unsigned int tempStart) {
 
         // Restore top of data
-        if (size < m_data.size ())
-            m_data.resize (size);
+        if ((int) size < m_size) {
+            m_size = size;
+            TrimHeap ();
+        }
 
         // Restore start of temp data
         m_tempStart = tempStart;
@@ -554,7 +665,8 @@ inline int TempArray (vmData& data, vmTypeLibrary& typeLib, vmBasicValType eleme
 
     // Allocate temporary array
     int dataIndex = data.AllocateTemp (typeLib.DataSize (type));
-    data.InitData (dataIndex, type, typeLib);
+    if (dataIndex != 0)
+        data.InitData (dataIndex, type, typeLib);
     return dataIndex;
 }
 
@@ -563,6 +675,8 @@ template<class T> int FillTempIntArray (vmData& data, vmTypeLibrary& typeLib, in
 
     // Allocate temporary array
     int dataIndex = TempArray (data, typeLib, VTP_INT, arraySize);
+    if (dataIndex == 0)
+        return 0;
 
     // Translate C array into data
     for (int i = 0; i < arraySize; i++)
@@ -577,6 +691,8 @@ template<class T> int FillTempRealArray (vmData& data, vmTypeLibrary& typeLib, i
 
     // Allocate temporary array
     int dataIndex = TempArray (data, typeLib, VTP_REAL, arraySize);
+    if (dataIndex == 0)
+        return 0;
 
     // Translate C array into data
     for (int i = 0; i < arraySize; i++)
@@ -596,7 +712,8 @@ inline int TempArray2D (vmData& data, vmTypeLibrary& typeLib, vmBasicValType ele
 
     // Allocate temporary array
     int dataIndex = data.AllocateTemp (typeLib.DataSize (type));
-    data.InitData (dataIndex, type, typeLib);
+    if (dataIndex != 0)
+        data.InitData (dataIndex, type, typeLib);
     return dataIndex;
 }
 
@@ -605,6 +722,8 @@ template<class T> int FillTempIntArray2D (vmData& data, vmTypeLibrary& typeLib,
 
     // Allocate temporary array
     int dataIndex = TempArray2D (data, typeLib, VTP_INT, arraySize1, arraySize2);
+    if (dataIndex == 0)
+        return 0;
 
     // Translate C array into data
     int i = 0;
@@ -623,6 +742,8 @@ template<class T> int FillTempRealArray2D (vmData& data, vmTypeLibrary& typeLib,
 
     // Allocate temporary array
     int dataIndex = TempArray2D (data, typeLib, VTP_REAL, arraySize1, arraySize2);
+    if (dataIndex == 0)
+        return 0;
 
     // Translate C array into data
     int i = 0;
@@ -0,0 +1,914 @@
+//---------------------------------------------------------------------------
+/*  Native loop compiler.
+
+    Translates the instructions of a hot loop into x86-64 machine code.
+    Each instruction becomes a short template that works directly on the VM
+    registers, stack and variable data, so the generated code behaves exactly
+    like the interpreter, without the dispatch overhead.
+*/
+
+
+#pragma hdrstop
+
+#include "vmJit.h"
+
+//---------------------------------------------------------------------------
+
+#ifndef _MSC_VER
+#pragma package(smart_init)
+#endif
+
+#ifdef VM_JIT
+
+#include <stddef.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <map>
+
+////////////////////////////////////////////////////////////////////////////////
+// x86-64 code generation
+
+// Native registers.
+// Generated code only uses registers the System V calling convention allows
+// a function to modify, and never calls out, so needs no stack frame.
+enum jitRegister {
+    REG_EAX = 0,
+    REG_ECX = 1,
+    REG_EDX = 2,
+    REG_ESI = 6,                // Variable data
+    REG_EDI = 7,                // vmJitContext
+    REG_R8  = 8,                // Register file
+    REG_R9  = 9,                // Steps remaining
+    REG_XMM0 = 0
+};
+
+// Condition codes
+enum jitCondition {
+    CC_ALWAYS   = -1,
+    CC_AE       = 0x3,
+    CC_E        = 0x4,
+    CC_NE       = 0x5,
+    CC_A        = 0x7,
+    CC_S        = 0x8,
+    CC_NS       = 0x9,
+    CC_P        = 0xa,
+    CC_NP       = 0xb,
+    CC_L        = 0xc,
+    CC_GE       = 0xd,
+    CC_LE       = 0xe,
+    CC_G        = 0xf
+};
+
+// Group 1 ALU operations (reg field of 0x81 opcode)
+enum jitAluOp {
+    ALU_ADD = 0,
+    ALU_SUB = 5,
+    ALU_XOR = 6,
+    ALU_CMP = 7
+};
+
+// Memory operand. Address = base + index * 4 + disp
+struct jitMem {
+    int base, index, disp;
+    jitMem (int b, int d, int i = -1) : base (b), index (i), disp (d) { ; }
+};
+
+class jitAssembler {
+public:
+    std::vector<unsigned char> m_code;
+
+    unsigned int Size ()    { return m_code.size (); }
+    void Byte (int b)       { m_code.push_back ((unsigned char) b); }
+    void Long (int l) {
+        for (int i = 0; i < 4; i++)
+            Byte ((l >> (i * 8)) & 0xff);
+    }
+    void Patch (unsigned int offset, unsigned int target) {
+
+        // Point the rel32 field at offset to target
+        int rel = target - (offset + 4);
+        for (int i = 0; i < 4; i++)
+            m_code [offset + i] = (rel >> (i * 8)) & 0xff;
+    }
+
+    // Encoding
+    void MemOp (int prefix, int op, int op2, int reg, const jitMem& m, bool wide = false) {
+        if (prefix != 0)
+            Byte (prefix);
+        int rex =   (wide ? 8 : 0)
+                |   ((reg & 8) ? 4 : 0)
+                |   ((m.index >= 0 && (m.index & 8)) ? 2 : 0)
+                |   ((m.base & 8) ? 1 : 0);
+        if (rex != 0)
+            Byte (0x40 | rex);
+        Byte (op);
+        if (op2 >= 0)
+            Byte (op2);
+
+        // Note: Base is never rsp, rbp, r12 or r13, which need special encodings
+        bool shortDisp = m.disp >= -128 && m.disp < 128;
+        int mod = shortDisp ? 0x40 : 0x80;
+        if (m.index < 0)
+            Byte (mod | (reg & 7) << 3 | (m.base & 7));
+        else {
+            Byte (mod | (reg & 7) << 3 | 4);
+            Byte (0x80 | (m.index & 7) << 3 | (m.base & 7));
+        }
+        if (shortDisp)  Byte (m.disp);
+        else            Long (m.disp);
+    }
+    void RegOp (int op, int op2, int reg, int rm) {
+        int rex = ((reg & 8) ? 4 : 0) | ((rm & 8) ? 1 : 0);
+        if (rex != 0)
+            Byte (0x40 | rex);
+        Byte (op);
+        if (op2 >= 0)
+            Byte (op2);
+        Byte (0xc0 | (reg & 7) << 3 | (rm & 7));
+    }
+
+    // Instructions
+    void Load (int reg, const jitMem& m)            { MemOp (0, 0x8b, -1, reg, m); }
+    void Load64 (int reg, const jitMem& m)          { MemOp (0, 0x8b, -1, reg, m, true); }
+    void Store (const jitMem& m, int reg)           { MemOp (0, 0x89, -1, reg, m); }
+    void StoreImm (const jitMem& m, int imm)        { MemOp (0, 0xc7, -1, 0, m); Long (imm); }
+    void Add (int reg, const jitMem& m)             { MemOp (0, 0x03, -1, reg, m); }
+    void Sub (int reg, const jitMem& m)             { MemOp (0, 0x2b, -1, reg, m); }
+    void And (int reg, const jitMem& m)             { MemOp (0, 0x23, -1, reg, m); }
+    void Or (int reg, const jitMem& m)              { MemOp (0, 0x0b, -1, reg, m); }
+    void Xor (int reg, const jitMem& m)             { MemOp (0, 0x33, -1, reg, m); }
+    void Cmp (int reg, const jitMem& m)             { MemOp (0, 0x3b, -1, reg, m); }
+    void Imul (int reg, const jitMem& m)            { MemOp (0, 0x0f, 0xaf, reg, m); }
+    void ImulImm (int dst, int src, int imm)        { RegOp (0x69, -1, dst, src); Long (imm); }
+    void AddReg (int dst, int src)                  { RegOp (0x01, -1, src, dst); }
+    void AndReg (int dst, int src)                  { RegOp (0x21, -1, src, dst); }
+    void OrReg (int dst, int src)                   { RegOp (0x09, -1, src, dst); }
+    void Test (int reg)                             { RegOp (0x85, -1, reg, reg); }
+    void AluImm (jitAluOp op, int reg, int imm)     { RegOp (0x81, -1, op, reg); Long (imm); }
+    void Neg (int reg)                              { RegOp (0xf7, -1, 3, reg); }
+    void Cdq ()                                     { Byte (0x99); }
+    void Idiv (int reg)                             { RegOp (0xf7, -1, 7, reg); }
+    void Setcc (jitCondition cc, int reg)           { RegOp (0x0f, 0x90 + cc, 0, reg); }
+    void MovzxByte (int dst, int src)               { RegOp (0x0f, 0xb6, dst, src); }
+    void Movss (int xmm, const jitMem& m)           { MemOp (0xf3, 0x0f, 0x10, xmm, m); }
+    void MovssStore (const jitMem& m, int xmm)      { MemOp (0xf3, 0x0f, 0x11, xmm, m); }
+    void Addss (int xmm, const jitMem& m)           { MemOp (0xf3, 0x0f, 0x58, xmm, m); }
+    void Mulss (int xmm, const jitMem& m)           { MemOp (0xf3, 0x0f, 0x59, xmm, m); }
+    void Subss (int xmm, const jitMem& m)           { MemOp (0xf3, 0x0f, 0x5c, xmm, m); }
+    void Divss (int xmm, const jitMem& m)           { MemOp (0xf3, 0x0f, 0x5e, xmm, m); }
+    void Cvtsi2ss (int xmm, const jitMem& m)        { MemOp (0xf3, 0x0f, 0x2a, xmm, m); }
+    void Cvttss2si (int reg, const jitMem& m)       { MemOp (0xf3, 0x0f, 0x2c, reg, m); }
+    void Ucomiss (int xmm, const jitMem& m)         { MemOp (0, 0x0f, 0x2e, xmm, m); }
+    void Ret ()                                     { Byte (0xc3); }
+    unsigned int Jump (jitCondition cc) {
+
+        // Emit jump with 32 bit displacement. Returns offset of displacement
+        // for patching.
+        if (cc == CC_ALWAYS)
+            Byte (0xe9);
+        else {
+            Byte (0x0f);
+            Byte (0x80 + cc);
+        }
+        Long (0);
+        return Size () - 4;
+    }
+    void JumpShort (jitCondition cc, int rel) {
+        Byte (0x70 + cc);
+        Byte (rel);
+    }
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// Loop compiler
+
+// Point where native code returns to the interpreter
+struct jitExit {
+    unsigned int    ip;             // Instruction to continue from
+    int             stackSize;      // Values pushed to the stack
+    int             steps;          // Steps to refund (instructions of the current block not executed)
+
+    jitExit (unsigned int i, int s, int st) : ip (i), stackSize (s), steps (st) { ; }
+    bool operator< (const jitExit& e) const {
+        if (ip != e.ip)                 return ip < e.ip;
+        if (stackSize != e.stackSize)   return stackSize < e.stackSize;
+        return steps < e.steps;
+    }
+};
+
+static vmOpCode StackOperation (vmOpCode code, bool& pop) {
+
+    // Return the register machine operation that performs the same function
+    // as a type specialised stack machine operation, or OP_NOP if there isn't
+    // one. Sets pop if the instruction pops reg2 first.
+    pop = true;
+    switch (code) {
+    case OP_POP_PLUS_INT:   return OP_R_PLUS_INT;
+    case OP_POP_PLUS_REAL:  return OP_R_PLUS_REAL;
+    case OP_POP_MINUS_INT:  return OP_R_MINUS_INT;
+    case OP_POP_MINUS_REAL: return OP_R_MINUS_REAL;
+    case OP_POP_TIMES_INT:  return OP_R_TIMES_INT;
+    case OP_POP_TIMES_REAL: return OP_R_TIMES_REAL;
+    case OP_POP_DIV_INT:    return OP_R_DIV_INT;
+    case OP_POP_DIV_REAL:   return OP_R_DIV_REAL;
+    case OP_POP_MOD_INT:    return OP_R_MOD_INT;
+    default:                break;
+    }
+
+    // Comparison and logical blocks are in the same order as their register
+    // machine equivalents
+    if (code >= OP_POP_EQUAL_INT && code <= OP_POP_XOR)
+        return (vmOpCode) (OP_R_EQUAL_INT + (code - OP_POP_EQUAL_INT));
+    if (code >= OP_POP_EQUAL_INT_JUMP_FALSE && code <= OP_POP_LESS_EQUAL_REAL_JUMP_FALSE)
+        return (vmOpCode) (OP_R_EQUAL_INT + (code - OP_POP_EQUAL_INT_JUMP_FALSE));
+
+    pop = false;
+    return vmRegisterOpCode (code);
+}
+
+static int StackEffect (vmInstruction& instruction) {
+    vmOpCode code = (vmOpCode) instruction.m_opCode;
+    switch (code) {
+    case OP_PUSH:
+    case OP_PUSH_VAR:
+    case OP_LOAD_VAR_PUSH:
+    case OP_PUSH_CONST:
+    case OP_PUSH_DATA:
+        return 1;
+    case OP_POP:
+    case OP_POP_SAVE:
+    case OP_POP_ARRAY_INDEX:
+    case OP_POP_ARRAY_INDEX_UNCHECKED:
+        return -1;
+    case OP_ARRAY_INDEX_N:
+    case OP_ARRAY_INDEX_FIELD:
+        return -(instruction.m_value.IntVal () & 0xff);
+    default:
+        break;
+    }
+    bool pop;
+    StackOperation (code, pop);
+    return pop ? -1 : 0;
+}
+
+static bool IsConditionalJump (vmOpCode code) {
+    return code == OP_JUMP_TRUE || code == OP_JUMP_FALSE || (vmIsJump (code) && code != OP_JUMP && code != OP_CALL);
+}
+
+class jitLoopCompiler {
+    std::vector<vmInstruction>& m_code;
+    vmVariables&                m_variables;
+    unsigned int                m_head, m_jump;
+    jitAssembler                m_asm;
+
+    // Per instruction information (indexed by offset from loop head)
+    std::vector<int>            m_depth;        // Stack depth before instruction. -1 = Unreachable
+    std::vector<bool>           m_leader;       // True if instruction starts a block
+    std::vector<unsigned int>   m_blockEnd;     // Offset of first instruction after the block
+    std::vector<unsigned int>   m_native;       // Native code offset
+
+    // Jumps to patch
+    std::vector<std::pair<unsigned int, unsigned int> >     m_jumps;    // Displacement offset, target instruction
+    std::map<jitExit, std::vector<unsigned int> >           m_exits;    // Exit, displacement offsets
+
+    unsigned int VarData (vmInstruction& instruction);
+    bool Compilable (vmInstruction& instruction);
+    bool Analyse ();
+    void Exit (jitCondition cc, unsigned int ip, int stackSize, int steps);
+    void SideExit (jitCondition cc, unsigned int offset);
+    void Branch (jitCondition cc, unsigned int offset, unsigned int target);
+    void Unary (vmOpCode op, const jitMem& a, const jitMem& dst);
+    void Binary (vmOpCode op, const jitMem& a, const jitMem& b, const jitMem& dst);
+    void CompileInstruction (unsigned int offset);
+
+    // Operands
+    jitMem Reg ()               { return jitMem (REG_EDI, offsetof (vmJitContext, reg)); }
+    jitMem Reg2 ()              { return jitMem (REG_EDI, offsetof (vmJitContext, reg2)); }
+    jitMem Stack (int i)        { return jitMem (REG_EDI, offsetof (vmJitContext, stack) + i * sizeof (vmValue)); }
+    jitMem Data (unsigned int i){ return jitMem (REG_ESI, i * sizeof (vmValue)); }
+    jitMem Register (int r)     { return jitMem (REG_R8, (r & 0xff) * sizeof (vmValue)); }
+    int Depth (unsigned int offset)     { return m_depth [offset - m_head]; }
+    bool InLoop (unsigned int offset)   { return offset >= m_head && offset <= m_jump; }
+
+public:
+    jitLoopCompiler (std::vector<vmInstruction>& code, vmVariables& variables, unsigned int head, unsigned int jump)
+        : m_code (code), m_variables (variables), m_head (head), m_jump (jump) { ; }
+    bool Compile ();
+    std::vector<unsigned char>& NativeCode () { return m_asm.m_code; }
+};
+
+unsigned int jitLoopCompiler::VarData (vmInstruction& instruction) {
+
+    // Return data index of variable referenced by instruction, or 0 if it
+    // has not been allocated yet
+    switch (instruction.m_opCode) {
+    case OP_LOAD_DATA:
+    case OP_PUSH_DATA:
+    case OP_R_LOAD_DATA:
+    case OP_R_SAVE_DATA:
+        return instruction.m_value.IntVal ();       // Already resolved by the VM
+    }
+    int index = instruction.m_value.IntVal ();
+    if (!m_variables.IndexValid (index))
+        return 0;
+    return m_variables.Variables () [index].m_dataIndex;
+}
+
+bool jitLoopCompiler::Compilable (vmInstruction& instruction) {
+    vmOpCode code = (vmOpCode) instruction.m_opCode;
+    switch (code) {
+    case OP_NOP:
+    case OP_PUSH_CONST:
+    case OP_ADD_CONST:
+    case OP_ARRAY_INDEX:
+    case OP_POP_ARRAY_INDEX:
+    case OP_ARRAY_INDEX_UNCHECKED:
+    case OP_POP_ARRAY_INDEX_UNCHECKED:
+    case OP_ARRAY_INDEX_N:
+    case OP_ARRAY_INDEX_FIELD:
+    case OP_JUMP:
+    case OP_JUMP_TRUE:
+    case OP_JUMP_FALSE:
+    case OP_CONV_INT_REAL:
+    case OP_CONV_REAL_INT:
+    case OP_CONV_INT_REAL2:
+    case OP_CONV_REAL_INT2:
+    case OP_R_LOAD_CONST:
+    case OP_R_MOVE:
+    case OP_R_CONV_INT_REAL:
+    case OP_R_CONV_REAL_INT:
+        return true;
+    case OP_LOAD_CONST:
+    case OP_PUSH:
+    case OP_POP:
+        return instruction.m_type != VTP_STRING;
+    case OP_DEREF:
+    case OP_SAVE:
+    case OP_POP_SAVE:
+        return instruction.m_type == VTP_INT || instruction.m_type == VTP_REAL;
+    case OP_OP_NOT:
+        return instruction.m_type == VTP_INT;
+    case OP_LOAD_VAR:
+    case OP_LOAD_VAR_COW:               // (Deferred copies are completed before native code runs)
+    case OP_LOAD_VAR_COW_READ:
+    case OP_LOAD_VAR_DEREF:
+    case OP_PUSH_VAR:
+    case OP_LOAD_VAR_PUSH:
+    case OP_R_LOAD_VAR:
+    case OP_R_SAVE_VAR:
+        return VarData (instruction) != 0;
+    case OP_LOAD_DATA:
+    case OP_PUSH_DATA:
+    case OP_R_LOAD_DATA:
+    case OP_R_SAVE_DATA:
+        return true;
+    default:
+        break;
+    }
+    if (code >= OP_R_NEG_INT && code <= OP_R_NOT)
+        return true;
+    if (code >= OP_R_PLUS_INT && code <= OP_R_XOR)
+        return true;
+    bool pop;
+    return StackOperation (code, pop) != OP_NOP;
+}
+
+bool jitLoopCompiler::Analyse () {
+
+    // Find reachable instructions, the stack depth at each one, and the basic
+    // blocks.
+    unsigned int size = m_jump - m_head + 1;
+    m_depth     = std::vector<int> (size, -1);
+    m_leader    = std::vector<bool> (size, false);
+    m_blockEnd  = std::vector<unsigned int> (size, 0);
+    m_native    = std::vector<unsigned int> (size, 0);
+
+    if (!Compilable (m_code [m_head]))
+        return false;
+    m_depth [0] = 0;
+    m_leader [0] = true;
+    std::vector<unsigned int> work;
+    work.push_back (m_head);
+    while (!work.empty ()) {
+        unsigned int offset = work.back ();
+        work.pop_back ();
+        vmInstruction& instruction = m_code [offset];
+        if (!Compilable (instruction))
+            continue;
+
+        // Stack depth after instruction. The stack is kept in the context
+        // structure, and must not be popped below where it was on entry.
+        vmOpCode code = (vmOpCode) instruction.m_opCode;
+        int depth = Depth (offset) + StackEffect (instruction);
+        if (depth < 0 || depth > VM_JITMAXSTACK)
+            return false;
+
+        // Successors
+        unsigned int next [2];
+        int count = 0;
+        if (code != OP_JUMP)
+            next [count++] = offset + 1;
+        if (code == OP_JUMP || IsConditionalJump (code)) {
+            unsigned int target = instruction.m_value.IntVal ();
+            if (InLoop (target)) {
+                next [count++] = target;
+                m_leader [target - m_head] = true;
+            }
+            if (offset + 1 <= m_jump)
+                m_leader [offset + 1 - m_head] = true;
+        }
+        for (int i = 0; i < count; i++) {
+            if (!InLoop (next [i]))
+                continue;
+            int& d = m_depth [next [i] - m_head];
+            if (d < 0) {
+                d = depth;
+                work.push_back (next [i]);
+            }
+            else if (d != depth)
+                return false;
+        }
+    }
+
+    // Find end of each block.
+    // Blocks end after a jump, or before an instruction that can't be compiled
+    // (as native code returns to the interpreter there).
+    for (int offset = m_jump; offset >= (int) m_head; offset--) {
+        int i = offset - m_head;
+        if (m_depth [i] < 0)
+            continue;
+        vmInstruction& instruction = m_code [offset];
+        if (!Compilable (instruction))
+            m_blockEnd [i] = offset;
+        else if (vmIsJump ((vmOpCode) instruction.m_opCode) || m_leader [i + 1])
+            m_blockEnd [i] = offset + 1;
+        else
+            m_blockEnd [i] = m_blockEnd [i + 1];
+    }
+    return true;
+}
+
+void jitLoopCompiler::Exit (jitCondition cc, unsigned int ip, int stackSize, int steps) {
+    m_exits [jitExit (ip, stackSize, steps)].push_back (m_asm.Jump (cc));
+}
+
+void jitLoopCompiler::SideExit (jitCondition cc, unsigned int offset) {
+
+    // Return to the interpreter before executing the instruction at offset
+    // (e.g. so that it can report a runtime error).
+    // Steps counted for the rest of the block are refunded.
+    Exit (cc, offset, Depth (offset), m_blockEnd [offset - m_head] - offset);
+}
+
+void jitLoopCompiler::Branch (jitCondition cc, unsigned int offset, unsigned int target) {
+
+    // Jump to target. Leaves native code if target is outside the loop
+    if (InLoop (target))
+        m_jumps.push_back (std::make_pair (m_asm.Jump (cc), target));
+    else
+        Exit (cc, target, Depth (offset) + StackEffect (m_code [offset]), 0);
+}
+
+void jitLoopCompiler::Unary (vmOpCode op, const jitMem& a, const jitMem& dst) {
+    switch (op) {
+    case OP_R_NEG_INT:
+        m_asm.Load (REG_EAX, a);
+        m_asm.Neg (REG_EAX);
+        m_asm.Store (dst, REG_EAX);
+        break;
+    case OP_R_NEG_REAL:
+        m_asm.Load (REG_EAX, a);
+        m_asm.AluImm (ALU_XOR, REG_EAX, 0x80000000);
+        m_asm.Store (dst, REG_EAX);
+        break;
+    case OP_R_NOT:
+        m_asm.Load (REG_EAX, a);
+        m_asm.Test (REG_EAX);
+        m_asm.Setcc (CC_E, REG_EAX);
+        m_asm.MovzxByte (REG_EAX, REG_EAX);
+        m_asm.Neg (REG_EAX);
+        m_asm.Store (dst, REG_EAX);
+        break;
+    case OP_R_CONV_INT_REAL:
+        m_asm.Cvtsi2ss (REG_XMM0, a);
+        m_asm.MovssStore (dst, REG_XMM0);
+        break;
+    case OP_R_CONV_REAL_INT:
+        m_asm.Cvttss2si (REG_EAX, a);
+        m_asm.Store (dst, REG_EAX);
+        break;
+    default:
+        assert (false);
+    }
+}
+
+void jitLoopCompiler::Binary (vmOpCode op, const jitMem& a, const jitMem& b, const jitMem& dst) {
+
+    // dst = a op b.
+    // Comparisons leave the result in eax.
+    jitCondition cc;
+    switch (op) {
+    case OP_R_PLUS_INT:     m_asm.Load (REG_EAX, a); m_asm.Add (REG_EAX, b);  m_asm.Store (dst, REG_EAX); return;
+    case OP_R_MINUS_INT:    m_asm.Load (REG_EAX, a); m_asm.Sub (REG_EAX, b);  m_asm.Store (dst, REG_EAX); return;
+    case OP_R_TIMES_INT:    m_asm.Load (REG_EAX, a); m_asm.Imul (REG_EAX, b); m_asm.Store (dst, REG_EAX); return;
+    case OP_R_AND:          m_asm.Load (REG_EAX, a); m_asm.And (REG_EAX, b);  m_asm.Store (dst, REG_EAX); return;
+    case OP_R_OR:           m_asm.Load (REG_EAX, a); m_asm.Or (REG_EAX, b);   m_asm.Store (dst, REG_EAX); return;
+    case OP_R_XOR:          m_asm.Load (REG_EAX, a); m_asm.Xor (REG_EAX, b);  m_asm.Store (dst, REG_EAX); return;
+    case OP_R_PLUS_REAL:    m_asm.Movss (REG_XMM0, a); m_asm.Addss (REG_XMM0, b); m_asm.MovssStore (dst, REG_XMM0); return;
+    case OP_R_MINUS_REAL:   m_asm.Movss (REG_XMM0, a); m_asm.Subss (REG_XMM0, b); m_asm.MovssStore (dst, REG_XMM0); return;
+    case OP_R_TIMES_REAL:   m_asm.Movss (REG_XMM0, a); m_asm.Mulss (REG_XMM0, b); m_asm.MovssStore (dst, REG_XMM0); return;
+    case OP_R_DIV_REAL:     m_asm.Movss (REG_XMM0, a); m_asm.Divss (REG_XMM0, b); m_asm.MovssStore (dst, REG_XMM0); return;
+    case OP_R_DIV_INT:
+    case OP_R_MOD_INT:
+
+        // Division by zero traps, exactly as it does in the interpreter
+        m_asm.Load (REG_EAX, a);
+        m_asm.Load (REG_ECX, b);
+        m_asm.Cdq ();
+        m_asm.Idiv (REG_ECX);
+        if (op == OP_R_MOD_INT) {
+
+            // Negative remainders wrap around, as per the interpreter
+            m_asm.Test (REG_EDX);
+            m_asm.JumpShort (CC_NS, 2);
+            m_asm.AddReg (REG_EDX, REG_ECX);
+            m_asm.Store (dst, REG_EDX);
+        }
+        else
+            m_asm.Store (dst, REG_EAX);
+        return;
+
+    // Integer comparisons
+    case OP_R_EQUAL_INT:            cc = CC_E;  goto intCompare;
+    case OP_R_NOT_EQUAL_INT:        cc = CC_NE; goto intCompare;
+    case OP_R_GREATER_INT:          cc = CC_G;  goto intCompare;
+    case OP_R_GREATER_EQUAL_INT:    cc = CC_GE; goto intCompare;
+    case OP_R_LESS_INT:             cc = CC_L;  goto intCompare;
+    case OP_R_LESS_EQUAL_INT:       cc = CC_LE;
+    intCompare:
+        m_asm.Load (REG_EAX, a);
+        m_asm.Cmp (REG_EAX, b);
+        m_asm.Setcc (cc, REG_EAX);
+        break;
+
+    // Real comparisons.
+    // ucomiss sets the parity flag for unordered (NaN) operands. These must
+    // compare as not equal, and fail all ordering tests, so "less" tests are
+    // performed as "greater" tests with the operands swapped.
+    case OP_R_EQUAL_REAL:
+        m_asm.Movss (REG_XMM0, a);
+        m_asm.Ucomiss (REG_XMM0, b);
+        m_asm.Setcc (CC_E, REG_EAX);
+        m_asm.Setcc (CC_NP, REG_ECX);
+        m_asm.AndReg (REG_EAX, REG_ECX);
+        break;
+    case OP_R_NOT_EQUAL_REAL:
+        m_asm.Movss (REG_XMM0, a);
+        m_asm.Ucomiss (REG_XMM0, b);
+        m_asm.Setcc (CC_NE, REG_EAX);
+        m_asm.Setcc (CC_P, REG_ECX);
+        m_asm.OrReg (REG_EAX, REG_ECX);
+        break;
+    case OP_R_GREATER_REAL:         cc = CC_A;  goto realCompare;
+    case OP_R_GREATER_EQUAL_REAL:   cc = CC_AE;
+    realCompare:
+        m_asm.Movss (REG_XMM0, a);
+        m_asm.Ucomiss (REG_XMM0, b);
+        m_asm.Setcc (cc, REG_EAX);
+        break;
+    case OP_R_LESS_REAL:            cc = CC_A;  goto realCompareSwapped;
+    case OP_R_LESS_EQUAL_REAL:      cc = CC_AE;
+    realCompareSwapped:
+        m_asm.Movss (REG_XMM0, b);
+        m_asm.Ucomiss (REG_XMM0, a);
+        m_asm.Setcc (cc, REG_EAX);
+        break;
+    default:
+        assert (false);
+        return;
+    }
+
+    // Convert comparison result to BASIC true (-1) or false (0)
+    m_asm.MovzxByte (REG_EAX, REG_EAX);
+    m_asm.Neg (REG_EAX);
+    m_asm.Store (dst, REG_EAX);
+}
+
+void jitLoopCompiler::CompileInstruction (unsigned int offset) {
+    vmInstruction& instruction = m_code [offset];
+    vmOpCode code = (vmOpCode) instruction.m_opCode;
+    int depth = Depth (offset);
+    int value = instruction.m_value.IntVal ();
+    int rd = (byte) instruction.m_type;
+
+    switch (code) {
+    case OP_NOP:
+        return;
+    case OP_LOAD_CONST:
+        m_asm.StoreImm (Reg (), value);
+        return;
+    case OP_LOAD_VAR:
+    case OP_LOAD_VAR_COW:
+    case OP_LOAD_VAR_COW_READ:
+        m_asm.StoreImm (Reg (), VarData (instruction));
+        return;
+    case OP_LOAD_VAR_DEREF:
+    case OP_PUSH_VAR:
+    case OP_LOAD_DATA:
+    case OP_PUSH_DATA:
+        m_asm.Load (REG_EAX, Data (VarData (instruction)));
+        m_asm.Store (Reg (), REG_EAX);
+        if (code == OP_PUSH_VAR || code == OP_PUSH_DATA)
+            m_asm.Store (Stack (depth), REG_EAX);
+        return;
+    case OP_LOAD_VAR_PUSH:
+        m_asm.StoreImm (Reg (), VarData (instruction));
+        m_asm.StoreImm (Stack (depth), VarData (instruction));
+        return;
+    case OP_PUSH_CONST:
+        m_asm.StoreImm (Reg (), value);
+        m_asm.StoreImm (Stack (depth), value);
+        return;
+    case OP_DEREF:
+        m_asm.Load (REG_EAX, Reg ());
+        m_asm.Test (REG_EAX);
+        SideExit (CC_E, offset);                    // Unset pointer
+        m_asm.Load (REG_EAX, jitMem (REG_ESI, 0, REG_EAX));
+        m_asm.Store (Reg (), REG_EAX);
+        return;
+    case OP_ADD_CONST:
+        m_asm.Load (REG_EAX, Reg ());
+        m_asm.Test (REG_EAX);
+        SideExit (CC_E, offset);                    // Unset pointer
+        m_asm.AluImm (ALU_ADD, REG_EAX, value);
+        m_asm.Store (Reg (), REG_EAX);
+        return;
+    case OP_POP_ARRAY_INDEX:
+        m_asm.Load (REG_EAX, Stack (depth - 1));
+        m_asm.Store (Reg2 (), REG_EAX);
+        // Fall through
+    case OP_ARRAY_INDEX:
+
+        // reg2 = array address, reg = index.
+        // Array header holds the element count, then the element size.
+        m_asm.Load (REG_ECX, Reg2 ());
+        m_asm.Test (REG_ECX);
+        SideExit (CC_E, offset);                    // Unset pointer
+        m_asm.Load (REG_EAX, Reg ());
+        m_asm.Cmp (REG_EAX, jitMem (REG_ESI, 0, REG_ECX));
+        SideExit (CC_AE, offset);                   // Index out of range (unsigned compare catches negatives)
+        m_asm.Imul (REG_EAX, jitMem (REG_ESI, sizeof (vmValue), REG_ECX));
+        m_asm.AddReg (REG_EAX, REG_ECX);
+        m_asm.AluImm (ALU_ADD, REG_EAX, 2);
+        m_asm.Store (Reg (), REG_EAX);
+        return;
+    case OP_POP_ARRAY_INDEX_UNCHECKED:
+        m_asm.Load (REG_EAX, Stack (depth - 1));
+        m_asm.Store (Reg2 (), REG_EAX);
+        // Fall through
+    case OP_ARRAY_INDEX_UNCHECKED:
+        m_asm.Load (REG_ECX, Reg2 ());
+        m_asm.Load (REG_EAX, Reg ());
+        m_asm.Imul (REG_EAX, jitMem (REG_ESI, sizeof (vmValue), REG_ECX));
+        m_asm.AddReg (REG_EAX, REG_ECX);
+        m_asm.AluImm (ALU_ADD, REG_EAX, 2);
+        m_asm.Store (Reg (), REG_EAX);
+        return;
+    case OP_ARRAY_INDEX_N:
+    case OP_ARRAY_INDEX_FIELD: {
+
+        // Stack holds the array address, then each index except the last.
+        // reg = last index. ECX steps through the nested row headers.
+        int count = value & 0xff;
+        m_asm.Load (REG_ECX, Stack (depth - count));
+        m_asm.Test (REG_ECX);
+        SideExit (CC_E, offset);                    // Unset pointer
+        for (int i = 0; i < count; i++) {
+            m_asm.Load (REG_EAX, i < count - 1 ? Stack (depth - count + 1 + i) : Reg ());
+            if ((value & (1 << (i + 8))) == 0) {
+                m_asm.Cmp (REG_EAX, jitMem (REG_ESI, 0, REG_ECX));
+                SideExit (CC_AE, offset);           // Index out of range
+            }
+            if (code == OP_ARRAY_INDEX_FIELD && i == count - 1) {
+
+                // Field major structure array. Field is in column (value >> 18)
+                int field = value >> 18;
+                if (field != 0) {
+                    m_asm.Load (REG_EDX, jitMem (REG_ESI, 0, REG_ECX));
+                    m_asm.ImulImm (REG_EDX, REG_EDX, field);
+                    m_asm.AddReg (REG_EAX, REG_EDX);
+                }
+            }
+            else
+                m_asm.Imul (REG_EAX, jitMem (REG_ESI, sizeof (vmValue), REG_ECX));
+            m_asm.AddReg (REG_ECX, REG_EAX);
+            m_asm.AluImm (ALU_ADD, REG_ECX, 2);
+        }
+        m_asm.Store (Reg (), REG_ECX);
+        return;
+    }
+    case OP_PUSH:
+        m_asm.Load (REG_EAX, Reg ());
+        m_asm.Store (Stack (depth), REG_EAX);
+        return;
+    case OP_POP:
+        m_asm.Load (REG_EAX, Stack (depth - 1));
+        m_asm.Store (Reg2 (), REG_EAX);
+        return;
+    case OP_POP_SAVE:
+        m_asm.Load (REG_EAX, Stack (depth - 1));
+        m_asm.Store (Reg2 (), REG_EAX);
+        // Fall through
+    case OP_SAVE:
+        m_asm.Load (REG_ECX, Reg2 ());
+        m_asm.Test (REG_ECX);
+        SideExit (CC_LE, offset);                   // Unset pointer
+        m_asm.Load (REG_EAX, Reg ());
+        m_asm.Store (jitMem (REG_ESI, 0, REG_ECX), REG_EAX);
+        return;
+    case OP_JUMP:
+        Branch (CC_ALWAYS, offset, value);
+        return;
+    case OP_JUMP_TRUE:
+    case OP_JUMP_FALSE:
+        m_asm.Load (REG_EAX, Reg ());
+        m_asm.Test (REG_EAX);
+        Branch (code == OP_JUMP_TRUE ? CC_NE : CC_E, offset, value);
+        return;
+    case OP_CONV_INT_REAL:  Unary (OP_R_CONV_INT_REAL, Reg (), Reg ());     return;
+    case OP_CONV_REAL_INT:  Unary (OP_R_CONV_REAL_INT, Reg (), Reg ());     return;
+    case OP_CONV_INT_REAL2: Unary (OP_R_CONV_INT_REAL, Reg2 (), Reg2 ());   return;
+    case OP_CONV_REAL_INT2: Unary (OP_R_CONV_REAL_INT, Reg2 (), Reg2 ());   return;
+
+    // Register machine
+    case OP_R_LOAD_CONST:
+        m_asm.StoreImm (Register (rd), value);
+        return;
+    case OP_R_LOAD_VAR:
+    case OP_R_LOAD_DATA:
+        m_asm.Load (REG_EAX, Data (VarData (instruction)));
+        m_asm.Store (Register (rd), REG_EAX);
+        return;
+    case OP_R_SAVE_VAR:
+    case OP_R_SAVE_DATA:
+        m_asm.Load (REG_EAX, Register (rd));
+        m_asm.Store (Data (VarData (instruction)), REG_EAX);
+        return;
+    case OP_R_MOVE:
+        m_asm.Load (REG_EAX, Register (rd));
+        m_asm.Store (Reg (), REG_EAX);
+        return;
+    default:
+        break;
+    }
+    if (code >= OP_R_CONV_INT_REAL && code <= OP_R_NOT) {
+        Unary (code, Register (value), Register (rd));
+        return;
+    }
+    if (code >= OP_R_PLUS_INT && code <= OP_R_XOR) {
+        Binary (code, Register (value), Register (value >> 8), Register (rd));
+        return;
+    }
+
+    // Type specialised stack machine operations.
+    // Unary operations work on reg. Binary operations calculate reg2 op reg.
+    bool pop;
+    vmOpCode op = StackOperation (code, pop);
+    assert (op != OP_NOP);
+    if (pop) {
+        m_asm.Load (REG_EAX, Stack (depth - 1));
+        m_asm.Store (Reg2 (), REG_EAX);
+    }
+    if (op >= OP_R_CONV_INT_REAL && op <= OP_R_NOT)
+        Unary (op, Reg (), Reg ());
+    else
+        Binary (op, Reg2 (), Reg (), Reg ());
+    if (IsConditionalJump (code)) {
+
+        // Comparison and jump if false. Result is in eax.
+        m_asm.Test (REG_EAX);
+        Branch (CC_E, offset, value);
+    }
+}
+
+bool jitLoopCompiler::Compile () {
+    if (!Analyse ())
+        return false;
+
+    // Prologue. Load context pointers and step budget into registers
+    m_asm.Load64 (REG_ESI, jitMem (REG_EDI, offsetof (vmJitContext, data)));
+    m_asm.Load64 (REG_R8,  jitMem (REG_EDI, offsetof (vmJitContext, regFile)));
+    m_asm.Load   (REG_R9,  jitMem (REG_EDI, offsetof (vmJitContext, steps)));
+
+    // Instructions
+    for (unsigned int offset = m_head; offset <= m_jump; offset++) {
+        int i = offset - m_head;
+        if (m_depth [i] < 0)
+            continue;
+        m_native [i] = m_asm.Size ();
+
+        // Each block counts all its steps up front, returning to the
+        // interpreter if there are not enough left to run it.
+        int length = m_blockEnd [i] - offset;
+        if (m_leader [i] && length > 0) {
+            m_asm.AluImm (ALU_CMP, REG_R9, length);
+            Exit (CC_L, offset, m_depth [i], 0);
+            m_asm.AluImm (ALU_SUB, REG_R9, length);
+        }
+
+        if (Compilable (m_code [offset]))
+            CompileInstruction (offset);
+        else
+            Exit (CC_ALWAYS, offset, m_depth [i], 0);
+    }
+
+    // Exits.
+    // Store where to resume, refund unexecuted steps, and return.
+    for (std::map<jitExit, std::vector<unsigned int> >::iterator e = m_exits.begin (); e != m_exits.end (); e++) {
+        for (unsigned int j = 0; j < e->second.size (); j++)
+            m_asm.Patch (e->second [j], m_asm.Size ());
+        if (e->first.steps > 0)
+            m_asm.AluImm (ALU_ADD, REG_R9, e->first.steps);
+        m_asm.StoreImm (jitMem (REG_EDI, offsetof (vmJitContext, ip)), e->first.ip);
+        m_asm.StoreImm (jitMem (REG_EDI, offsetof (vmJitContext, stackSize)), e->first.stackSize);
+        m_asm.Store (jitMem (REG_EDI, offsetof (vmJitContext, steps)), REG_R9);
+        m_asm.Ret ();
+    }
+
+    // Jumps within the loop
+    for (unsigned int j = 0; j < m_jumps.size (); j++)
+        m_asm.Patch (m_jumps [j].first, m_native [m_jumps [j].second - m_head]);
+
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// vmJit
+
+static vmJitLoop notCompilable;             // Marks loops that could not be compiled
+
+vmJitLoop *vmJit::Compile (std::vector<vmInstruction>& code, unsigned int jump, vmVariables& variables) {
+    unsigned int head = code [jump].m_value.IntVal ();
+    if (jump - head >= VM_JITMAXLENGTH)
+        return NULL;
+
+    // Generate code
+    jitLoopCompiler compiler (code, variables, head, jump);
+    if (!compiler.Compile ())
+        return NULL;
+    std::vector<unsigned char>& native = compiler.NativeCode ();
+
+    // Copy into executable memory
+    void *memory = mmap (NULL, native.size (), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED)
+        return NULL;
+    memcpy (memory, &native [0], native.size ());
+    if (mprotect (memory, native.size (), PROT_READ | PROT_EXEC) != 0) {
+        munmap (memory, native.size ());
+        return NULL;
+    }
+
+    vmJitLoop *loop = new vmJitLoop;
+    loop->m_code    = memory;
+    loop->m_size    = native.size ();
+    loop->m_entry   = (void (*) (vmJitContext *)) memory;
+    return loop;
+}
+
+vmJitLoop *vmJit::Loop (std::vector<vmInstruction>& code, unsigned int jump, vmVariables& variables) {
+    if (jump >= m_loops.size ()) {
+        m_loops.resize (code.size (), NULL);
+        m_counts.resize (code.size (), 0);
+    }
+
+    // Already compiled?
+    vmJitLoop *loop = m_loops [jump];
+    if (loop != NULL)
+        return loop != &notCompilable ? loop : NULL;
+
+    // Compile once hot
+    if (++m_counts [jump] < VM_JITTHRESHOLD)
+        return NULL;
+    loop = Compile (code, jump, variables);
+    m_loops [jump] = loop != NULL ? loop : &notCompilable;
+    return loop;
+}
+
+void vmJit::Invalidate (unsigned int offset) {
+
+    // Loops run from their head to their backward jump, so a loop contains
+    // the offset if its jump is at or after it
+    for (unsigned int i = offset; i < m_loops.size (); i++) {
+        vmJitLoop *loop = m_loops [i];
+        if (loop != NULL && loop != &notCompilable) {
+            munmap (loop->m_code, loop->m_size);
+            delete loop;
+        }
+    }
+    if (offset < m_loops.size ()) {
+        m_loops.resize (offset);
+        m_counts.resize (offset);
+    }
+}
+
+#endif
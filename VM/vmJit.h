@@ -0,0 +1,90 @@
+//---------------------------------------------------------------------------
+/*  Native loop compiler.
+
+    Compiles frequently executed loops into native x86-64 code.
+*/
+
+#ifndef vmJitH
+#define vmJitH
+//---------------------------------------------------------------------------
+
+#include "vmCode.h"
+#include "vmVariables.h"
+
+// Native code is only generated for x86-64 with GCC compatible compilers on
+// POSIX systems (executable memory is allocated with mmap). Define VM_NO_JIT
+// to disable it altogether.
+#if defined (__GNUC__) && defined (__x86_64__) && !defined (_WIN32) && !defined (VM_NO_JIT)
+#define VM_JIT
+#endif
+
+#ifdef VM_JIT
+
+#define VM_JITTHRESHOLD     100         // Number of times a loop must run before it is compiled
+#define VM_JITMAXSTACK      64          // Maximum values pushed to the stack inside a compiled loop
+#define VM_JITMAXLENGTH     4096        // Maximum loop length (instructions)
+
+////////////////////////////////////////////////////////////////////////////////
+// vmJitContext
+//
+// Virtual machine state passed to and from native code.
+
+struct vmJitContext {
+    vmValue         reg, reg2;                  // Registers
+    int             steps;                      // IN: Steps allowed. OUT: Steps remaining
+    unsigned int    ip;                         // OUT: Instruction to continue from
+    int             stackSize;                  // OUT: Number of values in stack
+    vmValue         *data;                      // Variable data
+    vmValue         *regFile;                   // Register machine register file
+    vmValue         stack [VM_JITMAXSTACK];     // Values pushed inside the loop
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// vmJitLoop
+//
+// A compiled loop.
+// The loop starts at the destination of a backward OP_JUMP and ends at the
+// jump itself. Native code returns to the interpreter when execution leaves
+// the loop, reaches an instruction that is not compiled (function calls,
+// strings, breakpoints e.t.c), reaches an instruction that would raise a
+// runtime error, or when the step budget runs out. The interpreter then
+// continues from that instruction.
+
+struct vmJitLoop {
+    void            *m_code;
+    unsigned int    m_size;
+    void (*m_entry) (vmJitContext *context);
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// vmJit
+//
+// Tracks how often each loop runs, and compiles the hot ones.
+
+class vmJit {
+    std::vector<vmJitLoop *>    m_loops;        // Compiled loop for each backward jump (indexed by jump offset)
+    std::vector<unsigned int>   m_counts;       // Number of times each backward jump has been taken
+
+    vmJitLoop *Compile (std::vector<vmInstruction>& code, unsigned int jump, vmVariables& variables);
+
+    // Not copyable (owns executable memory)
+    vmJit (const vmJit& j);
+    vmJit& operator= (const vmJit& j);
+
+public:
+    vmJit () { ; }
+    ~vmJit () { Clear (); }
+
+    // Called each time the backward jump at offset "jump" is taken.
+    // Returns the compiled loop, or NULL if it is not compiled (yet).
+    vmJitLoop *Loop (std::vector<vmInstruction>& code, unsigned int jump, vmVariables& variables);
+
+    // Discard loops containing instructions from offset onwards
+    void Invalidate (unsigned int offset);
+
+    // Discard all loops
+    void Clear () { Invalidate (0); m_counts.clear (); }
+};
+
+#endif
+#endif
@@ -0,0 +1,190 @@
+//---------------------------------------------------------------------------
+/*  Peephole optimiser.
+
+    Replaces common instruction sequences with single "superinstructions",
+    to reduce the number of instructions dispatched at runtime.
+*/
+
+
+#pragma hdrstop
+
+#include "vmPeephole.h"
+
+//---------------------------------------------------------------------------
+
+#ifndef _MSC_VER
+#pragma package(smart_init)
+#endif
+
+static bool IsNumeric (const vmInstruction& i) {
+    return i.m_type == VTP_INT || i.m_type == VTP_REAL;
+}
+
+static vmOpCode PopOpCode (vmOpCode code) {
+
+    // Return the POP + operation superinstruction for a type specialised
+    // operation, or OP_NOP if there isn't one
+    switch (code) {
+    case OP_OP_PLUS_INT:            return OP_POP_PLUS_INT;
+    case OP_OP_PLUS_REAL:           return OP_POP_PLUS_REAL;
+    case OP_OP_PLUS_STRING:         return OP_POP_PLUS_STRING;
+    case OP_OP_MINUS_INT:           return OP_POP_MINUS_INT;
+    case OP_OP_MINUS_REAL:          return OP_POP_MINUS_REAL;
+    case OP_OP_TIMES_INT:           return OP_POP_TIMES_INT;
+    case OP_OP_TIMES_REAL:          return OP_POP_TIMES_REAL;
+    case OP_OP_DIV_INT:             return OP_POP_DIV_INT;
+    case OP_OP_DIV_REAL:            return OP_POP_DIV_REAL;
+    case OP_OP_MOD_INT:             return OP_POP_MOD_INT;
+    case OP_OP_EQUAL_INT:           return OP_POP_EQUAL_INT;
+    case OP_OP_EQUAL_REAL:          return OP_POP_EQUAL_REAL;
+    case OP_OP_NOT_EQUAL_INT:       return OP_POP_NOT_EQUAL_INT;
+    case OP_OP_NOT_EQUAL_REAL:      return OP_POP_NOT_EQUAL_REAL;
+    case OP_OP_GREATER_INT:         return OP_POP_GREATER_INT;
+    case OP_OP_GREATER_REAL:        return OP_POP_GREATER_REAL;
+    case OP_OP_GREATER_EQUAL_INT:   return OP_POP_GREATER_EQUAL_INT;
+    case OP_OP_GREATER_EQUAL_REAL:  return OP_POP_GREATER_EQUAL_REAL;
+    case OP_OP_LESS_INT:            return OP_POP_LESS_INT;
+    case OP_OP_LESS_REAL:           return OP_POP_LESS_REAL;
+    case OP_OP_LESS_EQUAL_INT:      return OP_POP_LESS_EQUAL_INT;
+    case OP_OP_LESS_EQUAL_REAL:     return OP_POP_LESS_EQUAL_REAL;
+    case OP_OP_AND:                 return OP_POP_AND;
+    case OP_OP_OR:                  return OP_POP_OR;
+    case OP_OP_XOR:                 return OP_POP_XOR;
+    default:                        return OP_NOP;
+    }
+}
+
+static vmOpCode PopJumpFalseOpCode (vmOpCode code) {
+
+    // Return the POP + compare + JUMP_FALSE superinstruction for a type
+    // specialised comparison, or OP_NOP if there isn't one.
+    // Note: Integer and real comparisons are declared in the same order as
+    // the POP + compare superinstructions.
+    if (code >= OP_POP_EQUAL_INT && code <= OP_POP_LESS_EQUAL_REAL)
+        return (vmOpCode) (OP_POP_EQUAL_INT_JUMP_FALSE + (code - OP_POP_EQUAL_INT));
+    return OP_NOP;
+}
+
+void vmFuseInstructions (   std::vector<vmInstruction>& code,
+                            vmLineTable& lines,
+                            const std::vector<unsigned int>& entryPoints,
+                            std::vector<unsigned int>& offsetMap) {
+    unsigned int size = code.size (), i;
+
+    // Find instructions that execution can jump to. These must remain at the
+    // start of an instruction sequence.
+    std::vector<bool> isEntry (size + 1, false);
+    for (i = 0; i < entryPoints.size (); i++)
+        if (entryPoints [i] <= size)
+            isEntry [entryPoints [i]] = true;
+    for (i = 0; i < size; i++) {
+        vmOpCode op = (vmOpCode) code [i].m_opCode;
+        if (vmIsJump (op) && code [i].m_value.IntVal () >= 0 && code [i].m_value.IntVal () <= (vmInt) size)
+            isEntry [code [i].m_value.IntVal ()] = true;
+        if (op == OP_CALL)
+            isEntry [i + 1] = true;                 // Return address
+    }
+
+    // Fused instructions must be on the same source line
+    std::vector<unsigned int> instrLines;
+    lines.InstructionLines (size, instrLines);
+
+    // Fuse instructions
+    std::vector<vmInstruction> result;
+    result.reserve (size);
+    offsetMap.resize (size + 1);
+    i = 0;
+    while (i < size) {
+        vmInstruction instr = code [i];
+
+        // Find number of following instructions that can be fused with this one
+        unsigned int available = 1;
+        while (     i + available < size
+                &&  available < 3
+                &&  !isEntry [i + available]
+                &&  instrLines [i + available] == instrLines [i])
+            available++;
+
+        vmOpCode op1 = available > 1 ? (vmOpCode) code [i + 1].m_opCode : OP_NOP;
+        vmOpCode op2 = available > 2 ? (vmOpCode) code [i + 2].m_opCode : OP_NOP;
+        unsigned int length = 1;
+
+        switch (instr.m_opCode) {
+        case OP_LOAD_VAR:
+            if (op1 == OP_DEREF && IsNumeric (code [i + 1])) {
+                instr.m_type = code [i + 1].m_type;
+                if (op2 == OP_PUSH && code [i + 2].m_type != VTP_STRING) {
+                    instr.m_opCode = OP_PUSH_VAR;
+                    length = 3;
+                }
+                else {
+                    instr.m_opCode = OP_LOAD_VAR_DEREF;
+                    length = 2;
+                }
+            }
+            else if (op1 == OP_PUSH && code [i + 1].m_type != VTP_STRING) {
+                instr.m_opCode = OP_LOAD_VAR_PUSH;
+                length = 2;
+            }
+            break;
+
+        case OP_LOAD_CONST:
+            if (IsNumeric (instr) && op1 == OP_PUSH && code [i + 1].m_type != VTP_STRING) {
+                instr.m_opCode = OP_PUSH_CONST;
+                length = 2;
+            }
+            break;
+
+        case OP_POP: {
+            bool popString = instr.m_type == VTP_STRING;
+            if (op1 == OP_SAVE) {
+                if (!popString && IsNumeric (code [i + 1])) {
+                    instr.m_opCode = OP_POP_SAVE;
+                    instr.m_type   = code [i + 1].m_type;
+                    length = 2;
+                }
+            }
+            else if (op1 == OP_ARRAY_INDEX || op1 == OP_ARRAY_INDEX_UNCHECKED) {
+                if (!popString) {
+                    instr.m_opCode = op1 == OP_ARRAY_INDEX ? OP_POP_ARRAY_INDEX : OP_POP_ARRAY_INDEX_UNCHECKED;
+                    length = 2;
+                }
+            }
+            else {
+                vmOpCode fused = PopOpCode (op1);
+                if (fused != OP_NOP && popString == (fused == OP_POP_PLUS_STRING)) {
+                    instr.m_type = code [i + 1].m_type;
+                    vmOpCode jump = PopJumpFalseOpCode (fused);
+                    if (jump != OP_NOP && op2 == OP_JUMP_FALSE) {
+                        instr.m_opCode = jump;
+                        instr.m_value  = code [i + 2].m_value;
+                        length = 3;
+                    }
+                    else {
+                        instr.m_opCode = fused;
+                        length = 2;
+                    }
+                }
+            }
+            break;
+        }
+        }
+
+        // Add instruction
+        for (unsigned int j = 0; j < length; j++)
+            offsetMap [i + j] = result.size ();
+        result.push_back (instr);
+        i += length;
+    }
+    offsetMap [size] = result.size ();
+
+    // Update jump destinations
+    for (i = 0; i < result.size (); i++) {
+        vmValue& dest = result [i].m_value;
+        if (vmIsJump ((vmOpCode) result [i].m_opCode) && dest.IntVal () >= 0 && dest.IntVal () <= (vmInt) size)
+            dest.IntVal () = offsetMap [dest.IntVal ()];
+    }
+
+    code.swap (result);
+    lines.Remap (offsetMap);
+}
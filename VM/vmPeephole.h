@@ -0,0 +1,31 @@
+//---------------------------------------------------------------------------
+/*  Peephole optimiser.
+
+    Replaces common instruction sequences with single "superinstructions",
+    to reduce the number of instructions dispatched at runtime.
+*/
+
+#ifndef vmPeepholeH
+#define vmPeepholeH
+//---------------------------------------------------------------------------
+
+#include "vmCode.h"
+
+// Fuse instruction sequences in code.
+//
+// entryPoints lists any additional offsets (besides jump and call
+// destinations) that execution can start from, such as program labels.
+// Sequences are never fused across an entry point, or across source lines
+// (so that breakpoints and stepping still work).
+//
+// On return offsetMap [i] is the new offset of the instruction that was at
+// offset i. (Instructions fused into a superinstruction map to the
+// superinstruction.) offsetMap [code.size ()] maps the end of the program.
+// Jump and call destinations in the code, and the source positions in lines,
+// are updated automatically.
+void vmFuseInstructions (   std::vector<vmInstruction>& code,
+                            vmLineTable& lines,
+                            const std::vector<unsigned int>& entryPoints,
+                            std::vector<unsigned int>& offsetMap);
+
+#endif
@@ -43,6 +43,70 @@ std::string UpperCase (std::string str) {
     return str;
 }
 
+////////////////////////////////////////////////////////////////////////////////
+// vmNameIndex
+
+unsigned int vmNameIndex::Hash (const std::string& name, int scope) {
+
+    // FNV-1a hash of lower case name and scope
+    unsigned int hash = 2166136261u ^ (unsigned int) scope;
+    for (unsigned int i = 0; i < name.length (); i++)
+        hash = (hash ^ (unsigned char) tolower (name [i])) * 16777619u;
+    return hash;
+}
+
+int vmNameIndex::Slot (const std::string& name, int scope) {
+    assert (!m_table.empty ());
+
+    // Find the table slot holding name, or the empty slot where it belongs.
+    // (Linear probing.)
+    unsigned int mask = m_table.size () - 1;
+    unsigned int slot = Hash (name, scope) & mask;
+    for (; m_table [slot] != 0; slot = (slot + 1) & mask) {
+        Entry& entry = m_entries [m_table [slot] - 1];
+        if (entry.m_scope != scope || entry.m_name.length () != name.length ())
+            continue;
+        unsigned int i;
+        for (i = 0; i < name.length () && entry.m_name [i] == tolower (name [i]); i++)
+            ;
+        if (i == name.length ())
+            break;
+    }
+    return slot;
+}
+
+void vmNameIndex::Add (const std::string& name, int index, int scope) {
+
+    // Keep table at most half full
+    if ((m_entries.size () + 1) * 2 > m_table.size ()) {
+        m_table.assign (m_table.empty () ? 64 : m_table.size () * 2, 0);
+        for (unsigned int i = 0; i < m_entries.size (); i++)
+            m_table [Slot (m_entries [i].m_name, m_entries [i].m_scope)] = i + 1;
+    }
+
+    // Add entry, unless already present
+    int slot = Slot (name, scope);
+    if (m_table [slot] != 0)
+        return;
+    Entry entry;
+    entry.m_name    = LowerCase (name);
+    entry.m_scope   = scope;
+    entry.m_index   = index;
+    m_entries.push_back (entry);
+    m_table [slot] = m_entries.size ();
+}
+
+void vmNameIndex::Truncate (int index) {
+
+    // Rebuild index from entries before index
+    std::vector<Entry> entries;
+    entries.swap (m_entries);
+    m_table.clear ();
+    for (unsigned int i = 0; i < entries.size (); i++)
+        if (entries [i].m_index < index)
+            Add (entries [i].m_name, entries [i].m_index, entries [i].m_scope);
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 // vmValType
 
@@ -128,6 +192,19 @@ bool vmValType::Equals (const vmValType& t) {
     return true;
 }
 
+unsigned int vmValType::Hash () {
+
+    // Hash the fields that Equals compares
+    unsigned int hash = 2166136261u;
+    hash = (hash ^ (unsigned int) m_basicType)  * 16777619u;
+    hash = (hash ^ m_arrayLevel)                * 16777619u;
+    hash = (hash ^ m_pointerLevel)              * 16777619u;
+    if (m_pointerLevel == 0)
+        for (int i = 0; i < m_arrayLevel; i++)
+            hash = (hash ^ m_arrayDims [i])     * 16777619u;
+    return hash;
+}
+
 bool vmValType::ExactEquals (const vmValType& t) {
 
     // Equals returns true if the types are identical in implementation.
@@ -175,25 +252,30 @@ void vmValType::StreamIn (std::istream& stream) {
 // vmTypeLibrary
 
 int vmTypeLibrary::GetStruc (std::string name) {
-    name = LowerCase (name);
-    for (int i = 0; i < m_structures.size (); i++) {
-        if (m_structures [i].m_name == name)
-            return i;
-    }
-    return -1;
+    return m_strucIndex.Find (name);
 }
 
 int vmTypeLibrary::GetField (vmStructure& struc, std::string fieldName) {
-    fieldName = LowerCase (fieldName);
-    for (   int i = struc.m_firstField;
-            i < struc.m_firstField + struc.m_fieldCount;
-            i++) {
-        assert (i >= 0);
-        assert (i < m_fields.size ());
-        if (m_fields [i].m_name == fieldName)
-            return i;
+
+    // Fields are indexed by their structure's first field. (A structure with
+    // no fields can share this with the next structure, so the field must be
+    // checked to be in range.)
+    int i = m_fieldIndex.Find (fieldName, struc.m_firstField);
+    if (i < struc.m_firstField || i >= struc.m_firstField + struc.m_fieldCount)
+        return -1;
+    assert (i < (int) m_fields.size ());
+    return i;
+}
+
+void vmTypeLibrary::BuildIndices () {
+    m_strucIndex.Clear ();
+    m_fieldIndex.Clear ();
+    for (unsigned int i = 0; i < m_structures.size (); i++) {
+        vmStructure& s = m_structures [i];
+        m_strucIndex.Add (s.m_name, i);
+        for (int j = s.m_firstField; j < s.m_firstField + s.m_fieldCount; j++)
+            m_fieldIndex.Add (m_fields [j].m_name, j, s.m_firstField);
     }
-    return -1;
 }
  
 int vmTypeLibrary::DataSize (vmValType& type) {
@@ -202,9 +284,9 @@ int vmTypeLibrary::DataSize (vmValType& type) {
     if (type.PhysicalPointerLevel () > 0)       // Pointers are always one element long
         return 1;
 
-    if (type.m_arrayLevel > 0)      {            // Calculate array size
+    if (type.m_arrayLevel > 0)      {            // Calculate array size
 	vmValType vt(type.m_basicType);
-        return type.ArraySize (DataSize (vt));
+        return type.ArraySize (DataSize (vt));
     }
 
     if (type.m_basicType >= 0) {
@@ -307,6 +389,8 @@ void vmTypeLibrary::StreamIn (std::istream& stream) {
     m_structures.resize (count);
     for (i = 0; i < count; i++)
         m_structures [i].StreamIn (stream);
+
+    BuildIndices ();
 }
 #endif
 
@@ -319,17 +403,43 @@ int vmValTypeSet::GetIndex (vmValType& type) {
     // If type is not present, create a new one and return an index to that.
 
     // Look for type
-    int i;
-    for (i = 0; i < m_types.size (); i++)
-        if (m_types [i].Equals (type))
-            return i;
+    if (m_table.empty ())
+        BuildTable ();
+    int slot = Slot (type);
+    if (m_table [slot] != 0)
+        return m_table [slot] - 1;
 
     // Otherwise create new one
-    i = m_types.size ();
+    int i = m_types.size ();
     m_types.push_back (type);
+    m_table [slot] = i + 1;
+    if (m_types.size () * 2 > m_table.size ())
+        BuildTable ();
     return i;
 }
 
+int vmValTypeSet::Slot (vmValType& type) {
+
+    // Find the table slot holding type, or the empty slot where it belongs
+    unsigned int mask = m_table.size () - 1;
+    unsigned int slot = type.Hash () & mask;
+    while (m_table [slot] != 0 && !m_types [m_table [slot] - 1].Equals (type))
+        slot = (slot + 1) & mask;
+    return slot;
+}
+
+void vmValTypeSet::BuildTable () {
+    unsigned int size = 64;
+    while (size < m_types.size () * 2 + 2)
+        size *= 2;
+    m_table.assign (size, 0);
+    for (unsigned int i = 0; i < m_types.size (); i++) {
+        int slot = Slot (m_types [i]);
+        if (m_table [slot] == 0)
+            m_table [slot] = i + 1;
+    }
+}
+
 #ifdef VM_STATE_STREAMING
 void vmValTypeSet::StreamOut (std::ostream& stream) {
     WriteLong (stream, m_types.size ());
@@ -342,6 +452,7 @@ void vmValTypeSet::StreamIn (std::istream& stream) {
     m_types.resize (count);
     for (int i = 0; i < count; i++)
         m_types [i].StreamIn (stream);
+    m_table.clear ();
 }
 #endif
 
@@ -379,6 +490,7 @@ void vmStructure::StreamOut (std::ostream& stream) {
     WriteLong (stream, m_dataSize);
     WriteByte (stream, m_containsString);
     WriteByte (stream, m_containsArray);
+    WriteByte (stream, m_fieldMajor);
 }
 
 void vmStructure::StreamIn (std::istream& stream) {
@@ -390,5 +502,6 @@ void vmStructure::StreamIn (std::istream& stream) {
     m_dataSize          = ReadLong (stream);
     m_containsString    = ReadByte (stream);
     m_containsArray     = ReadByte (stream);
+    m_fieldMajor        = ReadByte (stream);
 }
 #endif
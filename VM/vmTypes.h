@@ -40,6 +40,7 @@
 
 // Constants
 #define VM_MAXDIMENSIONS 10         // Maximum dimensions in an array
+#define VM_MAXFIELDMAJORFIELDS 8192 // Maximum fields in a field major structure
 
 // Basic supported variable types
 typedef std::string     vmString;
@@ -103,6 +104,41 @@ inline vmReal StringToReal (std::string& s)  {
 std::string LowerCase (std::string str);
 std::string UpperCase (std::string str);
 
+////////////////////////////////////////////////////////////////////////////////
+// vmNameIndex
+//
+// Hash index from names to positions in an array (e.g. of variables or
+// structures), so that names can be found without a linear search.
+// Names are case insensitive. Each name belongs to a scope (e.g. the structure
+// that a field belongs to), so the same name can be indexed once per scope.
+
+class vmNameIndex {
+    struct Entry {
+        std::string     m_name;             // (Lower case)
+        int             m_scope;
+        int             m_index;
+    };
+    std::vector<Entry>  m_entries;
+    std::vector<int>    m_table;            // Hash table of entry + 1. (0 = empty)
+    static unsigned int Hash (const std::string& name, int scope);
+    int Slot (const std::string& name, int scope);
+public:
+    void Clear () {
+        m_entries.clear ();
+        m_table.clear ();
+    }
+    int Find (const std::string& name, int scope = 0) {     // Returns -1 if not found
+        if (m_table.empty ())
+            return -1;
+        int entry = m_table [Slot (name, scope)];
+        return entry > 0 ? m_entries [entry - 1].m_index : -1;
+    }
+    void Add (const std::string& name, int index, int scope = 0);
+        // Note: If the name is already indexed in this scope, the existing
+        // index is kept. (Matching a linear search for the first occurrence.)
+    void Truncate (int index);              // Remove names of positions from index onwards
+};
+
 ////////////////////////////////////////////////////////////////////////////////
 // vmValType
 //
@@ -158,6 +194,7 @@ public:
     bool Equals (const vmBasicValType t) { return Equals (vmValType (t)); }
     bool ExactEquals (const vmValType& t);
     bool ExactEquals (const vmBasicValType t) { return ExactEquals (vmValType (t)); }
+    unsigned int Hash ();                   // Hash consistent with Equals
     bool IsNull () { return m_basicType == VTP_NULL; }
     int PhysicalPointerLevel () const { return m_pointerLevel; }
     int VirtualPointerLevel  () const { return m_pointerLevel + (m_byRef ? -1 : 0); }
@@ -197,6 +234,12 @@ public:
 // Struc
 //  dim angle#, names$ (100), x, y
 // EndStruc
+//
+// Arrays of a "field major" structure store each field in its own column,
+// i.e. element i's field at offset k is at array + 2 + k * elements + i.
+// Loops that touch one field across many elements then read dense memory.
+// Fields must be single values (basic types or pointers), and elements can
+// only be accessed one field at a time.
 
 struct vmStructureField {
     std::string m_name;                 // Field name
@@ -227,6 +270,7 @@ struct vmStructure {
     int         m_dataSize;             // Size of data
     bool        m_containsString;       // Contains one or more strings. (Requires special handling when copying data.)
     bool        m_containsArray;        // Contains one or more arrays.  (Requires special handling when allocating data.)
+    bool        m_fieldMajor;           // Arrays of structure are stored field major
 
     vmStructure (std::string& name, int firstField = 0) {
         m_name          = LowerCase (name);
@@ -235,6 +279,7 @@ struct vmStructure {
         m_dataSize      = 0;
         m_containsString    = false;
         m_containsArray     = false;
+        m_fieldMajor        = false;
     }
 
 #ifdef VM_STATE_STREAMING
@@ -252,6 +297,9 @@ struct vmStructure {
 class vmTypeLibrary {
     std::vector<vmStructureField>   m_fields;
     std::vector<vmStructure>        m_structures;
+    vmNameIndex                     m_strucIndex;       // Structure names
+    vmNameIndex                     m_fieldIndex;       // Field names. Scope is the structure's first field
+    void BuildIndices ();
 public:
     std::vector<vmStructureField>&  Fields ()       { return m_fields; }
     std::vector<vmStructure>&       Structures ()   { return m_structures; }
@@ -259,6 +307,19 @@ public:
     void Clear () {
         m_fields.clear ();
         m_structures.clear ();
+        m_strucIndex.Clear ();
+        m_fieldIndex.Clear ();
+    }
+    void Truncate (int strucCount, int fieldCount) {
+
+        // Remove structures and fields declared after the first strucCount
+        // structures and fieldCount fields
+        assert (strucCount >= 0 && strucCount <= (int) m_structures.size ());
+        assert (fieldCount >= 0 && fieldCount <= (int) m_fields.size ());
+        m_structures.erase (m_structures.begin () + strucCount, m_structures.end ());
+        m_fields.erase (m_fields.begin () + fieldCount, m_fields.end ());
+        m_strucIndex.Truncate (strucCount);
+        m_fieldIndex.Truncate (fieldCount);
     }
 
     // Finding structures and fields
@@ -291,6 +352,14 @@ public:
                 && (    type.m_arrayLevel > 0                                                       // Can be an array
                     ||  (type.m_basicType >= 0 && m_structures [type.m_basicType].m_containsArray));// or a structure containing an array
     }
+    bool FieldMajorArray (vmValType& type) {
+        assert (TypeValid (type));
+
+        // True if type is a (1 dimensional) array of field major structures
+        return      type.m_arrayLevel == 1
+                &&  type.m_basicType >= 0
+                &&  m_structures [type.m_basicType].m_fieldMajor;
+    }
 
     // Building structures
     vmStructure& CurrentStruc () {
@@ -309,6 +378,7 @@ public:
 
         // Create new structure
         m_structures.push_back (vmStructure (name, m_fields.size ()));
+        m_strucIndex.Add (name, m_structures.size () - 1);
         return CurrentStruc ();
     }
     vmStructureField& NewField (std::string& name, vmValType& type) {        // Create a new field and assign it to the current structure
@@ -325,8 +395,13 @@ public:
                 ||  type.m_basicType < 0
                 ||  type.m_basicType + 1 < m_structures.size ());
 
+        // Field major structure fields are single values
+        assert (!CurrentStruc ().m_fieldMajor || DataSize (type) == 1);
+        assert (!CurrentStruc ().m_fieldMajor || CurrentStruc ().m_fieldCount < VM_MAXFIELDMAJORFIELDS);
+
         // Create new field
         m_fields.push_back (vmStructureField (name, type, CurrentStruc ().m_dataSize));
+        m_fieldIndex.Add (name, m_fields.size () - 1, CurrentStruc ().m_firstField);
         CurrentStruc ().m_fieldCount++;
         CurrentStruc ().m_dataSize += DataSize (CurrentField ().m_type);
 
@@ -356,9 +431,18 @@ public:
 // type, so instead they specify an index into this set array.
 class vmValTypeSet {
     std::vector<vmValType> m_types;
+    std::vector<int>       m_table;         // Hash table of type index + 1. (0 = empty)
+    int Slot (vmValType& type);
+    void BuildTable ();
 public:
-    void Clear () { m_types.clear (); }
+    void Clear () { m_types.clear (); m_table.clear (); }
     int GetIndex (vmValType& type);
+    int Size () { return m_types.size (); }
+    void Truncate (int size) {
+        assert (size >= 0 && size <= Size ());
+        m_types.erase (m_types.begin () + size, m_types.end ());
+        m_table.clear ();                   // (Rebuilt by GetIndex)
+    }
     vmValType& GetValType (int index) {
         assert (index >= 0);
         assert (index < m_types.size ());
@@ -20,6 +20,8 @@ void vmVariable::Allocate (vmData& data, vmTypeLibrary& typeLib) {
     // Allocate new data
     assert (!Allocated ());
     m_dataIndex = data.Allocate (typeLib.DataSize (m_type));
+    if (m_dataIndex == 0)
+        return;                                     // Out of memory. (Variable remains unallocated.)
 
     // Initialise it
     data.InitData (m_dataIndex, m_type, typeLib);
@@ -45,14 +47,6 @@ void vmVariable::StreamIn (std::istream& stream) {
 
 ////////////////////////////////////////////////////////////////////////////////
 // vmVariables
-int vmVariables::GetVar (std::string name) {
-    name = LowerCase (name);
-    for (int i = 0; i < m_variables.size (); i++)
-        if (m_variables [i].m_name == name)
-            return i;
-    return -1;
-}
-
 #ifdef VM_STATE_STREAMING
 void vmVariables::StreamOut (std::ostream& stream) {
 
@@ -73,7 +67,10 @@ void vmVariables::StreamIn (std::istream& stream) {
     // Stream in variables
     long count = ReadLong (stream);
     m_variables.resize (count);
-    for (int i = 0; i < count; i++)
+    m_index.Clear ();
+    for (int i = 0; i < count; i++) {
         m_variables [i].StreamIn (stream);
+        m_index.Add (m_variables [i].m_name, i);
+    }
 }
 #endif
@@ -59,6 +59,7 @@ class vmVariables {
     vmVariableArray m_variables;            // Variables
     vmData&         m_data;                 // Data
     vmTypeLibrary&  m_types;                // Type information
+    vmNameIndex     m_index;                // Variable names
 public:
     vmVariables (vmData& data, vmTypeLibrary& types)
         : m_data (data), m_types (types) { ; }
@@ -82,12 +83,13 @@ public:
         // Deallocate everything.
         // No variables, data or type information remains
         m_variables.clear ();
+        m_index.Clear ();
         m_data.Clear ();
         m_types.Clear ();
     }
 
     // Finding variables
-    int GetVar (std::string name);
+    int GetVar (const std::string& name) { return m_index.Find (name); }
     bool VarStored (std::string& name)  { return GetVar (name) >= 0; }
     int Size ()                         { return m_variables.size (); }
     bool IndexValid (int index)         { return index >= 0 && index < Size (); }
@@ -99,8 +101,16 @@ public:
         // Allocate new variable and return index
         int top = m_variables.size ();
         m_variables.push_back (vmVariable (name, type));
+        m_index.Add (name, top);
         return top;
     }
+    void Truncate (int count) {
+
+        // Remove variables created after the first count variables
+        assert (count >= 0 && count <= Size ());
+        m_variables.erase (m_variables.begin () + count, m_variables.end ());
+        m_index.Truncate (count);
+    }
     void AllocateVar (vmVariable& var) {
         var.Allocate (m_data, m_types);
     }